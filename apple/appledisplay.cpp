@@ -40,30 +40,48 @@
     }                               \
 }
 
-#define drawApplePixel(c,x,y) { g_display->cacheDoubleWidePixel(x,y,c); }
-
-#define draw2Pixels(cA, cB, x, y) { g_display->cache2DoubleWidePixels(x,y,cA, cB); }
-
-#define DrawLoresPixelAt(c, x, y) {     \
-  uint8_t pixel = c & 0x0F;             \
-  for (uint8_t y2 = 0; y2<4; y2++) {    \
-    for (int8_t x2 = 6; x2>=0; x2--) {  \
-      drawApplePixel(pixel, x*7+x2, y*8+y2); \
-    }                                   \
-  }                                     \
-  pixel = (c >> 4);                     \
-  for (uint8_t y2 = 4; y2<8; y2++) {    \
-    for (int8_t x2 = 6; x2>=0; x2--) {  \
-      drawApplePixel(pixel, x*7+x2, y*8+y2); \
-    }                                   \
-  }                                     \
+// Each lores byte is two 7x4 blocks: the low nybble on top
+#define DrawLoresPixelAt(c, x, y) {                                 \
+  g_display->cacheDoubleWideFill((x)*7, (y)*8,   7, 4, (c) & 0x0F); \
+  g_display->cacheDoubleWideFill((x)*7, (y)*8+4, 7, 4, (c) >> 4);   \
 }
 
 #include "globals.h"
 
+static void vblEvent(void *obj, uint8_t event, uint64_t when)
+{
+  ((AppleDisplay *)obj)->verticalBlank();
+  g_scheduler.schedule(EVT_VBL, when + FRAMECYCLES);
+}
+
 AppleDisplay::AppleDisplay() : VMDisplay()
 {
+  static bool tablesBuilt = false;
+  if (!tablesBuilt) {
+    buildHiresTables();
+    buildGlyphCache();
+    tablesBuilt = true;
+  }
+
   this->switches = NULL;
+  lastSwitches = 0;
+  drawSwitches = 0;
+  vblCount = 0;
+  modeGeneration = 0;
+  shownGeneration = 0;
+  flashPhase = 0;
+  flashRows = 0;
+  memset(textShown, NOGLYPH, sizeof(textShown));
+
+#ifdef FRAMESNAPSHOT
+  memset(frames, 0, sizeof(frames));
+  memset(&shown, 0, sizeof(shown));
+  frame = &frames[frameQueue.readIndex()];
+  videoTouched = true;
+  lastFrameSwitches = 0;
+#endif
+
+  g_scheduler.setHandler(EVT_VBL, vblEvent, this);
 
   modeChange();
 }
@@ -111,8 +129,8 @@ bool AppleDisplay::deinterlaceHiresAddress(uint16_t address, uint8_t *row, uint1
   // for each 8-pixel tall group.
 
   // There are 8 bytes at the end of each run that we ignore. Skip them.
-  if ((address & 0x07f) >= 0x78 &&
-      (address & 0x7f) <= 0x7f) {
+  uint8_t offset = address & 0x7f;
+  if (offset >= 0x78) {
     *row = 255;
     *col = 65535;
     return false;
@@ -120,384 +138,528 @@ bool AppleDisplay::deinterlaceHiresAddress(uint16_t address, uint8_t *row, uint1
 
   *row = ((address & 0x380) >> 4) +
     ((address & 0x1c00)>>10) + 
-    64 * ((address & 0x7f) / 40);
+    hiresRunRow[offset];
 
-  *col = ((address & 0x7f) % 40) * 7;
+  *col = hiresRunCol[offset];
 
   return true;
 }
 
-// return a pointer to the right glyph, and set *invert appropriately
-const unsigned char *AppleDisplay::xlateChar(uint8_t c, bool *invert)
+// Where each character picture lives in glyphs[]
+#define UCASEGLYPH(i, inverse) ((i) * 2 + (inverse))
+#define LCASEGLYPH(i, inverse) (128 + (i) * 2 + (inverse))
+#define MOUSETEXTGLYPH(i) (192 + (i))
+
+uint8_t AppleDisplay::glyphs[GLYPHCOUNT][8][7];
+uint8_t AppleDisplay::glyphIndex[2][2][256];
+
+// return the glyph that character 'c' shows as. Flashing characters
+// are inverse in flash phase 0 and normal in phase 1.
+uint8_t AppleDisplay::xlateChar(uint8_t c, bool altCharset, uint8_t flashPhase)
 {
   if (c <= 0x3F) {
     // 0-3f: inverted @ABCDEFGHIJKLMNOPQRSTUVWXYZ[\]^_ !"#$%&'()*+,-./0123456789:;<=>?
     // (same w/o mousetext, actually)
-    *invert = true;
-    return &ucase_glyphs[c * 8];
+    return UCASEGLYPH(c, 1);
   } else if (c <= 0x5F) {
     // 40-5f: normal mousetext
     // (these are flashing @ABCDEFG..[\]^_ when not in mousetext mode)
-    if ((*switches) & S_ALTCH) {
-      *invert = false;
-      return &mousetext_glyphs[(c - 0x40) * 8];
+    if (altCharset) {
+      return MOUSETEXTGLYPH(c - 0x40);
     } else {
-      *invert = true;
-      return &ucase_glyphs[(c - 0x40) * 8];
+      return UCASEGLYPH(c - 0x40, !flashPhase);
     }
   } else if (c <= 0x7F) {
     // 60-7f: inverted   `abcdefghijklmnopqrstuvwxyz{|}~*
     // (these are flashing (sp)!"#$%...<=>? when not in mousetext)
-    if ((*switches) & S_ALTCH) {
-      *invert = true;
-      return &lcase_glyphs[(c - 0x60) * 8];
+    if (altCharset) {
+      return LCASEGLYPH(c - 0x60, 1);
     } else {
-      *invert = true;
-      return &ucase_glyphs[((c-0x60) + 0x20) * 8];
+      return UCASEGLYPH((c-0x60) + 0x20, !flashPhase);
     }
   } else if (c <= 0xBF) {
     // 80-BF: normal @ABCD... <=>? in both character sets
-    *invert = false;
-    return &ucase_glyphs[(c - 0x80) * 8];
+    return UCASEGLYPH(c - 0x80, 0);
   } else if (c <= 0xDF) {
     // C0-DF: normal @ABCD...Z[\]^_ in both character sets
-    *invert = false;
-    return &ucase_glyphs[(c - 0xC0) * 8];
+    return UCASEGLYPH(c - 0xC0, 0);
   } else {
     // E0-  : normal `abcdef... in both character sets
-    *invert = false;
-    return &lcase_glyphs[(c - 0xE0) * 8];
+    return LCASEGLYPH(c - 0xE0, 0);
   }
 
   /* NOTREACHED */
 }
-  
-inline void AppleDisplay::Draw14DoubleHiresPixelsAt(uint16_t addr)
-{
-  // We will consult 4 bytes (2 in main, 2 in aux) for any single-byte
-  // write. Align to the first byte in that series based on what
-  // address we were given...
-  addr &= ~0x01;
 
-  // Figure out the position of that address on the "normal" hires screen
-  uint8_t row;
-  uint16_t col;
-  deinterlaceHiresAddress(addr, &row, &col);
-  if (row >= 160 && 
-      ((*switches) & S_MIXED)) {
-    // displaying text, so don't have to draw this line
-    return;
+// Expands every character picture out of the font once, so drawing
+// text is just copying rows of color indexes
+void AppleDisplay::buildGlyphCache()
+{
+  for (uint8_t g = 0; g < GLYPHCOUNT; g++) {
+    const unsigned char *src;
+    bool inverse = false;
+    if (g >= MOUSETEXTGLYPH(0)) {
+      src = &mousetext_glyphs[(g - MOUSETEXTGLYPH(0)) * 8];
+    } else if (g >= LCASEGLYPH(0, 0)) {
+      src = &lcase_glyphs[((g - LCASEGLYPH(0, 0)) >> 1) * 8];
+      inverse = g & 1;
+    } else {
+      src = &ucase_glyphs[(g >> 1) * 8];
+      inverse = g & 1;
+    }
+    for (uint8_t r = 0; r < 8; r++) {
+      for (uint8_t n = 0; n < 7; n++) {
+	bool set = src[r] & (1 << n);
+	glyphs[g][r][n] = (set != inverse) ? c_white : c_black;
+      }
+    }
   }
 
-  // Make sure it's a valid graphics area, not a dead hole
-  if (col <= 280 && row <= 192) {
-    // Grab the 4 bytes we care about
-    uint8_t b1A = mmu->readDirect(addr, 0);
-    uint8_t b2A = mmu->readDirect(addr+1, 0);
-    uint8_t b1B = mmu->readDirect(addr, 1);
-    uint8_t b2B = mmu->readDirect(addr+1, 1);
-
-    // Construct the 28 bit wide bitstream, like we do for the simpler 14 Hires pixel draw
-    uint32_t bitTrain = b2A & 0x7F;
-    bitTrain <<= 7;
-    bitTrain |= (b2B & 0x7F);
-    bitTrain <<= 7;
-    bitTrain |= (b1A & 0x7F);
-    bitTrain <<= 7;
-    bitTrain |= (b1B & 0x7F);
-    
-    // Now we pop groups of 4 bits off the bottom and draw.
-
-    for (int8_t xoff = 0; xoff < 14; xoff += 2) {
-      if (g_displayType == m_ntsclike) {
-	// NTSC-like color - use drawApplePixel to show the messy NTSC color bleeds.
-	// This draws two doubled pixels with greater color, but lower pixel, resolution.
-	drawApplePixel(bitTrain & 0x0F, col+xoff, row);
-	drawApplePixel(bitTrain & 0x0F, col+xoff+1,row);
-      } else {
-	// Perfect color, B&W, monochrome. Draw an exact version of the pixels, and let 
-	// the physical display figure out if they need to be reduced to B&W or not.
-
-	uint8_t color = bitTrain & 0x0F;
-	
-	g_display->cachePixel((col*2)+(xoff*2), row, 
-			      ((bitTrain & 0x01) ? color : c_black));
-	
-	g_display->cachePixel((col*2)+(xoff*2)+1, row, 
-			      ((bitTrain & 0x02) ? color : c_black));
-	
-	g_display->cachePixel((col*2)+(xoff*2)+2, row, 
-			      ((bitTrain & 0x04 )? color : c_black));
-
-	g_display->cachePixel((col*2)+(xoff*2)+3, row, 
-			      ((bitTrain & 0x08 ) ? color : c_black));
+  for (uint8_t alt = 0; alt < 2; alt++) {
+    for (uint8_t phase = 0; phase < 2; phase++) {
+      for (uint16_t c = 0; c < 256; c++) {
+	glyphIndex[alt][phase][c] = xlateChar(c, alt, phase);
       }
-
+    }
+  }
+}
+  
+inline void AppleDisplay::Draw14DoubleHiresPixelsAt(const uint8_t *mainp, const uint8_t *auxp, uint8_t row, uint16_t col)
+{
+  // We consult 4 bytes (2 in main, 2 in aux) for each pair of
+  // addresses; mainp and auxp point at the first (even) one.
+
+  // Grab the 4 bytes we care about
+  uint8_t b1A = mainp[0];
+  uint8_t b2A = mainp[1];
+  uint8_t b1B = auxp[0];
+  uint8_t b2B = auxp[1];
+
+  // Construct the 28 bit wide bitstream, like we do for the simpler 14 Hires pixel draw
+  uint32_t bitTrain = b2A & 0x7F;
+  bitTrain <<= 7;
+  bitTrain |= (b2B & 0x7F);
+  bitTrain <<= 7;
+  bitTrain |= (b1A & 0x7F);
+  bitTrain <<= 7;
+  bitTrain |= (b1B & 0x7F);
+
+  // Now we pop groups of 4 bits off the bottom and draw.
+
+  if (g_displayType == m_ntsclike) {
+    // NTSC-like color - use double-wide pixels to show the messy NTSC color bleeds.
+    // This draws two doubled pixels with greater color, but lower pixel, resolution.
+    uint8_t pixels[14];
+    for (uint8_t xoff = 0; xoff < 14; xoff += 2) {
+      pixels[xoff] = pixels[xoff+1] = bitTrain & 0x0F;
       bitTrain >>= 4;
-    } // for
-
+    }
+    g_display->cacheDoubleWideRun(col, row, pixels, 14);
+  } else {
+    // Perfect color, B&W, monochrome. Draw an exact version of the pixels, and let
+    // the physical display figure out if they need to be reduced to B&W or not.
+    uint8_t pixels[28];
+    for (uint8_t x = 0; x < 28; x += 4) {
+      const uint8_t *p = dhrPixels[bitTrain & 0x0F];
+      pixels[x] = p[0];
+      pixels[x+1] = p[1];
+      pixels[x+2] = p[2];
+      pixels[x+3] = p[3];
+      bitTrain >>= 4;
+    }
+    g_display->cacheRun(col*2, row, pixels, 28);
   }
 }
 
 
+// Draws the 14 pixels for the byte pair at p (an even address).
+// The pixel colors come straight out of hiresLowPairs[] and
+// hiresHighPairs[]; see buildHiresTables() for how they're worked out.
+inline void AppleDisplay::Draw14HiresPixelsAt(const uint8_t *p, uint8_t row, uint16_t col)
+{
+  uint8_t b1 = p[0];
+  uint8_t b2 = p[1];
+
+  uint8_t mode = (g_displayType == m_ntsclike) ? 1 : 0;
+  const uint8_t *lo = hiresLowPairs[mode][b1 | ((b2 & 0x01) << 8)];
+  const uint8_t *hi = hiresHighPairs[mode][b2];
+
+  // The second color of each entry is the one on the left
+  uint8_t pixels[14];
+  for (uint8_t i = 0; i < 4; i++) {
+    pixels[i*2] = lo[i] & 0x0F;
+    pixels[i*2+1] = lo[i] >> 4;
+  }
+  for (uint8_t i = 0; i < 3; i++) {
+    pixels[8+i*2] = hi[i] & 0x0F;
+    pixels[8+i*2+1] = hi[i] >> 4;
+  }
+  g_display->cacheDoubleWideRun(col, row, pixels, 14);
+}
+
 // Whenever we change a byte, it's possible that it will have an affect on the byte next to it - 
 // because between two bytes there is a shared bit.
 // FIXME: what happens when the high bit of the left doesn't match the right? Which high bit does 
 // the overlap bit get?
-inline void AppleDisplay::Draw14HiresPixelsAt(uint16_t addr)
+//
+// Hires bytes are drawn in pairs, two bits (one 140-pixel-wide color
+// pixel) at a time:
+/*
+  The high bit only selects the color palette.
+
+  There are only really two bits here, and they can be one of six colors.
+
+  color    highbit even    odd    restriction
+  black       x      0x80,0x00
+  green       0    0x2A    0x55    odd only
+  violet      0    0x55    0x2A    even only
+  white       x      0xFF,0x7F
+  orange      1    0xAA    0xD5    odd only
+  blue        1    0xD5    0xAA    even only
+
+  in other words, we can look at the pixels in pairs and we get
+
+  00 black
+  01 green/orange
+  10 violet/blue
+  11 white
+
+  When the horizontal byte number is even, we ignore the last
+  bit. When the horizontal byte number is odd, we use that dropped
+  bit.
+
+  So each even byte turns in to 3 bits; and each odd byte turns in
+  to 4. Our effective output is therefore 140 pixels (half the
+  actual B&W resolution).
+
+  (Note that I swap 0x02 and 0x01 below, because we're running the
+  bit train backward, so the bits are reversed.)
+*/
+//
+// The 14-bit train for a pair is b1's low 7 bits followed by b2's, so
+// the first four color pixels depend only on b1 and bit 0 of b2 (with
+// b1's palette bit), and the last three only on b2. Each table entry
+// holds the two 280-pixel-wide colors for one color pixel, as
+// (first << 4) | second; [0] is perfect color (also used for B&W and
+// monochrome), [1] is NTSC-like.
+
+uint8_t AppleDisplay::hiresLowPairs[2][512][4];
+uint8_t AppleDisplay::hiresHighPairs[2][256][3];
+uint8_t AppleDisplay::dhrPixels[16][4];
+uint8_t AppleDisplay::hiresRunRow[128];
+uint16_t AppleDisplay::hiresRunCol[128];
+
+static uint8_t hiresPairColors(uint8_t bits, bool highBitSet, bool ntsc)
 {
-  uint8_t row;
-  uint16_t col;
+  uint8_t color;
+  switch (bits & 0x03) {
+  case 0x00:
+    color = c_black;
+    break;
+  case 0x02:
+    color = (highBitSet ? c_orange : c_green);
+    break;
+  case 0x01:
+    color = (highBitSet ? c_medblue : c_purple);
+    break;
+  default:
+    color = c_white;
+    break;
+  }
 
-  deinterlaceHiresAddress(addr, &row, &col);
-  if (row >= 160 && 
-      ((*switches) & S_MIXED)) {
-    return;
+  if (ntsc) {
+    // Only 140 pixels wide: both halves are the same
+    return (color << 4) | color;
   }
 
-  if (col <= 280 && row <= 192) {
-    /*
-      The high bit only selects the color palette.
-
-      There are only really two bits here, and they can be one of six colors.
-      
-      color    highbit even    odd    restriction
-      black       x      0x80,0x00
-      green       0    0x2A    0x55    odd only
-      violet      0    0x55    0x2A    even only
-      white       x      0xFF,0x7F    
-      orange      1    0xAA    0xD5    odd only
-      blue        1    0xD5    0xAA    even only
-
-      in other words, we can look at the pixels in pairs and we get
-
-      00 black
-      01 green/orange
-      10 violet/blue
-      11 white
-
-      When the horizontal byte number is even, we ignore the last
-      bit. When the horizontal byte number is odd, we use that dropped
-      bit.
-
-      So each even byte turns in to 3 bits; and each odd byte turns in
-      to 4. Our effective output is therefore 140 pixels (half the 
-      actual B&W resolution).
-
-      (Note that I swap 0x02 and 0x01 below, because we're running the
-      bit train backward, so the bits are reversed.)
-     */
-
-    uint8_t b1 = mmu->read(addr);
-    uint8_t b2 = mmu->read(addr+1);
-
-    // Used for color modes...
-    bool highBitOne = (b1 & 0x80);
-    bool highBitTwo = (b2 & 0x80);
-
-    uint16_t bitTrain = (b1 & 0x7F) | ((b2 & 0x7F) << 7);
-
-    for (int8_t xoff = 0; xoff < 14; xoff += 2) {
-
-      if (g_displayType == m_ntsclike) {
-	// Use the NTSC-like color mode, where we're only 140 pixels wide.
-	
-	bool highBitSet = (xoff >= 7 ? highBitTwo : highBitOne);
-	uint8_t color;
-	switch (bitTrain & 0x03) {
-	case 0x00:
-	  color = c_black;
-	  break;
-	case 0x02:
-	  color = (highBitSet ? c_orange : c_green);
-	  break;
-	case 0x01:
-	  color = (highBitSet ? c_medblue : c_purple);
-	  break;
-	case 0x03:
-	  color = c_white;
-	  break;
-	}
-	
-	draw2Pixels( color, color, col+xoff, row );
-      } else {
-	// Use the "perfect" color mode, like the Apple RGB monitor showed.
-	bool highBitSet = (xoff >= 7 ? highBitTwo : highBitOne);
-	uint8_t color;
-	switch (bitTrain & 0x03) {
-	case 0x00:
-	  color = c_black;
-	  break;
-	case 0x02:
-	  color = (highBitSet ? c_orange : c_green);
-	  break;
-	case 0x01:
-	  color = (highBitSet ? c_medblue : c_purple);
-	  break;
-	case 0x03:
-	  color = c_white;
-	  break;
-	}
+  // "Perfect" color, like the Apple RGB monitor showed
+  uint8_t a = (color==c_white || (bits & 0x02)) ? color : c_black;
+  uint8_t b = (color==c_white || (bits & 0x01)) ? color : c_black;
+  return (a << 4) | b;
+}
 
-	draw2Pixels( (color==c_white || (bitTrain & 0x02)) ? color : c_black,
-		     (color==c_white || (bitTrain & 0x01)) ? color : c_black,
-		     col+xoff, row );
+void AppleDisplay::buildHiresTables()
+{
+  for (uint8_t ntsc = 0; ntsc <= 1; ntsc++) {
+    for (uint16_t i = 0; i < 512; i++) {
+      // b1, plus bit 0 of b2 as bit 7 of the train
+      uint16_t bitTrain = (i & 0x7F) | ((i & 0x100) >> 1);
+      bool highBit = (i & 0x80);
+      for (uint8_t p = 0; p < 4; p++) {
+	hiresLowPairs[ntsc][i][p] = hiresPairColors(bitTrain >> (p*2), highBit, ntsc);
+      }
+    }
+    for (uint16_t b2 = 0; b2 < 256; b2++) {
+      // bits 1-6 of b2 are bits 8-13 of the train
+      uint8_t bitTrain = (b2 & 0x7F) >> 1;
+      bool highBit = (b2 & 0x80);
+      for (uint8_t p = 0; p < 3; p++) {
+	hiresHighPairs[ntsc][b2][p] = hiresPairColors(bitTrain >> (p*2), highBit, ntsc);
       }
-      bitTrain >>= 2;
     }
   }
+
+  // Double hires, perfect color: each 4-bit color is 4 pixels wide,
+  // showing the color where its bits are set
+  for (uint8_t c = 0; c < 16; c++) {
+    for (uint8_t i = 0; i < 4; i++) {
+      dhrPixels[c][i] = (c & (1 << i)) ? c : c_black;
+    }
+  }
+
+  // Where each offset in a 128-byte hires run falls: which 64-line
+  // third of the screen, and which column. (The last 8 bytes aren't
+  // displayed.)
+  for (uint8_t i = 0; i < 128; i++) {
+    hiresRunRow[i] = 64 * (i / 40);
+    hiresRunCol[i] = (i % 40) * 7;
+  }
 }
 
-void AppleDisplay::redraw80ColumnText(uint8_t startingY)
+// The renderers read video memory straight out of VMRam - main
+// memory (bank 0) for the 40-column modes, plus aux (bank 1) for the
+// 80-column ones - rather than through the MMU, which would depend on
+// (and might change) the CPU's view of memory. Text rows and hires
+// lines never cross a 256-byte page, so one lookup covers a row.
+inline const uint8_t *AppleDisplay::videoMemory(uint16_t address, uint8_t bank)
 {
-  uint8_t row, col;
-  col = -1; // will force us to deinterlaceAddress()
-  bool invert;
-  const uint8_t *cptr;
+#ifdef FRAMESNAPSHOT
+  // ... or, with FRAMESNAPSHOT, out of the newest vertical blank copy
+  if (address >= 0x2000)
+    return &frame->hires[bank][address - 0x2000];
+  return &frame->text[bank][address - 0x400];
+#else
+  return ((AppleMMU *)mmu)->displayPage(address >> 8, bank) + (address & 0xFF);
+#endif
+}
 
-  // FIXME: is there ever a case for 0x800, like in redraw40ColumnText?
-  uint16_t start = 0x400;
-
-  // Every time through this loop, we increment the column. That's going to be correct most of the time.
-  // Sometimes we'll get beyond the end (40 columns), and wind up on another line 8 rows down.
-  // Sometimes we'll get beyond the end, and we'll wind up in unused RAM.
-  // But this is an optimization (for speed) over just calling DrawCharacter() for every one.
-  for (uint16_t addr = start; addr <= start + 0x3FF; addr++,col++) {
-    if (col > 39 || row > 23) {
-      // Could be blanking space; we'll try to re-confirm...
-      deinterlaceAddress(addr, &row, &col);      
-    }
+// Address of the first byte of text/lores row 'row' (0-23)
+static inline uint16_t textRowAddress(uint16_t start, uint8_t row)
+{
+  return start + ((row & 0x07) << 7) + (row >> 3) * 40;
+}
 
-    // Only draw onscreen locations
-    if (row >= startingY && col <= 39 && row <= 23) {
-      // Even characters are in bank 0 ram. Odd characters are in bank
-      // 1 ram. Draw to the physical display and let it figure out 
-      // whether or not there are enough physical pixels to display 
-      // the 560 columns we'd need for this.
-
-      // Draw the first of two characters
-      cptr = xlateChar(mmu->readDirect(addr, 1), &invert);
-      for (uint8_t y2 = 0; y2<8; y2++) {
-	uint8_t d = *(cptr + y2);
-	for (uint8_t x2 = 0; x2 <= 7; x2++) {
-	  uint16_t basex = (col*2)*7;
-	  bool pixelOn = (d & (1<<x2));
-	  if (pixelOn) {
-	    uint8_t val = (invert ? c_black : c_white);
-	    g_display->cachePixel(basex + x2, row*8+y2, val);
-	  } else {
-	    uint8_t val = (invert ? c_white : c_black);
-	    g_display->cachePixel(basex + x2, row*8+y2, val);
-	  }
-	}
-      }
+// Address of the first byte of hires scanline 'line' (0-191)
+static inline uint16_t hiresLineAddress(uint16_t start, uint8_t line)
+{
+  return start + ((line & 0x07) << 10) + (((line >> 3) & 0x07) << 7) + (line >> 6) * 40;
+}
 
-      // Draw the second of two characters
-      cptr = xlateChar(mmu->readDirect(addr, 0), &invert);
-      for (uint8_t y2 = 0; y2<8; y2++) {
-	uint8_t d = *(cptr + y2);
-	for (uint8_t x2 = 0; x2 <= 7; x2++) {
-	  uint16_t basex = (col*2+1)*7;
-	  bool pixelOn = (d & (1<<x2));
-	  if (pixelOn) {
-	    uint8_t val = (invert ? c_black : c_white);
-	    g_display->cachePixel(basex + x2, row*8+y2, val);
-	  } else {
-	    uint8_t val = (invert ? c_white : c_black);
-	    g_display->cachePixel(basex + x2, row*8+y2, val);
-	  }
-	}
-      }
-    }
+void AppleDisplay::redraw80ColumnText(uint8_t row)
+{
+  // FIXME: is there ever a case for 0x800, like in redraw40ColumnText?
+  uint16_t start = textRowAddress(0x400, row);
+  const uint8_t *mainp = videoMemory(start, 0);
+  const uint8_t *auxp = videoMemory(start, 1);
+
+  // Even characters are in bank 0 ram. Odd characters are in bank 1
+  // ram. Draw to the physical display and let it figure out whether
+  // or not there are enough physical pixels to display the 560
+  // columns we'd need for this.
+  uint8_t codes[80];
+  for (uint8_t col = 0; col < 40; col++) {
+    codes[col*2] = auxp[col];
+    codes[col*2+1] = mainp[col];
   }
+  drawTextCells(row, codes, 80);
 }
 
-void AppleDisplay::redraw40ColumnText(uint8_t startingY)
+void AppleDisplay::redraw40ColumnText(uint8_t row)
 {
-  bool invert;
+  const uint8_t *mainp = videoMemory(textRowAddress((drawSwitches & S_PAGE2) ? 0x800 : 0x400, row), 0);
+  drawTextCells(row, mainp, 40);
+}
 
-  uint16_t start = ((*switches) & S_PAGE2) ? 0x800 : 0x400;
-  uint8_t row, col;
-  col = -1; // will force us to deinterlaceAddress()
-  
-  // Every time through this loop, we increment the column. That's going to be correct most of the time.
-  // Sometimes we'll get beyond the end (40 columns), and wind up on another line 8 rows down.
-  // Sometimes we'll get beyond the end, and we'll wind up in unused RAM.
-  // But this is an optimization (for speed) over just calling DrawCharacter() for every one.
-  for (uint16_t addr = start; addr <= start + 0x3FF; addr++,col++) {
-    if (col > 39 || row > 23) {
-      // Could be blanking space; we'll try to re-confirm...
-      deinterlaceAddress(addr, &row, &col);      
+// Draws the cells of text row 'row' (80 or 40 'cols' of character
+// 'codes') whose glyph isn't the one already on the display. Runs of
+// changed cells go out a scanline at a time.
+void AppleDisplay::drawTextCells(uint8_t row, const uint8_t *codes, uint8_t cols)
+{
+  bool altCharset = drawSwitches & S_ALTCH;
+  const uint8_t *index = glyphIndex[altCharset][flashPhase];
+  uint8_t *shownRow = textShown[row];
+
+  uint8_t ids[80];
+  bool flashing = false;
+  for (uint8_t col = 0; col < cols; col++) {
+    ids[col] = index[codes[col]];
+    flashing |= (!altCharset && (codes[col] & 0xC0) == 0x40);
+  }
+  if (flashing) {
+    flashRows |= (1UL << row);
+  } else {
+    flashRows &= ~(1UL << row);
+  }
+
+  uint8_t col = 0;
+  while (col < cols) {
+    if (ids[col] == shownRow[col]) {
+      col++;
+      continue;
+    }
+    uint8_t first = col;
+    while (col < cols && ids[col] != shownRow[col]) {
+      shownRow[col] = ids[col];
+      col++;
     }
 
-    // Only draw onscreen locations
-    if (row >= startingY && col <= 39 && row <= 23) {
-      const uint8_t *cptr = xlateChar(mmu->read(addr), &invert);
-      
-      for (uint8_t y2 = 0; y2<8; y2++) {
-	uint8_t d = *(cptr + y2);
-	for (uint8_t x2 = 0; x2 < 7; x2++) {
-	  if (d & 1) {
-	    uint8_t val = (invert ? c_black : c_white);
-	    drawApplePixel(val, col*7+x2, row*8+y2);
-	  } else {
-	    uint8_t val = (invert ? c_white : c_black);
-	    drawApplePixel(val, col*7+x2, row*8+y2);
-	  }
-	  d >>= 1;
-	}
+    uint8_t pixels[80*7];
+    for (uint8_t y = 0; y < 8; y++) {
+      uint8_t *p = pixels;
+      for (uint8_t i = first; i < col; i++) {
+	memcpy(p, glyphs[ids[i]][y], 7);
+	p += 7;
       }
+      if (cols == 80) {
+	g_display->cacheRun(first*7, row*8+y, pixels, (col-first)*7);
+      } else {
+	g_display->cacheDoubleWideRun(first*7, row*8+y, pixels, (col-first)*7);
+      }
+    }
+
+    // The dirty rect is in 280-pixel-wide terms
+    if (cols == 80) {
+      extendDirtyRect((first*7)/2, row*8);
+      extendDirtyRect((col*7-1)/2, row*8+7);
+    } else {
+      extendDirtyRect(first*7, row*8);
+      extendDirtyRect(col*7-1, row*8+7);
     }
   }
 }
 
-void AppleDisplay::redrawHires()
+void AppleDisplay::redrawHires(uint8_t line)
 {
-  uint16_t start = ((*switches) & S_PAGE2) ? 0x4000 : 0x2000;
-  if ((*switches) & S_80STORE) {
+  uint16_t start = (drawSwitches & S_PAGE2) ? 0x4000 : 0x2000;
+  if (drawSwitches & S_80STORE) {
     // Apple IIe, technical nodes #3: 80STORE must be OFF to display Page 2
     start = 0x2000;
   }
+  start = hiresLineAddress(start, line);
+  const uint8_t *mainp = videoMemory(start, 0);
 
-  // FIXME: check MIXED & don't redraw the lower area if it's set
-  for (uint16_t addr = start; addr <= start + 0x1FFF; addr+=2) {
-    if ((*switches) & S_DHIRES) {
-      // FIXME: inline & optimize
-      Draw14DoubleHiresPixelsAt(addr);
-    } else {
-      // FIXME: inline & optimize
-      Draw14HiresPixelsAt(addr);
+  if (drawSwitches & S_DHIRES) {
+    const uint8_t *auxp = videoMemory(start, 1);
+    for (uint8_t c = 0; c < 40; c += 2) {
+      Draw14DoubleHiresPixelsAt(mainp + c, auxp + c, line, c * 7);
+    }
+  } else {
+    for (uint8_t c = 0; c < 40; c += 2) {
+      Draw14HiresPixelsAt(mainp + c, line, c * 7);
     }
   }
 }
 
-void AppleDisplay::redrawLores()
+void AppleDisplay::redrawLores(uint8_t row)
 {
-  // FIXME: can make more efficient by checking S_MIXED for lower bound
-  
-  if (((*switches) & S_80COL) && ((*switches) & S_DHIRES)) {
-    for (uint16_t addr = 0x400; addr <= 0x400 + 0x3ff; addr++) {
-      uint8_t row, col;
-      deinterlaceAddress(addr, &row, &col);
-      if (col <= 39 && row <= 23) {
-	Draw80LoresPixelAt(mmu->readDirect(addr, 0), col, row, 1);
-	Draw80LoresPixelAt(mmu->readDirect(addr, 1), col, row, 0);
-      }
+  if ((drawSwitches & S_80COL) && (drawSwitches & S_DHIRES)) {
+    uint16_t start = textRowAddress(0x400, row);
+    const uint8_t *mainp = videoMemory(start, 0);
+    const uint8_t *auxp = videoMemory(start, 1);
+    for (uint8_t col = 0; col < 40; col++) {
+      Draw80LoresPixelAt(mainp[col], col, row, 1);
+      Draw80LoresPixelAt(auxp[col], col, row, 0);
     }
   } else {
-    uint16_t start = ((*switches) & S_PAGE2) ? 0x800 : 0x400;
-    for (uint16_t addr = start; addr <= start + 0x3FF; addr++) {
-      uint8_t row, col;
-      deinterlaceAddress(addr, &row, &col);
-      if (col <= 39 && row <= 23) {
-	DrawLoresPixelAt(mmu->read(addr), col, row);
-      }
+    const uint8_t *mainp = videoMemory(textRowAddress((drawSwitches & S_PAGE2) ? 0x800 : 0x400, row), 0);
+    for (uint8_t col = 0; col < 40; col++) {
+      DrawLoresPixelAt(mainp[col], col, row);
     }
   }
 }
 
+void AppleDisplay::markTextRow(uint8_t row)
+{
+  for (uint8_t y = row * 8; y < row * 8 + 8; y++) {
+    dirtyLines[y] = true;
+  }
+}
+
+// A mode switch or page flip can change what every line shows. This
+// is checked before each write is filtered, and again before drawing,
+// so that a write to a page that wasn't showing at the time can't be
+// missed if the page is flipped back in before the next redraw.
+inline bool AppleDisplay::checkSwitches()
+{
+  if (*switches != lastSwitches) {
+    lastSwitches = *switches;
+    modeChange();
+    return true;
+  }
+  return false;
+}
+
+void AppleDisplay::writeLores(uint16_t address, uint8_t v)
+{
+#ifdef FRAMESNAPSHOT
+  // The next snapshot will pick it up; diffFrame() works out what
+  // changed
+  videoTouched = true;
+#else
+  if (checkSwitches())
+    return;
+
+  uint8_t row, col;
+  deinterlaceAddress(address, &row, &col);
+  if (col > 39 || row > 23)
+    return; // one of the "screen holes"
+
+  // Is this row showing text or lores, and not hires?
+  bool textRow = ((*switches) & S_TEXT) ||
+    (((*switches) & S_MIXED) && row >= 20);
+  if (!textRow && ((*switches) & S_HIRES))
+    return;
+
+  // ... and from which page? (The same choices the redraw functions
+  // above make.)
+  bool page2;
+  if (textRow) {
+    page2 = ((*switches) & S_PAGE2) && !((*switches) & S_80COL);
+  } else {
+    page2 = ((*switches) & S_PAGE2) &&
+      !(((*switches) & S_80COL) && ((*switches) & S_DHIRES));
+  }
+  if ((address >= 0x800) != page2)
+    return;
+
+  markTextRow(row);
+#endif
+}
+
+void AppleDisplay::writeHires(uint16_t address, uint8_t v)
+{
+#ifdef FRAMESNAPSHOT
+  // The next snapshot will pick it up; diffFrame() works out what
+  // changed
+  videoTouched = true;
+#else
+  if (checkSwitches())
+    return;
+
+  if (((*switches) & S_TEXT) || !((*switches) & S_HIRES))
+    return;
+
+  bool page2 = ((*switches) & S_PAGE2) && !((*switches) & S_80STORE);
+  if ((address >= 0x4000) != page2)
+    return;
+
+  uint8_t row;
+  uint16_t col;
+  if (!deinterlaceHiresAddress(address, &row, &col))
+    return;
+  if (row >= 160 && ((*switches) & S_MIXED))
+    return;
+
+  dirtyLines[row] = true;
+#endif
+}
+
 void AppleDisplay::modeChange()
 {
+  modeGeneration++;
+  for (uint8_t y = 0; y < 192; y++) {
+    dirtyLines[y] = true;
+  }
   dirty = true;
   dirtyRect.left = dirtyRect.top = 0;
   dirtyRect.right = 279;
@@ -518,24 +680,16 @@ void AppleDisplay::Draw80LoresPixelAt(uint8_t c, uint8_t x, uint8_t y, uint8_t o
     // The colors in every other column are swizzled. Un-swizzle.
     c = ((c & 0x77) << 1) | ((c & 0x88) >> 3);
   }
-  uint8_t pixel = c & 0x0F;
-  for (uint8_t y2 = 0; y2<4; y2++) {
-    for (int8_t x2 = 3; x2>=offset; x2--) {
-      drawApplePixel(pixel, x*7+x2+offset*3, y*8+y2);
-    }
-  }
-
-  pixel = (c >> 4);
-  for (uint8_t y2 = 4; y2<8; y2++) {
-    for (int8_t x2 = 3; x2>=offset; x2--) {
-      drawApplePixel(pixel, x*7+x2+offset*3, y*8+y2);
-    }
-  }
+  uint16_t x1 = x*7 + offset*4;
+  g_display->cacheDoubleWideFill(x1, y*8,   4-offset, 4, c & 0x0F);
+  g_display->cacheDoubleWideFill(x1, y*8+4, 4-offset, 4, c >> 4);
 }
 
 void AppleDisplay::setSwitches(uint16_t *switches)
 {
   this->switches = switches;
+  lastSwitches = *switches;
+  drawSwitches = *switches;
   modeChange();
 }
 
@@ -546,52 +700,84 @@ AiieRect AppleDisplay::getDirtyRect()
 
 bool AppleDisplay::needsRedraw()
 {
-  modeChange(); // FIXME: this shouldn't be necessary.
-  /* It should work like this:
+  /* Video memory writes (see writeLores() and writeHires()) mark the
+   * scanlines they affect; anything that changes the whole picture -
+   * a mode switch, a page flip, a new display type - marks them all
+   * via modeChange(). Here we re-render just the marked lines, and
+   * grow the dirty rect to cover them.
    *
-   *   When currently active video ram is written to, it calls the display.
-   *     Display detects whether or not it's currently locked.
-   *     If it's currently locked, then it notes the rect in a "locked update" rect
-   *     If it's not locked, then it pulls in the locked rect + this rect and extends the current dirty rect appropriately
+   * There's no lock between this and the CPU. A line's flag is
+   * cleared before it's drawn, so a write that lands while we're
+   * drawing it will be picked up next time around.
    *
-   *   Then when we start drawing, we take a snapshot of video ram &
-   *   blit the appropriate rect.
-   *
-   * Alternately: we could have multiple copies of the video areas of
-   * RAM and swap between them when drawing starts. But to do that,
-   * we'd need another (1 + 1 + 8 + 8) * 2 = 36k of RAM, which we don't have.
-   *
-   * I'm not sure either approach fixes tearing, though. We see
-   * tearing because there's no snapshot when the mode flags change, I
-   * think.
+   * With FRAMESNAPSHOT, we draw from the newest vertical blank copy
+   * instead, and the lines to draw are the ones that differ from the
+   * last copy we drew from.
    */
+#ifdef FRAMESNAPSHOT
+  if (frameQueue.acquire()) {
+    frame = &frames[frameQueue.readIndex()];
+    diffFrame();
+  }
+  drawSwitches = frame->switches;
+#else
+  checkSwitches();
+  drawSwitches = *switches;
+#endif
+
+  // Forget what text we drew if something else could have been drawn
+  // over it since
+  uint32_t generation = modeGeneration;
+  if (generation != shownGeneration) {
+    shownGeneration = generation;
+    memset(textShown, NOGLYPH, sizeof(textShown));
+  }
 
-  if (dirty) {
-    // Figure out what graphics mode we're in and redraw it in its entirety.
+  // Flashing characters only need their rows looked at again when the
+  // flash phase changes; textShown narrows that down to their cells
+  uint8_t phase = (vblCount / FLASHFRAMES) & 1;
+  if (phase != flashPhase) {
+    flashPhase = phase;
+    for (uint8_t row = 0; row < 24; row++) {
+      if (flashRows & (1UL << row))
+	markTextRow(row);
+    }
+  }
 
-    if ((*switches) & S_TEXT) {
-      if ((*switches) & S_80COL) {
-	redraw80ColumnText(0);
+  for (uint8_t row = 0; row < 24; row++) {
+    bool textRow = (drawSwitches & S_TEXT) ||
+      ((drawSwitches & S_MIXED) && row >= 20);
+
+    if (textRow || !(drawSwitches & S_HIRES)) {
+      // Text and lores are drawn a whole (8-line) row at a time
+      bool rowDirty = false;
+      for (uint8_t y = row * 8; y < row * 8 + 8; y++) {
+	if (dirtyLines[y]) {
+	  dirtyLines[y] = false;
+	  rowDirty = true;
+	}
+      }
+      if (!rowDirty)
+	continue;
+
+      if (!textRow) {
+	redrawLores(row);
+	extendDirtyRect(0, row * 8);
+	extendDirtyRect(279, row * 8 + 7);
+      } else if (drawSwitches & S_80COL) {
+	// (these extend the dirty rect over just the cells they draw)
+	redraw80ColumnText(row);
       } else {
-	redraw40ColumnText(0);
+	redraw40ColumnText(row);
       }
-      
-      return true;
-    }
-
-    // Not text mode - what mode are we in?
-    if ((*switches) & S_HIRES) {
-      redrawHires();
     } else {
-      redrawLores();
-    }
-
-    // Mixed graphics modes: draw text @ bottom
-    if ((*switches) & S_MIXED) {
-      if ((*switches) & S_80COL) {
-	redraw80ColumnText(20);
-      } else {
-	redraw40ColumnText(20);
+      for (uint8_t y = row * 8; y < row * 8 + 8; y++) {
+	if (dirtyLines[y]) {
+	  dirtyLines[y] = false;
+	  redrawHires(y);
+	  extendDirtyRect(0, y);
+	  extendDirtyRect(279, y);
+	}
       }
     }
   }
@@ -609,6 +795,101 @@ void AppleDisplay::displayTypeChanged()
   modeChange();
 }
 
+void AppleDisplay::resetFrameClock()
+{
+  uint64_t now = g_cpu->cycles;
+  uint64_t next = now - (now % FRAMECYCLES) + VBLSTART;
+  if (next <= now)
+    next += FRAMECYCLES;
+  g_scheduler.schedule(EVT_VBL, next);
+
+#ifdef FRAMESNAPSHOT
+  // We're called after a Reset or Resume, which change memory behind
+  // the MMU's back; the next vertical blank has to take a snapshot
+  videoTouched = true;
+#endif
+}
+
+// Called on the CPU thread at the start of each vertical blank
+void AppleDisplay::verticalBlank()
+{
+#ifdef FRAMESNAPSHOT
+  snapshotFrame();
+#endif
+  vblCount++;
+}
+
+#ifdef FRAMESNAPSHOT
+void AppleDisplay::snapshotFrame()
+{
+  uint16_t sw = *switches;
+  if (!videoTouched && sw == lastFrameSwitches)
+    return; // nothing new to show
+
+  VideoFrame *f = &frames[frameQueue.writeIndex()];
+  f->switches = sw;
+  for (uint8_t bank = 0; bank < 2; bank++) {
+    for (uint8_t hi = 0x04; hi < 0x0C; hi++) {
+      memcpy(&f->text[bank][(hi - 0x04) << 8], ((AppleMMU *)mmu)->displayPage(hi, bank), 256);
+    }
+    if ((sw & S_HIRES) && !(sw & S_TEXT)) {
+      // Just the page that's showing (see redrawHires())
+      uint8_t start = ((sw & S_PAGE2) && !(sw & S_80STORE)) ? 0x40 : 0x20;
+      for (uint8_t hi = start; hi < start + 0x20; hi++) {
+	memcpy(&f->hires[bank][(hi - 0x20) << 8], ((AppleMMU *)mmu)->displayPage(hi, bank), 256);
+      }
+    }
+  }
+  frameQueue.publish();
+
+  videoTouched = false;
+  lastFrameSwitches = sw;
+}
+
+// Marks the lines where 'frame' differs from 'shown', and brings
+// 'shown' up to date
+void AppleDisplay::diffFrame()
+{
+  uint16_t sw = frame->switches;
+  if (sw != shown.switches) {
+    shown.switches = sw;
+    modeChange();
+  }
+
+  for (uint8_t row = 0; row < 24; row++) {
+    bool textRow = (sw & S_TEXT) || ((sw & S_MIXED) && row >= 20);
+    if (!textRow && (sw & S_HIRES))
+      continue;
+    bool changed = false;
+    for (uint8_t bank = 0; bank < 2; bank++) {
+      for (uint16_t page = 0x400; page <= 0x800; page += 0x400) {
+	uint16_t offset = textRowAddress(page, row) - 0x400;
+	if (memcmp(&frame->text[bank][offset], &shown.text[bank][offset], 40)) {
+	  memcpy(&shown.text[bank][offset], &frame->text[bank][offset], 40);
+	  changed = true;
+	}
+      }
+    }
+    if (changed)
+      markTextRow(row);
+  }
+
+  if ((sw & S_HIRES) && !(sw & S_TEXT)) {
+    uint16_t start = ((sw & S_PAGE2) && !(sw & S_80STORE)) ? 0x4000 : 0x2000;
+    uint8_t lines = (sw & S_MIXED) ? 160 : 192;
+    for (uint8_t line = 0; line < lines; line++) {
+      uint16_t offset = hiresLineAddress(start, line) - 0x2000;
+      for (uint8_t bank = 0; bank < 2; bank++) {
+	if (memcmp(&frame->hires[bank][offset], &shown.hires[bank][offset], 40)) {
+	  memcpy(&shown.hires[bank][offset], &frame->hires[bank][offset], 40);
+	  dirtyLines[line] = true;
+	}
+      }
+    }
+  }
+}
+#endif
+
 void AppleDisplay::lockDisplay()
 {
 }
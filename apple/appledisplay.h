@@ -9,6 +9,25 @@
 
 #include "vmdisplay.h"
 
+#ifdef FRAMESNAPSHOT
+#include "triplebuffer.h"
+#endif
+
+// The video frame on the CPU clock: 262 lines of 65 cycles (about
+// 60Hz), the last 70 of them vertical blank. Frames start on multiples
+// of FRAMECYCLES; $C019 and EVT_VBL both work from that.
+#define FRAMECYCLES 17030
+#define VBLSTART (192 * 65)
+
+// Flashing characters swap between inverse and normal this often
+#define FLASHFRAMES 16
+
+// Distinct character pictures in the glyph cache: the 64 upper case
+// glyphs and 32 lower case ones, each normal and inverse, plus the 32
+// mousetext ones
+#define GLYPHCOUNT 224
+#define NOGLYPH 0xFF
+
 enum {
   c_black     = 0,
   c_magenta   = 1,
@@ -37,6 +56,17 @@ enum {
 
 class AppleMMU;
 
+#ifdef FRAMESNAPSHOT
+// What the display had to show at one vertical blank: the switches,
+// both text pages, and whichever hires page was showing, in main
+// (bank 0) and aux (bank 1) memory
+struct VideoFrame {
+  uint16_t switches;
+  uint8_t text[2][0x800];   // $400-$BFF
+  uint8_t hires[2][0x4000]; // $2000-$5FFF
+};
+#endif
+
 class AppleDisplay : public VMDisplay{
  public:
   AppleDisplay();
@@ -50,32 +80,99 @@ class AppleDisplay : public VMDisplay{
   void modeChange(); // FIXME: rename 'redraw'?
   void setSwitches(uint16_t *switches);
 
+  // Called by the MMU when the CPU writes to text/lores ($400-$BFF)
+  // or hires ($2000-$5FFF) memory, so just the affected lines redraw
   void writeLores(uint16_t address, uint8_t v);
   void writeHires(uint16_t address, uint8_t v);
 
   void displayTypeChanged();
 
-  const unsigned char *xlateChar(uint8_t c, bool *invert);
+  // (Re)start the vertical blank events from the CPU's cycle count
+  void resetFrameClock();
+  void verticalBlank();
+  // How many vertical blanks there have been; hosts draw once per
+  uint32_t frameCount() { return vblCount; }
 
  private:
+  static uint8_t xlateChar(uint8_t c, bool altCharset, uint8_t flashPhase);
+  static void buildGlyphCache();
 
   bool deinterlaceAddress(uint16_t address, uint8_t *row, uint8_t *col);
   bool deinterlaceHiresAddress(uint16_t address, uint8_t *row, uint16_t *col);
 
-  void Draw14DoubleHiresPixelsAt(uint16_t addr);
-  void Draw14HiresPixelsAt(uint16_t addr);
+  inline const uint8_t *videoMemory(uint16_t address, uint8_t bank);
+
+  void Draw14DoubleHiresPixelsAt(const uint8_t *mainp, const uint8_t *auxp, uint8_t row, uint16_t col);
+  void Draw14HiresPixelsAt(const uint8_t *p, uint8_t row, uint16_t col);
+  static void buildHiresTables();
   void Draw80LoresPixelAt(uint8_t c, uint8_t x, uint8_t y, uint8_t offset);
 
-  void redraw40ColumnText(uint8_t startingY);
-  void redraw80ColumnText(uint8_t startingY);
-  void redrawHires();
-  void redrawLores();
+  void redraw40ColumnText(uint8_t row);
+  void redraw80ColumnText(uint8_t row);
+  void drawTextCells(uint8_t row, const uint8_t *codes, uint8_t cols);
+  void redrawHires(uint8_t line);
+  void redrawLores(uint8_t row);
+
+  void markTextRow(uint8_t row);
+  inline bool checkSwitches();
+#ifdef FRAMESNAPSHOT
+  void snapshotFrame();
+  void diffFrame();
+#endif
 
  private:
   volatile bool dirty;
   AiieRect dirtyRect;
 
+  // Scanlines that need to be re-rendered from video memory; set by
+  // writeLores()/writeHires() and modeChange(), consumed by needsRedraw()
+  volatile bool dirtyLines[192];
+
+  // Precomputed hires pixel colors and address decoding (see
+  // buildHiresTables() in appledisplay.cpp)
+  static uint8_t hiresLowPairs[2][512][4];
+  static uint8_t hiresHighPairs[2][256][3];
+  static uint8_t dhrPixels[16][4];
+  static uint8_t hiresRunRow[128];
+  static uint16_t hiresRunCol[128];
+
+  // Text is drawn from pre-expanded glyphs (see buildGlyphCache()):
+  // each distinct character picture as 8 rows of 7 color indexes, and
+  // which of them a character code shows as, per character set and
+  // flash phase
+  static uint8_t glyphs[GLYPHCOUNT][8][7];
+  static uint8_t glyphIndex[2][2][256]; // [ALTCHARSET][flash phase][code]
+
+  // The glyph each text cell was last drawn with (80 cells to a row in
+  // 80-column mode, 40 otherwise), or NOGLYPH. Only cells that differ
+  // are redrawn; it's all forgotten whenever modeChange() says the
+  // text area might have been drawn over.
+  uint8_t textShown[24][80];
+  volatile uint32_t modeGeneration; // bumped by modeChange()
+  uint32_t shownGeneration;         // ... as of the last textShown reset
+  uint8_t flashPhase;               // ... that the text was drawn in
+  uint32_t flashRows;               // text rows with flashing characters
+
   uint16_t *switches; // pointer to the MMU's switches
+  uint16_t lastSwitches; // ... as of the last checkSwitches()
+  uint16_t drawSwitches; // ... that the frame being drawn was shown with
+
+  volatile uint32_t vblCount;
+
+#ifdef FRAMESNAPSHOT
+  /* The CPU thread copies the video memory in to frames[] at each
+   * vertical blank, and needsRedraw() draws from the newest one, so
+   * the picture never tears and the renderer never touches live
+   * memory. 'shown' is the renderer's copy of what it last drew from,
+   * to work out which lines changed.
+   */
+  VideoFrame frames[3];
+  TripleBuffer frameQueue;
+  VideoFrame *frame;   // frames[frameQueue.readIndex()]
+  VideoFrame shown;
+  bool videoTouched;   // written to since the last snapshot?
+  uint16_t lastFrameSwitches;
+#endif
 };
 
 #endif
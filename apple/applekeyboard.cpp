@@ -18,8 +18,9 @@ AppleKeyboard::AppleKeyboard(AppleMMU *m)
     keysDown[i] = false;
   }
   anyKeyIsDown = false;
-  startRepeatTimer = 0;
-  repeatTimer = 0;
+  keyThatIsRepeating = 0;
+
+  g_scheduler.setHandler(EVT_KEYREPEAT, repeatKey, this);
 
   capsLockEnabled = true;
 }
@@ -112,6 +113,30 @@ uint8_t AppleKeyboard::translateKeyWithModifiers(uint8_t k)
 }
 
 void AppleKeyboard::keyDepressed(uint8_t k)
+{
+  keyEvent e = { k, true };
+  pendingKeys.push(e); // (dropped if the CPU's that far behind)
+}
+
+void AppleKeyboard::keyReleased(uint8_t k)
+{
+  keyEvent e = { k, false };
+  pendingKeys.push(e); // (dropped if the CPU's that far behind)
+}
+
+void AppleKeyboard::processKeys()
+{
+  const keyEvent *e;
+  while ((e = pendingKeys.peek()) != NULL) {
+    if (e->down)
+      pressKey(e->key);
+    else
+      releaseKey(e->key);
+    pendingKeys.pop();
+  }
+}
+
+void AppleKeyboard::pressKey(uint8_t k)
 {
   keysDown[k] = true;  
 
@@ -123,7 +148,7 @@ void AppleKeyboard::keyDepressed(uint8_t k)
       anyKeyIsDown = true;
     }
     keyThatIsRepeating = translateKeyWithModifiers(k);
-    startRepeatTimer = g_cpu->cycles + STARTREPEAT;
+    g_scheduler.schedule(EVT_KEYREPEAT, g_cpu->cycles + STARTREPEAT);
     mmu->keyboardInput(keyThatIsRepeating);
   } else if (k == PK_LA) {
     // Special handling: apple keys
@@ -140,7 +165,7 @@ void AppleKeyboard::keyDepressed(uint8_t k)
   }
 }
 
-void AppleKeyboard::keyReleased(uint8_t k)
+void AppleKeyboard::releaseKey(uint8_t k)
 {
   keysDown[k] = false;  
 
@@ -168,29 +193,17 @@ void AppleKeyboard::keyReleased(uint8_t k)
     }
     if (!anyKeyIsDown) {
       mmu->setKeyDown(false);
+      g_scheduler.cancel(EVT_KEYREPEAT);
     }
   }  
 }
 
-void AppleKeyboard::maintainKeyboard(uint32_t cycleCount)
+void AppleKeyboard::repeatKey(void *obj, uint8_t event, uint64_t when)
 {
-  if (anyKeyIsDown) {
-    if (startRepeatTimer) {
-      if (cycleCount >= startRepeatTimer) {
-	// waiting to start repeating
-	startRepeatTimer = 0;
-	repeatTimer = 0;
-	// Will fall through...
-      } else {
-	// Don't fall through; not time to start repeating yet
-	return;
-      }
-    }
-    
-    // already repeating; keep it up
-    if (cycleCount >= repeatTimer) {
-      mmu->keyboardInput(keyThatIsRepeating);
-      repeatTimer = cycleCount + REPEATAGAIN;
-    }
+  AppleKeyboard *kbd = (AppleKeyboard *)obj;
+
+  if (kbd->anyKeyIsDown) {
+    kbd->mmu->keyboardInput(kbd->keyThatIsRepeating);
+    g_scheduler.schedule(EVT_KEYREPEAT, when + REPEATAGAIN);
   }
 }
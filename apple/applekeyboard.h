@@ -5,6 +5,10 @@
 
 #include "vmkeyboard.h"
 #include "applemmu.h"
+#include "spscring.h"
+
+// Presses and releases that haven't reached the CPU thread yet
+#define KEYQUEUESIZE 64
 
 class AppleKeyboard : public VMKeyboard {
  public:
@@ -13,9 +17,11 @@ class AppleKeyboard : public VMKeyboard {
 
   virtual void keyDepressed(uint8_t k);
   virtual void keyReleased(uint8_t k);
-  virtual void maintainKeyboard(uint32_t cycleCount);
+  virtual void processKeys();
 
  protected:
+  void pressKey(uint8_t k);
+  void releaseKey(uint8_t k);
   bool isVirtualKey(uint8_t kc);
   uint8_t translateKeyWithModifiers(uint8_t k);
 
@@ -39,19 +45,22 @@ class AppleKeyboard : public VMKeyboard {
   // while repeating, we send that keypress (reset keystrobe) about 15 
   // times a second (every 66667-ish CPU cycles).
   //
-  // startRepeatTimer is the time (in CPU clock cycles) when we will
-  // start repeating the key that's currently down (note: rollover 
-  // happens every 4925 seconds because it's a 32-bit counter, which means 
-  // that roughly once every 82 minutes it's possible that a key will begin 
-  // repeating early).
+  // The repeats are driven by the EVT_KEYREPEAT scheduler event, which
+  // is first scheduled when the key goes down.
   //
   // keyThatIsRepeating is set to the actual key pressed.
-  // repeatTimer is the cpu cycle count at which we would repeat again.
-  // (It also has the rollover problem once every 82 minutes.)
  
-  uint32_t startRepeatTimer;
   uint8_t keyThatIsRepeating;
-  uint32_t repeatTimer;
+
+  static void repeatKey(void *obj, uint8_t event, uint64_t when);
+
+  // The keyboard state, the MMU's keyboard switches and the repeat
+  // event all belong to the CPU thread, so the host just queues keys
+  struct keyEvent {
+    uint8_t key;
+    bool down;
+  };
+  SPSCRing<keyEvent, KEYQUEUESIZE> pendingKeys;
 };
 
 #endif
@@ -23,6 +23,23 @@
 // Serializing token for MMU data
 #define MMUMAGIC 'M'
 
+// Idle-loop detection: this many back-to-back reads of the same soft
+// switch from the same instruction, each within IDLEPOLLGAP
+// instructions of the last and with nothing new to report - where
+// that instruction is a loop we can account for without running it
+// (see isPollLoop()) - means the guest is just waiting...
+#define IDLEPOLLS 16
+#define IDLEPOLLGAP 32
+// ... and we'll let the host skip up to this many cycles at a time
+// (one video frame) rather than run the loop.
+#define IDLEMAXCYCLES 17030
+
+// One pass through a KEYIN-style loop (INC zp, BNE, BIT abs, BPL):
+// 5+3+4+3 cycles, and 4 more when the INC wraps and the high byte is
+// bumped as well (BNE not taken, INC zp+1).
+#define KEYINCYCLES 15
+#define KEYINWRAPCYCLES 4
+
 // apple //e memory map
 
 /*
@@ -71,7 +88,8 @@ Current write page table [512 bytes] in real ram
 //
 // After that it's all a guess. Should it be slot ROMs?
 // extended RAM? Hires RAM? FIXME: do some analysis of common memory
-// hotspots...
+// hotspots... (build with -DMEMHEATMAP to collect the data; see
+// dumpHeatmap())
 
 enum {
   // Pages we want to fall to internal RAM:
@@ -129,10 +147,25 @@ static uint16_t _pageNumberForRam(uint8_t highByte, uint8_t variant)
   return ((highByte - 0xE0) * 3 + variant + MP_E0);
 }
 
+#ifdef MEMHEATMAP
+static AppleMMU *heatmapMMU = NULL;
+
+static void dumpHeatmapAtExit()
+{
+  if (heatmapMMU)
+    heatmapMMU->dumpHeatmap("heatmap");
+}
+#endif
+
 AppleMMU::AppleMMU(AppleDisplay *display)
 {
   anyKeyDown = false;
 
+  pollAddress = pollPC = 0;
+  pollCount = 0;
+  lastPollInstruction = 0;
+  pollCounter = pollCarry = 0;
+
   for (int8_t i=0; i<=7; i++) {
     slots[i] = NULL;
   }
@@ -146,6 +179,12 @@ AppleMMU::AppleMMU(AppleDisplay *display)
 #else
   clock = new NixClock((AppleMMU *)this);
 #endif
+
+#ifdef MEMHEATMAP
+  resetHeatmap();
+  heatmapMMU = this;
+  atexit(dumpHeatmapAtExit);
+#endif
 }
 
 AppleMMU::~AppleMMU()
@@ -231,6 +270,12 @@ void AppleMMU::Reset()
 
 uint8_t AppleMMU::read(uint16_t address)
 {
+#ifdef MEMHEATMAP
+  pageReads[readPages[address >> 8]]++;
+  if ((address >> 8) == 0xC0)
+    switchReads[address & 0xFF]++;
+#endif
+
   uint8_t rv = 0;
   if (handleNoSlotClock(address, &rv)) {
     return rv;
@@ -266,6 +311,11 @@ uint8_t AppleMMU::read(uint16_t address)
   return res;
 }
 
+const uint8_t *AppleMMU::displayPage(uint8_t hi, uint8_t bank)
+{
+  return g_ram.pagePointer(_pageNumberForRam(hi, bank));
+}
+
 // Bypass MMU and read directly from a given page - also bypasses switches
 uint8_t AppleMMU::readDirect(uint16_t address, uint8_t fromPage)
 {
@@ -276,6 +326,13 @@ uint8_t AppleMMU::readDirect(uint16_t address, uint8_t fromPage)
 
 void AppleMMU::write(uint16_t address, uint8_t v)
 {
+#ifdef MEMHEATMAP
+  // (Counts writes to ROM, too, although they're then thrown away)
+  pageWrites[writePages[address >> 8]]++;
+  if ((address >> 8) == 0xC0)
+    switchWrites[address & 0xFF]++;
+#endif
+
   if (handleNoSlotClock(address, NULL)) {
     return;
   }
@@ -295,27 +352,38 @@ void AppleMMU::write(uint16_t address, uint8_t v)
   }
 
   g_ram.writeByte((writePages[address >> 8] << 8) | (address & 0xFF), v);
+#ifdef BLOCKCACHE
+  g_cpu->invalidateCode(writePages[address >> 8], address & 0xFF);
+#endif
 
+  // Tell the display, which works out whether it's on screen
   if (address >= 0x400 &&
-      address <= 0x7FF) {
-
-    // If it's text mode, or mixed mode, or lores graphics mode, then update.
-    if ((switches & S_TEXT) || (switches & S_MIXED) || (!(switches & S_HIRES))) {
-      // Force a redraw
-      display->modeChange();
-    }
+      address <= 0xBFF) {
+    display->writeLores(address, v);
     return;
   }
 
   if (address >= 0x2000 &&
       address <= 0x5FFF) {
-    if (switches & S_HIRES) {
-      // Force a redraw
-      display->modeChange();
-    }
+    display->writeHires(address, v);
   }
 }
 
+uint16_t AppleMMU::codePage(uint8_t hi)
+{
+  // $C000-$CFFF has I/O, slot latching and the No Slot Clock, all of
+  // which have read side effects; everything else is plain RAM or ROM
+  // and is identified by the VMRam page it's mapped to.
+  if (hi >= 0xC0 && hi <= 0xCF)
+    return NOCODEPAGE;
+#ifdef MEMHEATMAP
+  // Instruction fetches have to reach read() to be counted
+  return NOCODEPAGE;
+#else
+  return readPages[hi];
+#endif
+}
+
 bool AppleMMU::handleNoSlotClock(uint16_t address, uint8_t *rv)
 {
   uint8_t ah = address >> 8;
@@ -340,7 +408,13 @@ bool AppleMMU::handleNoSlotClock(uint16_t address, uint8_t *rv)
 void AppleMMU::resetDisplay()
 {
   updateMemoryPages();
+#ifdef FRAMESNAPSHOT
+  // The display thread's diffFrame() sees the switches change between
+  // snapshots and invalidates the screen itself; the dirty state is
+  // only its to touch
+#else
   display->modeChange();
+#endif
 }
 
 void AppleMMU::handleMemorySwitches(uint16_t address, uint16_t lastSwitch)
@@ -536,13 +610,16 @@ uint8_t AppleMMU::readSwitches(uint16_t address)
   case 0xC018: // RD80COL
     return (switches & S_80STORE) ? 0x80 : 0x00;
   case 0xC019: // RDVBLBAR -- vertical blanking, for 4550 cycles of every 17030
-    // Should return 0 for 4550 of 17030 cycles. Since we're not really 
-    // running full speed video, instead, I'm returning 0 for 4096 (2^12)
-    // of every 16384 (2^14) cycles; the math is easier.
-    if ((g_cpu->cycles & 0x3000) == 0x3000) {
-      return 0x00;
-    } else {
-      return 0xFF; // FIXME: is 0xFF correct? Or 0x80?
+    {
+      // The same frame the display's vertical blank events run on
+      uint64_t frameStart = g_cpu->cycles - (g_cpu->cycles % FRAMECYCLES);
+      if (g_cpu->cycles - frameStart >= VBLSTART) {
+	noticePolling(address, frameStart + FRAMECYCLES);
+	return 0x00;
+      } else {
+	noticePolling(address, frameStart + VBLSTART);
+	return 0xFF; // FIXME: is 0xFF correct? Or 0x80?
+      }
     }
   case 0xC01A: // RDTEXT
     return ( (switches & S_TEXT) ? 0x80 : 0x00 );
@@ -660,7 +737,13 @@ uint8_t AppleMMU::readSwitches(uint16_t address)
 
   if (address >= 0xc000 && address <= 0xc00f) {
     // This is the keyboardStrobe support referenced in the switch statement above.
-    return g_ram.readByte((readPages[0xC0] << 8) | 0x10);
+    uint8_t v = g_ram.readByte((readPages[0xC0] << 8) | 0x10);
+    if (!(v & 0x80)) {
+      // No key yet. Nothing changes until one is pressed (which wakes
+      // the CPU) or a device event comes due.
+      noticePolling(address, g_cpu->cycles + IDLEMAXCYCLES);
+    }
+    return v;
   }
 
   /* *** FIXME: 
@@ -880,6 +963,123 @@ void AppleMMU::keyboardInput(uint8_t v)
   g_ram.writeByte((writePages[0xC0] << 8) | 0x10, 
 		  v | 0x80);
   anyKeyDown = true;
+
+  // If the CPU was waiting for a key, then it's got one now
+  g_cpu->wake();
+}
+
+// Called when the guest reads a soft switch that won't change before
+// cycle 'until' (unless there's input). If it's doing that in a tight
+// loop then it's idle, and the host can skip ahead - to 'until', the
+// next scheduled device event, or IDLEMAXCYCLES from now, whichever
+// comes first.
+void AppleMMU::noticePolling(uint16_t address, uint64_t until)
+{
+  uint64_t instructions = g_cpu->instructions;
+
+  if (address != pollAddress || g_cpu->pc != pollPC ||
+      instructions - lastPollInstruction > IDLEPOLLGAP) {
+    pollAddress = address;
+    pollPC = g_cpu->pc;
+    pollCount = 0;
+    pollCarry = 0;
+  } else if (pollCount < IDLEPOLLS) {
+    pollCount++;
+  } else if (!isPollLoop(address)) {
+    // Something else happens in this loop (a timeout, say) so it has
+    // to really run. Look again later.
+    pollCount = 0;
+  } else {
+    uint64_t now = g_cpu->cycles;
+    if (until > now + IDLEMAXCYCLES)
+      until = now + IDLEMAXCYCLES;
+    if (until > g_scheduler.nextEvent())
+      until = g_scheduler.nextEvent();
+    if (until > now)
+      g_cpu->idle(until);
+  }
+  lastPollInstruction = instructions;
+}
+
+// True if the instruction that just read 'address' closes a loop we
+// can skip iterations of. That's either the bare
+//   loop: LDA/LDX/LDY/BIT address
+//         BPL/BMI loop
+// which has no side effects at all, or KEYIN's (at $FD1B, and the
+// 80-column firmware's like it)
+//   loop: INC zp
+//         BNE +2
+//         INC zp+1
+//         LDA/LDX/LDY/BIT address
+//         BPL/BMI loop
+// whose only side effect is the counter at zp (RNDL/RNDH, the random
+// seed) - which idleSkipped() keeps going. Both CPU cores have the PC
+// just past the absolute operand here.
+bool AppleMMU::isPollLoop(uint16_t address)
+{
+  uint16_t at = g_cpu->pc - 9;
+  uint8_t code[11];
+  for (uint8_t i=0; i<sizeof(code); i++) {
+    uint16_t a = at + i;
+    if ((a >> 8) == 0xC0)
+      return false; // not code
+    code[i] = g_ram.readByte((readPages[a >> 8] << 8) | (a & 0xFF));
+  }
+
+  // code[6..10] is the read and the branch
+  if (!(code[6] == 0xAD || code[6] == 0xAE ||
+	code[6] == 0xAC || code[6] == 0x2C) ||
+      code[7] != (address & 0xFF) || code[8] != (address >> 8) ||
+      !(code[9] == 0x10 || code[9] == 0x30))
+    return false;
+
+  if (code[10] == 0xFB) { // branches back to the read
+    pollCounter = 0;
+    return true;
+  }
+
+  if (code[10] == 0xF5 && // branches back to the first INC
+      code[0] == 0xE6 && code[2] == 0xD0 && code[3] == 0x02 &&
+      code[4] == 0xE6 && code[5] == (uint8_t)(code[1] + 1) &&
+      code[1] != 0xFF) {
+    pollCounter = code[1];
+    return true;
+  }
+
+  return false;
+}
+
+// Run a KEYIN-style loop's counter on by as many iterations as fit in
+// the cycles that were skipped, carrying any leftover in to the next
+// skip.
+void AppleMMU::idleSkipped(uint64_t cycles)
+{
+  if (!pollCounter)
+    return;
+
+  uint16_t counter = read(pollCounter) | (read(pollCounter + 1) << 8);
+
+  cycles += pollCarry;
+  while (1) {
+    // iterations up to and including the one that wraps the low byte
+    uint16_t toWrap = 256 - (counter & 0xFF);
+    uint64_t wrapCycles = (uint64_t)toWrap * KEYINCYCLES + KEYINWRAPCYCLES;
+    if (cycles >= wrapCycles) {
+      counter += toWrap;
+      cycles -= wrapCycles;
+      continue;
+    }
+    uint16_t n = cycles / KEYINCYCLES;
+    if (n >= toWrap)
+      n = toWrap - 1;
+    counter += n;
+    cycles -= (uint64_t)n * KEYINCYCLES;
+    break;
+  }
+  pollCarry = cycles;
+
+  write(pollCounter, counter & 0xFF);
+  write(pollCounter + 1, counter >> 8);
 }
 
 void AppleMMU::setKeyDown(bool isTrue)
@@ -975,6 +1175,12 @@ void AppleMMU::resetRAM()
   // we're really setting all the RAM flags to the right default
   // settings above - but better safe than sorry?
   updateMemoryPages();
+
+#ifdef BLOCKCACHE
+  // We wrote straight in to g_ram, behind the CPU's back
+  if (g_cpu)
+    g_cpu->flushCodeCache();
+#endif
 }
 
 void AppleMMU::setSlot(int8_t slotnum, Slot *peripheral)
@@ -992,6 +1198,10 @@ void AppleMMU::setSlot(int8_t slotnum, Slot *peripheral)
     for (int i=0; i<256; i++) {
       g_ram.writeByte( (page0 << 8) + i, tmpBuf[i] );
     }
+#ifdef BLOCKCACHE
+    if (g_cpu)
+      g_cpu->flushCodeCache();
+#endif
   }
 }
 
@@ -1132,6 +1342,41 @@ void AppleMMU::updateMemoryPages()
       writePages[idx] = _pageNumberForRam(idx, 0);
     }
   }
+
+  // Point the CPU's fast path at the same pages...
+  for (uint16_t idx = 0; idx < 0x100; idx++) {
+    readPointers[idx] = g_ram.pagePointer(readPages[idx]);
+    writePointers[idx] = g_ram.pagePointer(writePages[idx]);
+    writeCodePages[idx] = writePages[idx];
+  }
+  // ... except where there are side effects. $C000-$CFFF has soft
+  // switches, slot ROM latching, $CFFF unlatching and the No Slot Clock.
+  for (uint16_t idx = 0xc0; idx < 0xd0; idx++) {
+    readPointers[idx] = writePointers[idx] = NULL;
+  }
+  // Writes to ROM are dropped in write()
+  if (!writebsr) {
+    for (uint16_t idx = 0xd0; idx < 0x100; idx++) {
+      writePointers[idx] = NULL;
+    }
+  }
+  // and writes to the video pages have to tell the display
+  for (uint16_t idx = 0x04; idx < 0x0C; idx++) {
+    writePointers[idx] = NULL;
+  }
+  for (uint16_t idx = 0x20; idx < 0x60; idx++) {
+    writePointers[idx] = NULL;
+  }
+#ifdef MEMHEATMAP
+  // ... and to count every access, nothing gets the fast path.
+  memset(readPointers, 0, sizeof(readPointers));
+  memset(writePointers, 0, sizeof(writePointers));
+#endif
+
+#ifdef BLOCKCACHE
+  if (g_cpu)
+    g_cpu->invalidateCodeMapping();
+#endif
 }
 
 void AppleMMU::setAppleKey(int8_t which, bool isDown)
@@ -1139,3 +1384,79 @@ void AppleMMU::setAppleKey(int8_t which, bool isDown)
   assert(which <= 1);
   g_ram.writeByte((writePages[0xC0] << 8) | (0x61 + which), isDown ? 0x80 : 0x00);
 }
+
+#ifdef MEMHEATMAP
+void AppleMMU::resetHeatmap()
+{
+  memset(pageReads, 0, sizeof(pageReads));
+  memset(pageWrites, 0, sizeof(pageWrites));
+  memset(switchReads, 0, sizeof(switchReads));
+  memset(switchWrites, 0, sizeof(switchWrites));
+}
+
+// Writes the access counts since startup (or resetHeatmap()).
+//
+// <basename>.csv has one "page" line per VMRam page - the CPU page it
+// backs and which variant of it (main/aux, ROM or language card bank;
+// see _pageNumberForRam) - and one "switch" line per $C0xx address.
+//
+// <basename>.bin is the raw counters in host byte order: uint64_t
+// pageReads[MMUPAGES], pageWrites[MMUPAGES], switchReads[256],
+// switchWrites[256].
+bool AppleMMU::dumpHeatmap(const char *basename)
+{
+  char fn[256];
+
+  snprintf(fn, sizeof(fn), "%s.bin", basename);
+  FILE *f = fopen(fn, "wb");
+  if (!f) {
+    printf("Unable to write heatmap to %s\n", fn);
+    return false;
+  }
+  bool ok = (fwrite(pageReads, sizeof(pageReads), 1, f) == 1 &&
+	     fwrite(pageWrites, sizeof(pageWrites), 1, f) == 1 &&
+	     fwrite(switchReads, sizeof(switchReads), 1, f) == 1 &&
+	     fwrite(switchWrites, sizeof(switchWrites), 1, f) == 1);
+  fclose(f);
+  if (!ok) {
+    printf("Short write to %s\n", fn);
+    return false;
+  }
+
+  snprintf(fn, sizeof(fn), "%s.csv", basename);
+  f = fopen(fn, "w");
+  if (!f) {
+    printf("Unable to write heatmap to %s\n", fn);
+    return false;
+  }
+  fprintf(f, "kind,index,address,variant,reads,writes\n");
+  for (uint16_t hi = 0; hi < 0x100; hi++) {
+    uint8_t variants;
+    if (hi == 0xC0)
+      variants = 1;
+    else if (hi >= 0xD0 && hi <= 0xDF)
+      variants = 5;
+    else if (hi >= 0xE0)
+      variants = 3;
+    else
+      variants = 2;
+    for (uint8_t v = 0; v < variants; v++) {
+      uint16_t page = _pageNumberForRam(hi, v);
+      fprintf(f, "page,%u,$%02X00,%u,%llu,%llu\n",
+	      page, hi, v,
+	      (unsigned long long)pageReads[page],
+	      (unsigned long long)pageWrites[page]);
+    }
+  }
+  for (uint16_t i = 0; i < 0x100; i++) {
+    fprintf(f, "switch,%u,$C0%02X,,%llu,%llu\n",
+	    i, i,
+	    (unsigned long long)switchReads[i],
+	    (unsigned long long)switchWrites[i]);
+  }
+  fclose(f);
+
+  printf("Memory heatmap written to %s.csv and %s.bin\n", basename, basename);
+  return true;
+}
+#endif
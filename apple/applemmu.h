@@ -13,6 +13,9 @@
 
 #define FLOATING 0
 
+// How many 256-byte pages of VMRam the //e's memory map uses
+#define MMUPAGES 591
+
 // Switches activated by various memory locations
 enum {
   S_TEXT  = 0x0001,
@@ -29,7 +32,7 @@ typedef bool (*callback_t)(void *);
 
 class AppleVM;
 
-class AppleMMU : public MMU {
+class AppleMMU final : public MMU {
   friend class AppleVM;
 
  public:
@@ -42,6 +45,14 @@ class AppleMMU : public MMU {
   virtual uint8_t read(uint16_t address);
   virtual uint8_t readDirect(uint16_t address, uint8_t fromPage);
   virtual void write(uint16_t address, uint8_t v);
+  virtual uint16_t codePage(uint8_t hi);
+  virtual void idleSkipped(uint64_t cycles);
+
+  // Read-only view of the 256 bytes of main (bank 0) or aux (bank 1)
+  // memory at CPU page 'hi', regardless of the current memory map, for
+  // the display to render from. These never move, and reading them
+  // doesn't touch any switches.
+  const uint8_t *displayPage(uint8_t hi, uint8_t bank);
 
   virtual void Reset();
 
@@ -56,6 +67,12 @@ class AppleMMU : public MMU {
 
   void setAppleKey(int8_t which, bool isDown);
 
+#ifdef MEMHEATMAP
+  // Writes <basename>.csv and <basename>.bin (see applemmu.cpp)
+  bool dumpHeatmap(const char *basename);
+  void resetHeatmap();
+#endif
+
  protected:
   bool handleNoSlotClock(uint16_t address, uint8_t *rv);
 
@@ -66,9 +83,30 @@ class AppleMMU : public MMU {
 
   void updateMemoryPages();
 
+  void noticePolling(uint16_t address, uint64_t until);
+  bool isPollLoop(uint16_t address);
+
  private:
   AppleDisplay *display;
   uint16_t switches;
+
+  // idle-loop detection state (see noticePolling())
+  uint16_t pollAddress;
+  uint16_t pollPC;
+  uint8_t pollCount;
+  uint64_t lastPollInstruction;
+  // for KEYIN-style loops: the zero page counter they bump (0 if
+  // none), and the skipped cycles not yet counted as an iteration
+  uint8_t pollCounter;
+  uint8_t pollCarry;
+
+#ifdef MEMHEATMAP
+  // CPU accesses per VMRam page, and per $C0xx soft switch
+  uint64_t pageReads[MMUPAGES];
+  uint64_t pageWrites[MMUPAGES];
+  uint64_t switchReads[0x100];
+  uint64_t switchWrites[0x100];
+#endif
  public: // 'public' for debugging
   bool auxRamRead;
   bool auxRamWrite;
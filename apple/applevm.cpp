@@ -13,7 +13,13 @@
 #endif
 
 #include <errno.h>
-const char *suspendHdr = "Sus2";
+const char *suspendHdr = "Sus3";
+
+// The paddle timers run out on the CPU clock
+static void paddleTimerExpired(void *obj, uint8_t event, uint64_t when)
+{
+  ((AppleMMU *)obj)->triggerPaddleTimer(event - EVT_PADDLE0);
+}
 
 AppleVM::AppleVM()
 {
@@ -32,6 +38,9 @@ AppleVM::AppleVM()
 
   hd32 = new HD32((AppleMMU *)mmu);
   ((AppleMMU *)mmu)->setSlot(7, hd32);
+
+  g_scheduler.setHandler(EVT_PADDLE0, paddleTimerExpired, mmu);
+  g_scheduler.setHandler(EVT_PADDLE1, paddleTimerExpired, mmu);
 }
 
 AppleVM::~AppleVM()
@@ -117,27 +126,14 @@ void AppleVM::Resume(const char *fn)
   }
 
   g_filemanager->closeFile(fh);
-}
-
-// fixme: make member vars
-unsigned long paddleCycleTrigger[2] = {0, 0};
 
-void AppleVM::triggerPaddleInCycles(uint8_t paddleNum,uint16_t cycleCount)
-{
-  paddleCycleTrigger[paddleNum] = cycleCount + g_cpu->cycles;
+  // The CPU's cycle count has moved; so does the next vertical blank
+  ((AppleDisplay *)vmdisplay)->resetFrameClock();
 }
 
-void AppleVM::cpuMaintenance(uint32_t cycles)
+void AppleVM::triggerPaddleInCycles(uint8_t paddleNum,uint16_t cycleCount)
 {
-  for (uint8_t i=0; i<2; i++) {
-    if (paddleCycleTrigger[i] && cycles >= paddleCycleTrigger[i]) {
-      ((AppleMMU *)mmu)->triggerPaddleTimer(i);
-      paddleCycleTrigger[i] = 0;
-    }
-  }
-
-  keyboard->maintainKeyboard(cycles);
-  disk6->maintenance(cycles);
+  g_scheduler.schedule(EVT_PADDLE0 + paddleNum, g_cpu->cycles + cycleCount);
 }
 
 void AppleVM::Reset()
@@ -145,11 +141,9 @@ void AppleVM::Reset()
   disk6->Reset();
   ((AppleMMU *)mmu)->resetRAM();
   mmu->Reset();
+  ((AppleDisplay *)vmdisplay)->resetFrameClock();
 
   g_cpu->pc = (((AppleMMU *)mmu)->read(0xFFFD) << 8) | ((AppleMMU *)mmu)->read(0xFFFC);
-
-  // give the keyboard a moment to depress keys upon startup
-  keyboard->maintainKeyboard(0);
 }
 
 void AppleVM::Monitor()
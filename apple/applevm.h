@@ -17,8 +17,6 @@ class AppleVM : public VM {
   void Suspend(const char *fn);
   void Resume(const char *fn);
 
-  void cpuMaintenance(uint32_t cycles);
-
   virtual void Reset();
   void Monitor();
 
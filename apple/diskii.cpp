@@ -26,6 +26,10 @@
 // 10 second delay before flushing
 #define FLUSHDELAY (1023000 * 10)
 
+// How many half tracks ahead of a moving head to prefetch (DOS steps
+// two half tracks per track, so this is the next two tracks)
+#define PREFETCHHALFTRACKS 4
+
 DiskII::DiskII(AppleMMU *mmu)
 {
   this->mmu = mmu;
@@ -46,6 +50,11 @@ DiskII::DiskII(AppleMMU *mmu)
   diskIsSpinningUntil[0] = diskIsSpinningUntil[1] = 0;
   flushAt[0] = flushAt[1] = 0;
   selectedDisk = 0;
+
+  g_scheduler.setHandler(EVT_DISK1SPINDOWN, diskEvent, this);
+  g_scheduler.setHandler(EVT_DISK2SPINDOWN, diskEvent, this);
+  g_scheduler.setHandler(EVT_DISK1FLUSH, diskEvent, this);
+  g_scheduler.setHandler(EVT_DISK2FLUSH, diskEvent, this);
 }
 
 DiskII::~DiskII()
@@ -54,7 +63,7 @@ DiskII::~DiskII()
 
 bool DiskII::Serialize(int8_t fd)
 {
-  uint8_t buf[23] = { DISKIIMAGIC,
+  uint8_t buf[27] = { DISKIIMAGIC,
 		      readWriteLatch,
 		      sequencer,
 		      dataRegister,
@@ -87,13 +96,17 @@ bool DiskII::Serialize(int8_t fd)
     buf[ptr++] = ((deliveredDiskBits[i] >> 16) & 0xFF);
     buf[ptr++] = ((deliveredDiskBits[i] >>  8) & 0xFF);
     buf[ptr++] = ((deliveredDiskBits[i]      ) & 0xFF);
+    buf[ptr++] = (diskIsSpinningUntil[i] >> 56) & 0xFF;
+    buf[ptr++] = (diskIsSpinningUntil[i] >> 48) & 0xFF;
+    buf[ptr++] = (diskIsSpinningUntil[i] >> 40) & 0xFF;
+    buf[ptr++] = (diskIsSpinningUntil[i] >> 32) & 0xFF;
     buf[ptr++] = (diskIsSpinningUntil[i] >> 24) & 0xFF;
     buf[ptr++] = (diskIsSpinningUntil[i] >> 16) & 0xFF;
     buf[ptr++] = (diskIsSpinningUntil[i] >>  8) & 0xFF;
     buf[ptr++] = (diskIsSpinningUntil[i]      ) & 0xFF;
-    // Safety check: keeping the hard-coded 23 and comparing against ptr.
-    // If we change the 23, also need to change the size of buf[] above
-    if (g_filemanager->write(fd, buf, 23) != ptr) {
+    // Safety check: keeping the hard-coded 27 and comparing against ptr.
+    // If we change the 27, also need to change the size of buf[] above
+    if (g_filemanager->write(fd, buf, 27) != ptr) {
       return false;
     }
     
@@ -101,6 +114,7 @@ bool DiskII::Serialize(int8_t fd)
       // Make sure we have flushed the disk images
       disk[i]->flush();
       flushAt[i] = 0; // and there's no need to re-flush them now
+      g_scheduler.cancel(EVT_DISK1FLUSH + i);
 
       buf[0] = 1;
       if (g_filemanager->write(fd, buf, 1) != 1)
@@ -144,7 +158,7 @@ bool DiskII::Deserialize(int8_t fd)
 
   for (int i=0; i<2; i++) {
     uint8_t ptr = 0;
-    if (g_filemanager->read(fd, buf, 23) != 23)
+    if (g_filemanager->read(fd, buf, 27) != 27)
       return false;
 
     curHalfTrack[i] = buf[ptr++];
@@ -173,6 +187,13 @@ bool DiskII::Deserialize(int8_t fd)
     diskIsSpinningUntil[i] <<= 8; diskIsSpinningUntil[i] |= buf[ptr++];
     diskIsSpinningUntil[i] <<= 8; diskIsSpinningUntil[i] |= buf[ptr++];
     diskIsSpinningUntil[i] <<= 8; diskIsSpinningUntil[i] |= buf[ptr++];
+    diskIsSpinningUntil[i] <<= 8; diskIsSpinningUntil[i] |= buf[ptr++];
+    diskIsSpinningUntil[i] <<= 8; diskIsSpinningUntil[i] |= buf[ptr++];
+    diskIsSpinningUntil[i] <<= 8; diskIsSpinningUntil[i] |= buf[ptr++];
+    diskIsSpinningUntil[i] <<= 8; diskIsSpinningUntil[i] |= buf[ptr++];
+    scheduleSpinDown(i);
+    flushAt[i] = 0;
+    g_scheduler.cancel(EVT_DISK1FLUSH + i);
     
     if (disk[i])
       delete disk[i];
@@ -230,9 +251,7 @@ void DiskII::driveOff()
 {
   if (diskIsSpinningUntil[selectedDisk] == -1) {
     diskIsSpinningUntil[selectedDisk] = g_cpu->cycles + SPINDOWNDELAY; // 1 second lag
-    if (diskIsSpinningUntil[selectedDisk] == -1 ||
-	diskIsSpinningUntil[selectedDisk] == 0)
-      diskIsSpinningUntil[selectedDisk] = 2; // fudge magic numbers; 0 is "off" and -1 is "forever".
+    scheduleSpinDown(selectedDisk);
 
     // The drive-is-on-indicator is turned off later, when the disk
     // actually spins down.
@@ -240,8 +259,7 @@ void DiskII::driveOff()
   
   if (disk[selectedDisk]) {
     flushAt[selectedDisk] = g_cpu->cycles + FLUSHDELAY;
-    if (flushAt[selectedDisk] == 0)
-      flushAt[selectedDisk] = 1; // fudge magic number; 0 is "don't flush"
+    scheduleFlush(selectedDisk);
   }
 }
 
@@ -254,6 +272,7 @@ void DiskII::driveOn()
     driveSpinupCycles[selectedDisk] = g_cpu->cycles;
     deliveredDiskBits[selectedDisk] = 0;
     diskIsSpinningUntil[selectedDisk] = -1; // magic "forever"
+    scheduleSpinDown(selectedDisk);
   }
   // FIXME: does the sequencer get reset? Maybe if it's the selected disk? Or no?
   // sequencer = 0;
@@ -465,6 +484,17 @@ void DiskII::setPhase(uint8_t phase)
   if (curHalfTrack[selectedDisk] != prevHalfTrack) {
     if (disk[selectedDisk]) {
       curWozTrack[selectedDisk] = disk[selectedDisk]->dataTrackNumberForQuarterTrack(curHalfTrack[selectedDisk]*2);
+
+      // Get the track we're on, and the next couple in the direction
+      // the head's moving, ready before the controller reads them
+      disk[selectedDisk]->prefetchTrack(curWozTrack[selectedDisk]);
+      int8_t dir = (curHalfTrack[selectedDisk] > prevHalfTrack) ? 1 : -1;
+      for (int8_t i=1; i<=PREFETCHHALFTRACKS; i++) {
+	int8_t ht = curHalfTrack[selectedDisk] + dir * i;
+	if (ht < 0 || ht > 35 * 2 - 1)
+	  break;
+	disk[selectedDisk]->prefetchTrack(disk[selectedDisk]->dataTrackNumberForQuarterTrack(ht*2));
+      }
     } else {
       curWozTrack[selectedDisk] = 0;
     }
@@ -489,7 +519,7 @@ int64_t DiskII::calcExpectedBits()
       driveSpinupCycles[selectedDisk]++;
   }
 
-  uint32_t cyclesPassed = g_cpu->cycles - driveSpinupCycles[selectedDisk];
+  uint64_t cyclesPassed = g_cpu->cycles - driveSpinupCycles[selectedDisk];
   // This constant defines how fast the disk drive "spins".
   // 4.0 is good for DOS 3.3 writes, and reads as 205ms in
   //   Copy 2+'s drive speed verifier.
@@ -574,6 +604,7 @@ void DiskII::ejectDisk(int8_t driveNum)
   if (disk[driveNum]) {
     disk[driveNum]->flush();
     flushAt[driveNum] = 0;
+    g_scheduler.cancel(EVT_DISK1FLUSH + driveNum);
     delete disk[driveNum];
     disk[driveNum] = NULL;
     g_ui->drawOnOffUIElement(UIeDisk1_state + driveNum, true);
@@ -593,20 +624,21 @@ void DiskII::select(int8_t which)
       // I read about the duoDisk not having both motors on
       // simultaneously.
       diskIsSpinningUntil[selectedDisk] = 0;
+      scheduleSpinDown(selectedDisk);
       // FIXME: consume any disk bits that need to be consumed, and
       // spin it down
       g_ui->drawOnOffUIElement(UIeDisk1_activity + selectedDisk, false); // FIXME: queue for later drawing?
 
       // Spin up the other one though
       diskIsSpinningUntil[which] = -1;
+      scheduleSpinDown(which);
       g_ui->drawOnOffUIElement(UIeDisk1_activity + which, false); // FIXME: queue for later drawing?
     }
     
     // Queue flushing the cache of the disk that's no longer selected
     if (disk[selectedDisk]) {
       flushAt[selectedDisk] = g_cpu->cycles + FLUSHDELAY;
-      if (flushAt[selectedDisk] == 0)
-	flushAt[selectedDisk] = 1; // fudge magic number; 0 is "don't flush"
+      scheduleFlush(selectedDisk);
     }
     
     // set the selected disk drive
@@ -741,27 +773,48 @@ void DiskII::loadROM(uint8_t *toWhere)
 #endif
 }
 
-void DiskII::maintenance(uint32_t cycle)
+// Keep the scheduler in step with diskIsSpinningUntil[drive]: there's
+// a spin-down event only while the drive is coasting to a stop.
+void DiskII::scheduleSpinDown(int8_t drive)
 {
-  // Handle spin-down for the drive. Drives stay on for a second after
-  // the stop was noticed.
-  for (int i=0; i<2; i++) {
-    if (diskIsSpinningUntil[i] && 
-	g_cpu->cycles > diskIsSpinningUntil[i]) {
-      // Stop the given disk drive spinning
-      diskIsSpinningUntil[i] = 0;
+  if (diskIsSpinningUntil[drive] == 0 ||
+      diskIsSpinningUntil[drive] == (uint64_t)-1) {
+    g_scheduler.cancel(EVT_DISK1SPINDOWN + drive);
+  } else {
+    g_scheduler.schedule(EVT_DISK1SPINDOWN + drive, diskIsSpinningUntil[drive]);
+  }
+}
+
+void DiskII::scheduleFlush(int8_t drive)
+{
+  g_scheduler.schedule(EVT_DISK1FLUSH + drive, flushAt[drive]);
+}
+
+void DiskII::diskEvent(void *obj, uint8_t event, uint64_t when)
+{
+  DiskII *d = (DiskII *)obj;
+
+  switch (event) {
+  case EVT_DISK1SPINDOWN:
+  case EVT_DISK2SPINDOWN:
+    {
+      // Drives stay on for a second after the stop was noticed.
+      int8_t i = event - EVT_DISK1SPINDOWN;
+      d->diskIsSpinningUntil[i] = 0;
       // FIXME: consume any disk bits that need to be consumed, and spin it down
       g_ui->drawOnOffUIElement(UIeDisk1_activity + i, false); // FIXME: queue for later drawing?
     }
-
-    if (flushAt[i] &&
-	g_cpu->cycles > flushAt[i]) {
-      if (disk[i]) {
-	disk[i]->flush();
+    break;
+  case EVT_DISK1FLUSH:
+  case EVT_DISK2FLUSH:
+    {
+      int8_t i = event - EVT_DISK1FLUSH;
+      if (d->disk[i]) {
+	d->disk[i]->flush();
       }
-      flushAt[i] = 0;
+      d->flushAt[i] = 0;
     }
-
+    break;
   }
 }
 
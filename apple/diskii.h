@@ -35,10 +35,14 @@ class DiskII : public Slot {
 
   const char *DiskName(int8_t num);
 
-  void maintenance(uint32_t cycles);
-
   uint8_t selectedDrive();
   uint8_t headPosition(uint8_t drive);
+
+  // True while a drive with a disk in it has its motor running
+  bool motorIsOn() {
+    return ((disk[0] && diskIsSpinningUntil[0]) ||
+	    (disk[1] && diskIsSpinningUntil[1]));
+  }
   
  private:
   void setPhase(uint8_t phase);
@@ -51,6 +55,10 @@ class DiskII : public Slot {
   void driveOn();
   void driveOff();
 
+  void scheduleSpinDown(int8_t drive);
+  void scheduleFlush(int8_t drive);
+  static void diskEvent(void *obj, uint8_t event, uint64_t when);
+
 #ifndef TEENSYDUINO
   void convertDskToNib(const char *outFN);
 #endif
@@ -73,11 +81,11 @@ private:
   bool writeProt;
   AppleMMU *mmu;
 
-  volatile uint32_t diskIsSpinningUntil[2];
+  volatile uint64_t diskIsSpinningUntil[2];
 
   volatile int8_t selectedDisk;
 
-  volatile uint32_t flushAt[2];
+  volatile uint64_t flushAt[2];
 };
 
 #endif
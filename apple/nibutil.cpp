@@ -96,7 +96,7 @@ static void _encodeData(uint8_t *outputBuffer, bitPtr *ptr, const uint8_t input[
 {
   int ptr2 = 0;
   int ptr6 = 0x56;
-  static int nibbles[0x156];
+  uint8_t nibbles[0x156];
 
   memset(nibbles, 0, sizeof(nibbles));
 
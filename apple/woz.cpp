@@ -14,7 +14,6 @@ extern    uint32_t FreeRamEstimate();
 
 #ifdef TEENSYDUINO
 #define SKIPCHECKSUM
-#define STATICALLOC
 #endif
 
 #define PREP_SECTION(fd, t) {      \
@@ -46,33 +45,49 @@ Woz::Woz(bool verbose, uint8_t dumpflags)
   metaData = NULL;
   this->verbose = verbose;
   this->dumpflags = dumpflags;
-  dataTrackDirty = -1;
+  autoFlushTrackData = false;
 
   memset(&quarterTrackMap, 255, sizeof(quarterTrackMap));
   memset(&di, 0, sizeof(diskInfo));
   memset(&tracks, 0, sizeof(tracks));
+  memset(trackDirty, 0, sizeof(trackDirty));
+  memset(trackLastUsed, 0, sizeof(trackLastUsed));
+  trackUseClock = 0;
+  lastUsedTrack = 0xFF;
+#ifdef STATICALLOC
+  memset(cachedTrackOwner, 0xFF, sizeof(cachedTrackOwner));
+#endif
+#ifdef TRACKPREFETCH
+  for (int i=0; i<WOZPREFETCHSLOTS; i++) {
+    prefetchSlots[i].state.store(PF_FREE);
+  }
+  prefetchRequestCount = 0;
+  memset(trackGeneration, 0, sizeof(trackGeneration));
+  prefetchRunning = false;
+  prefetchQuit = false;
+  pthread_mutex_init(&prefetchLock, NULL);
+  pthread_cond_init(&prefetchWake, NULL);
+#endif
   randPtr = 0;
 }
 
 Woz::~Woz()
 {
+#ifdef TRACKPREFETCH
+  stopPrefetch();
+  pthread_mutex_destroy(&prefetchLock);
+  pthread_cond_destroy(&prefetchWake);
+#endif
   if (fd != -1) {
     close(fd);
     fd = -1;
   }
 
-#ifdef STATICALLOC
-  for (int i=0; i<160; i++) {
-    tracks[i].trackData = NULL;
-  }
-#else
   for (int i=0; i<160; i++) {
     if (tracks[i].trackData) {
-      free(tracks[i].trackData);
-      tracks[i].trackData = NULL;
+      freeTrack(i);
     }
   }
-#endif
   if (metaData) {
     free(metaData);
     metaData = NULL;
@@ -105,7 +120,7 @@ bool Woz::writeNextWozBit(uint8_t datatrack, uint8_t bit)
 
   advanceBitStream(datatrack);
   
-  dataTrackDirty = datatrack;
+  trackDirty[datatrack] = true;
   
   return true;
 }
@@ -137,6 +152,10 @@ void Woz::loadTrackByte(uint8_t datatrack)
 {
   // need another byte out of the track stream
   if (tracks[datatrack].trackData) {
+    if (datatrack != lastUsedTrack) {
+      lastUsedTrack = datatrack;
+      trackLastUsed[datatrack] = ++trackUseClock;
+    }
     lastReadPointer = trackPointer;
     trackByte = tracks[datatrack].trackData[trackPointer];
   } else {
@@ -642,7 +661,11 @@ void Woz::_initInfo()
 
   // reset all the track data
   for (int i=0; i<160; i++) {
+    if (tracks[i].trackData) {
+      freeTrack(i);
+    }
     memset(&tracks[i], 0, sizeof(trackInfo));
+    trackDirty[i] = false;
   }
   // Construct a default quarter-track mapping
   for (int i=0; i<140; i++) {
@@ -654,28 +677,79 @@ void Woz::_initInfo()
   }
 }
 
-// Only used if we didn't preload a data track; the load we perform
-// differs based on the image type we originally read from
-bool Woz::loadMissingTrackFromImage(uint8_t datatrack)
+// Returns a zeroed buffer of 'size' bytes to load 'datatrack' in to
+// (or NULL if there isn't one). When we're loading tracks on demand,
+// this is where the cache is kept to its budget.
+uint8_t *Woz::allocTrack(uint8_t datatrack, uint32_t size)
 {
-  // If we're going to malloc a new one, then find all the other ones
-  // that might be malloc'd and purge them if we're
-  // autoFlushTrackData==true (trying to limit memory use)
-  if (autoFlushTrackData == true) {
-    flush();
+  if (autoFlushTrackData) {
+    while (1) {
+      uint8_t cached = 0;
+      uint8_t oldest = 0xFF;
+      for (int i=0; i<160; i++) {
+	if (tracks[i].trackData && i != datatrack) {
+	  cached++;
+	  if (oldest == 0xFF || trackLastUsed[i] < trackLastUsed[oldest]) {
+	    oldest = i;
+	  }
+	}
+      }
+      if (cached < WOZCACHEDTRACKS)
+	break;
+      evictTrack(oldest);
+    }
+  }
+
+  trackLastUsed[datatrack] = ++trackUseClock;
+
 #ifdef STATICALLOC
-    for (int i=0; i<160; i++) {
-      tracks[i].trackData = NULL;
+  if (size > NIBTRACKSIZE) {
+    fprintf(stderr, "ERROR: track %d needs %d bytes; cached tracks only hold %d\n", datatrack, size, NIBTRACKSIZE);
+    return NULL;
+  }
+  for (int i=0; i<WOZCACHEDTRACKS; i++) {
+    if (cachedTrackOwner[i] == 0xFF) {
+      cachedTrackOwner[i] = datatrack;
+      memset(cachedTracks[i], 0, NIBTRACKSIZE);
+      return cachedTracks[i];
     }
+  }
+  fprintf(stderr, "ERROR: no free track buffers\n");
+  return NULL;
 #else
-    for (int i=0; i<160; i++) {
-      if (tracks[i].trackData) {
-        free(tracks[i].trackData);
-        tracks[i].trackData = NULL;
-      }
+  return (uint8_t *)calloc(size, 1);
+#endif
+}
+
+void Woz::freeTrack(uint8_t datatrack)
+{
+#ifdef STATICALLOC
+  for (int i=0; i<WOZCACHEDTRACKS; i++) {
+    if (tracks[datatrack].trackData == cachedTracks[i]) {
+      cachedTrackOwner[i] = 0xFF;
     }
+  }
+#else
+  free(tracks[datatrack].trackData);
 #endif
+  tracks[datatrack].trackData = NULL;
+  if (lastUsedTrack == datatrack)
+    lastUsedTrack = 0xFF;
+}
+
+// Drops a track from the cache, writing it back first if it's changed
+void Woz::evictTrack(uint8_t datatrack)
+{
+  if (trackDirty[datatrack]) {
+    flushTrack(datatrack);
   }
+  freeTrack(datatrack);
+}
+
+// Only used if we didn't preload a data track; the load we perform
+// differs based on the image type we originally read from
+bool Woz::loadMissingTrackFromImage(uint8_t datatrack)
+{
   // Based on the source image type, load the data track we're looking for
   if (imageType == T_WOZ) {
     // If the source was WOZ, just load the datatrack directly
@@ -690,6 +764,12 @@ bool Woz::loadMissingTrackFromImage(uint8_t datatrack)
       return true;
     }
     
+#ifdef TRACKPREFETCH
+    if (takePrefetchedTrack(datatrack)) {
+      return true;
+    }
+#endif
+
     uint8_t phystrack = datatrack; // used for clarity of which kind of track we mean, below
     
     static uint8_t sectorData[256*16];
@@ -701,16 +781,11 @@ bool Woz::loadMissingTrackFromImage(uint8_t datatrack)
       return false;
     }
     
-#ifdef STATICALLOC
-    tracks[datatrack].trackData = singleCachedTrack;
-    memset(singleCachedTrack, 0, sizeof(singleCachedTrack));
-#else
-    tracks[datatrack].trackData = (uint8_t *)calloc(NIBTRACKSIZE, 1);
+    tracks[datatrack].trackData = allocTrack(datatrack, NIBTRACKSIZE);
     if (!tracks[datatrack].trackData) {
       fprintf(stderr, "Failed to malloc track data\n");
       return false;
     }
-#endif    
     tracks[datatrack].startingBlock = STARTBLOCK + 13*phystrack; // make it look like it came from a WOZ2 image
     tracks[datatrack].blockCount = 13;
     uint32_t sizeInBits = nibblizeTrack(tracks[datatrack].trackData, sectorData, imageType, phystrack);
@@ -727,15 +802,10 @@ bool Woz::loadMissingTrackFromImage(uint8_t datatrack)
     // If the source was a NIB file, then the datatrack is directly
     // mapped 1:1 to the physical track
     uint8_t phystrack = datatrack; // used for clarity of which kind of track we mean, below
-#ifdef STATICALLOC
-    tracks[datatrack].trackData = singleCachedTrack;
-    memset(singleCachedTrack, 0, sizeof(singleCachedTrack));
-#else
-    tracks[datatrack].trackData = (uint8_t *)calloc(NIBTRACKSIZE, 1);
+    tracks[datatrack].trackData = allocTrack(datatrack, NIBTRACKSIZE);
     if (!tracks[datatrack].trackData) {
       return false;
     }
-#endif
     lseek(fd, NIBTRACKSIZE * phystrack, SEEK_SET);
     read(fd, tracks[datatrack].trackData, NIBTRACKSIZE);
     // FIXME: no error checking
@@ -780,16 +850,11 @@ bool Woz::readDskFile(const char *filename, bool preloadTracks, uint8_t subtype)
 	goto done;
       }
       uint8_t datatrack = quarterTrackMap[phystrack*4];
-#ifdef STATICALLOC
-      tracks[datatrack].trackData = singleCachedTrack;
-      memset(singleCachedTrack, 0, sizeof(singleCachedTrack));
-#else
-      tracks[datatrack].trackData = (uint8_t *)calloc(NIBTRACKSIZE, 1);
+      tracks[datatrack].trackData = allocTrack(datatrack, NIBTRACKSIZE);
       if (!tracks[datatrack].trackData) {
 	fprintf(stderr, "Failed to malloc track data\n");
 	goto done;
       }
-#endif
       tracks[datatrack].startingBlock = STARTBLOCK + 13*datatrack; // make it look like it came from a WOZ2 image
       tracks[datatrack].blockCount = 13;
       uint32_t sizeInBits = nibblizeTrack(tracks[datatrack].trackData, sectorData, subtype, phystrack);
@@ -798,6 +863,11 @@ bool Woz::readDskFile(const char *filename, bool preloadTracks, uint8_t subtype)
   }
   
   retval = true;
+#ifdef TRACKPREFETCH
+  if (!preloadTracks) {
+    startPrefetch();
+  }
+#endif
 
  done:
   return retval;
@@ -830,16 +900,11 @@ bool Woz::readNibFile(const char *filename, bool preloadTracks)
 	return false;
       }
       uint8_t datatrack = quarterTrackMap[phystrack * 4];
-#ifdef STATICALLOC
-      tracks[datatrack].trackData = singleCachedTrack;
-      memset(singleCachedTrack, 0, sizeof(singleCachedTrack));
-#else
-      tracks[datatrack].trackData = (uint8_t *)calloc(NIBTRACKSIZE, 1);
+      tracks[datatrack].trackData = allocTrack(datatrack, NIBTRACKSIZE);
       if (!tracks[datatrack].trackData) {
 	fprintf(stderr, "Failed to malloc track data\n");
 	return false;
       }
-#endif 
       memcpy(tracks[datatrack].trackData, nibData, NIBTRACKSIZE);
       tracks[datatrack].startingBlock = STARTBLOCK + 13*phystrack; // make it look like it came from a WOZ2 image
       tracks[datatrack].blockCount = 13;
@@ -1013,6 +1078,10 @@ bool Woz::readFile(const char *filename, bool preloadTracks, uint8_t forceType)
 {
 #ifdef STATICALLOC
   preloadTracks = false;
+#endif
+#ifdef TRACKPREFETCH
+  // The worker reads from fd, which is about to change
+  stopPrefetch();
 #endif
   if (forceType == T_AUTO) {
     // Try to determine type from the file extension
@@ -1216,20 +1285,12 @@ bool Woz::readWozDataTrack(uint8_t datatrack)
   if (tracks[datatrack].trackData) {
     return true; // We've already read this track's data; don't re-read it
   }
-#ifdef STATICALLOC
-  tracks[datatrack].trackData = singleCachedTrack;
-  memset(singleCachedTrack, 0, sizeof(singleCachedTrack));
-  if (count > sizeof(singleCachedTrack)) {
-    fprintf(stderr, "Want to alloc buffer than size of singleCachedTrack! About to overrun memory");
-  }
-#else
-  tracks[datatrack].trackData = (uint8_t *)calloc(count, 1);
+  tracks[datatrack].trackData = allocTrack(datatrack, count);
   if (!tracks[datatrack].trackData) {
     perror("Failed to alloc buf to read track magnetic data");
 
     return false;
   }
-#endif
   if (di.version == 1) {
     if (verbose) {
       printf("Reading datatrack[1] %d starting at byte 0x%X\n",
@@ -1727,38 +1788,212 @@ uint8_t Woz::dataTrackNumberForQuarterTrack(uint16_t qt)
   return quarterTrackMap[qt];
 }
 
-bool Woz::flush()
+void Woz::prefetchTrack(uint8_t datatrack)
+{
+#ifdef TRACKPREFETCH
+  if (!prefetchRunning || datatrack >= 35 || tracks[datatrack].trackData)
+    return;
+
+  // Use a free slot if there is one, or else the oldest finished one -
+  // unless this track's already been asked for
+  int8_t use = -1;
+  bool useIsFree = false;
+  for (int i=0; i<WOZPREFETCHSLOTS; i++) {
+    prefetchSlot *slot = &prefetchSlots[i];
+    uint8_t state = slot->state.load(std::memory_order_acquire);
+    if (state == PF_READY &&
+	slot->generation != trackGeneration[slot->datatrack]) {
+      // It's been written back since this was read; nobody can use it
+      slot->state.store(PF_FREE, std::memory_order_relaxed);
+      state = PF_FREE;
+    }
+    if (state != PF_FREE && slot->datatrack == datatrack)
+      return;
+
+    if (state == PF_FREE) {
+      if (!useIsFree) {
+	use = i;
+	useIsFree = true;
+      }
+    } else if (state == PF_READY && !useIsFree) {
+      if (use == -1 || slot->requested < prefetchSlots[use].requested)
+	use = i;
+    }
+  }
+  if (use == -1)
+    return; // the worker's busy with all of them
+
+  prefetchSlot *slot = &prefetchSlots[use];
+  slot->datatrack = datatrack;
+  slot->generation = trackGeneration[datatrack];
+  slot->requested = ++prefetchRequestCount;
+  slot->state.store(PF_BUSY, std::memory_order_relaxed);
+  if (!prefetchRequests.push(use)) {
+    slot->state.store(PF_FREE, std::memory_order_relaxed);
+    return;
+  }
+
+  pthread_mutex_lock(&prefetchLock);
+  pthread_cond_signal(&prefetchWake);
+  pthread_mutex_unlock(&prefetchLock);
+#endif
+}
+
+#ifdef TRACKPREFETCH
+void Woz::startPrefetch()
+{
+  prefetchQuit = false;
+  if (pthread_create(&prefetchThreadID, NULL, &prefetchThread, (void *)this)) {
+    fprintf(stderr, "Unable to start track prefetch thread; loading tracks on demand\n");
+    return;
+  }
+  prefetchRunning = true;
+}
+
+void Woz::stopPrefetch()
+{
+  if (!prefetchRunning)
+    return;
+
+  pthread_mutex_lock(&prefetchLock);
+  prefetchQuit = true;
+  pthread_cond_signal(&prefetchWake);
+  pthread_mutex_unlock(&prefetchLock);
+  pthread_join(prefetchThreadID, NULL);
+  prefetchRunning = false;
+
+  // Anything it had done, or hadn't got to yet, was for this image
+  while (prefetchRequests.peek()) {
+    prefetchRequests.pop();
+  }
+  for (int i=0; i<WOZPREFETCHSLOTS; i++) {
+    prefetchSlots[i].state.store(PF_FREE);
+  }
+}
+
+void *Woz::prefetchThread(void *arg)
+{
+  ((Woz *)arg)->prefetchWork();
+  return NULL;
+}
+
+void Woz::prefetchWork()
+{
+  uint8_t sectorData[256*16];
+
+  while (1) {
+    const uint8_t *next = NULL;
+    pthread_mutex_lock(&prefetchLock);
+    while (!prefetchQuit && (next = prefetchRequests.peek()) == NULL) {
+      pthread_cond_wait(&prefetchWake, &prefetchLock);
+    }
+    bool quit = prefetchQuit;
+    pthread_mutex_unlock(&prefetchLock);
+    if (quit)
+      return;
+
+    prefetchSlot *slot = &prefetchSlots[*next];
+    prefetchRequests.pop();
+
+    // pread() doesn't move the file offset, so this can't upset the CPU
+    // thread's own reads and writes
+    uint8_t phystrack = slot->datatrack;
+    if (pread(fd, sectorData, 256*16, 256*16*phystrack) == 256*16) {
+      memset(slot->data, 0, sizeof(slot->data));
+      slot->bitCount = nibblizeTrack(slot->data, sectorData, imageType, phystrack);
+      slot->state.store(PF_READY, std::memory_order_release);
+    } else {
+      slot->state.store(PF_FREE, std::memory_order_release);
+    }
+  }
+}
+
+// If the worker's already nibblized this track (and it hasn't been
+// written back since), load it from there
+bool Woz::takePrefetchedTrack(uint8_t datatrack)
 {
-  // This has to flush just one track to the file. If it tried to do more,
-  // it would wind up trying to preload the tracks that aren't loaded; and
-  // that would notice that the current track is dirty, so it would call
-  // flush() again; and then we'd be looping infinitely.
+  for (int i=0; i<WOZPREFETCHSLOTS; i++) {
+    prefetchSlot *slot = &prefetchSlots[i];
+    if (slot->state.load(std::memory_order_acquire) != PF_READY ||
+	slot->datatrack != datatrack)
+      continue;
+
+    if (slot->generation == trackGeneration[datatrack]) {
+      tracks[datatrack].trackData = allocTrack(datatrack, NIBTRACKSIZE);
+      if (tracks[datatrack].trackData) {
+	memcpy(tracks[datatrack].trackData, slot->data, NIBTRACKSIZE);
+	tracks[datatrack].startingBlock = STARTBLOCK + 13*datatrack; // make it look like it came from a WOZ2 image
+	tracks[datatrack].blockCount = 13;
+	tracks[datatrack].bitCount = slot->bitCount;
+      }
+    }
+    slot->state.store(PF_FREE, std::memory_order_relaxed);
+    return tracks[datatrack].trackData != NULL;
+  }
+  return false;
+}
+#endif
 
+// Writes back every track that's changed. They're all still loaded -
+// eviction writes a dirty track back before dropping it - so none of
+// this has to load anything.
+bool Woz::flush()
+{
   // FIXME: this assumes we have an open fd, which means we didn't preload
   // the whole image
 
   bool ret = true;
-  if (dataTrackDirty != -1) {
-    // From the imageType, call the appropriate function to write a track
-    switch (imageType) {
-    case T_WOZ:
-      ret = writeWozTrack(fd, dataTrackDirty, imageType);
-      break;
-    case T_DSK:
-    case T_PO:
-      ret = writeDskTrack(fd, dataTrackDirty, imageType);
-      break;
-    case T_NIB:
-      ret = writeNibTrack(fd, dataTrackDirty, imageType);
-      break;
-    default:
-      fprintf(stderr, "Error: unknown imageType; can't flush\n");
-      ret = false;
-      break;
+  for (int i=0; i<160; i++) {
+    if (trackDirty[i]) {
+      if (!flushTrack(i))
+	ret = false;
     }
-    //    fsync(fd); // FIXME should not be needed
   }
+  return ret;
+}
+
+bool Woz::flushTrack(uint8_t datatrack)
+{
+  // Decoding the track back out moves the read cursor, and we may be
+  // evicting in the middle of a read on another track; put it back
+  // when we're done
+  uint32_t savedTrackPointer = trackPointer;
+  uint32_t savedLastReadPointer = lastReadPointer;
+  uint32_t savedTrackBitCounter = trackBitCounter;
+  uint8_t savedTrackByte = trackByte;
+  uint8_t savedTrackBitIdx = trackBitIdx;
+  uint8_t savedTrackLoopCounter = trackLoopCounter;
+
+  bool ret = true;
+  // From the imageType, call the appropriate function to write a track
+  switch (imageType) {
+  case T_WOZ:
+    ret = writeWozTrack(fd, datatrack, imageType);
+    break;
+  case T_DSK:
+  case T_PO:
+    ret = writeDskTrack(fd, datatrack, imageType);
+    break;
+  case T_NIB:
+    ret = writeNibTrack(fd, datatrack, imageType);
+    break;
+  default:
+    fprintf(stderr, "Error: unknown imageType; can't flush\n");
+    ret = false;
+    break;
+  }
+  //    fsync(fd); // FIXME should not be needed
+
+  trackDirty[datatrack] = false;
+#ifdef TRACKPREFETCH
+  trackGeneration[datatrack]++;
+#endif
 
-  dataTrackDirty = -1;
+  trackPointer = savedTrackPointer;
+  lastReadPointer = savedLastReadPointer;
+  trackBitCounter = savedTrackBitCounter;
+  trackByte = savedTrackByte;
+  trackBitIdx = savedTrackBitIdx;
+  trackLoopCounter = savedTrackLoopCounter;
   return ret;
 }
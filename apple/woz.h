@@ -7,6 +7,17 @@
 #include <stdbool.h>
 #include "nibutil.h"
 #include "disktypes.h"
+#ifdef TRACKPREFETCH
+#include <pthread.h>
+#include <atomic>
+#include "spscring.h"
+#endif
+
+// Teensy can't afford to malloc tracks; the track pool's declared
+// below, so this has to be settled before the class is
+#ifdef TEENSYDUINO
+#define STATICALLOC
+#endif
 
 #define DUMP_TRACK         0x01
 #define DUMP_QTMAP         0x02
@@ -17,6 +28,23 @@
 #define DUMP_RAWTRACK      0x40
 #define DUMP_ORDEREDSECTOR 0x80
 
+// How much memory each image may spend on tracks it's loaded on demand
+// (which is how the disk drives use it). Past that, the least recently
+// used track is written back if it's dirty, and dropped.
+#ifndef WOZCACHEBYTES
+#ifdef TEENSYDUINO
+#define WOZCACHEBYTES (NIBTRACKSIZE * 1)
+#else
+#define WOZCACHEBYTES (NIBTRACKSIZE * 8)
+#endif
+#endif
+#define WOZCACHEDTRACKS (WOZCACHEBYTES / NIBTRACKSIZE)
+
+// With TRACKPREFETCH, DSK and PO images get a worker thread that
+// nibblizes tracks the drive is about to need (see prefetchTrack()) in
+// to this many staging buffers, so the CPU thread only has to copy them
+#define WOZPREFETCHSLOTS 4
+
 
 typedef struct _diskInfo {
   uint8_t version;          // Woz format version #
@@ -56,6 +84,9 @@ class Woz {
   bool isSynchronized();
 
   uint8_t dataTrackNumberForQuarterTrack(uint16_t qt);
+
+  // Hint that 'datatrack' will probably be read soon
+  void prefetchTrack(uint8_t datatrack);
   
   bool flush();
 
@@ -106,6 +137,19 @@ class Woz {
   bool readNibSectorData(uint8_t phystrack, uint8_t sector, nibSector *sectorData);
 
   bool loadMissingTrackFromImage(uint8_t datatrack);
+
+  uint8_t *allocTrack(uint8_t datatrack, uint32_t size);
+  void freeTrack(uint8_t datatrack);
+  void evictTrack(uint8_t datatrack);
+  bool flushTrack(uint8_t datatrack);
+
+#ifdef TRACKPREFETCH
+  void startPrefetch();
+  void stopPrefetch();
+  static void *prefetchThread(void *arg);
+  void prefetchWork();
+  bool takePrefetchedTrack(uint8_t datatrack);
+#endif
   
   bool checksumWozDataTrack(uint8_t datatrack, uint32_t *retCRC);
 
@@ -117,13 +161,48 @@ class Woz {
   bool verbose;
   uint8_t dumpflags;
 
-  bool autoFlushTrackData;
-  int8_t dataTrackDirty; // -1 means "none"
-  
+  bool autoFlushTrackData; // only keep WOZCACHEDTRACKS tracks loaded
+  bool trackDirty[160];     // written to since it was loaded/flushed
+
   uint8_t quarterTrackMap[40*4];
   diskInfo di;
   trackInfo tracks[160];
-  uint8_t singleCachedTrack[0x1A00];
+
+  // When each track was last used, for picking which one to evict
+  uint32_t trackLastUsed[160];
+  uint32_t trackUseClock;
+  uint8_t lastUsedTrack;
+
+#ifdef STATICALLOC
+  uint8_t cachedTracks[WOZCACHEDTRACKS][NIBTRACKSIZE];
+  uint8_t cachedTrackOwner[WOZCACHEDTRACKS]; // datatrack, or 0xFF if free
+#endif
+
+#ifdef TRACKPREFETCH
+  // A slot is only touched by the CPU thread while it's PF_FREE or
+  // PF_READY, and only by the worker while it's PF_BUSY
+  enum { PF_FREE = 0, PF_BUSY, PF_READY };
+  struct prefetchSlot {
+    std::atomic<uint8_t> state;
+    uint8_t datatrack;
+    uint32_t generation; // trackGeneration[datatrack] when requested
+    uint32_t requested;  // request order, for reusing the oldest
+    uint32_t bitCount;
+    uint8_t data[NIBTRACKSIZE];
+  };
+  prefetchSlot prefetchSlots[WOZPREFETCHSLOTS];
+  SPSCRing<uint8_t, 8> prefetchRequests; // slot indexes
+  uint32_t prefetchRequestCount;
+  // Bumped whenever a track's written back, so anything nibblized from
+  // the image before then is known to be stale
+  uint32_t trackGeneration[160];
+
+  bool prefetchRunning;
+  bool prefetchQuit;
+  pthread_t prefetchThreadID;
+  pthread_mutex_t prefetchLock;
+  pthread_cond_t prefetchWake;
+#endif
 
   // cursor for track enumeration
 protected:
@@ -133,7 +133,7 @@ bool BIOS::runUntilDone()
     case ACT_DISPLAYTYPE:
       g_displayType++;
       g_displayType %= 4; // FIXME: abstract max #
-      ((AppleDisplay*)g_display)->displayTypeChanged();
+      ((AppleDisplay*)g_vm->vmdisplay)->displayTypeChanged();
       break;
     case ACT_ABOUT:
       showAbout();
@@ -0,0 +1,902 @@
+#ifndef __CPU_THREADED_H
+#define __CPU_THREADED_H
+
+// Per-opcode handlers for the table-dispatched ("threaded") 65C02 core.
+//
+// Cpu::step() normally decodes each instruction with two switch
+// statements - one on the addressing mode and one on the operation.
+// When built with -DTHREADEDCPU, each of the 256 opcodes instead gets
+// its own handler with its addressing mode baked in by template
+// instantiation. Cpu::step() fetches the opcode and its 0-2 operand
+// bytes, then makes one indirect call through CpuCore<>::handlers[].
+//
+// Handlers return the number of *extra* cycles they took (taken
+// branches, decimal mode); the base cycle count lives in the table.
+//
+// This file is only meant to be included from cpu.cpp.
+
+#include "cpu.h"
+#include "mmu.h"
+
+typedef uint8_t (*cpuhandler_fn)(Cpu *c, uint16_t operand);
+
+typedef struct {
+  cpuhandler_fn fn;
+  uint8_t length;  // opcode + operand bytes
+  uint8_t cycles;  // base cycle count
+} cpuhandler_t;
+
+#define READMEM(addr) busRead(c, addr)
+#define WRITEMEM(addr, val) busWrite(c, addr, val)
+
+#define CFLAG(bit, condition) { if (condition) {c->flags |= bit;} else {c->flags &= ~bit;} }
+
+// A fully decoded instruction: everything Cpu::step() needs to run it
+// without touching memory again.
+struct decodedinsn_t {
+  cpuhandler_fn fn;
+  uint16_t pc;
+  uint16_t operand;
+  uint8_t length;
+  uint8_t cycles;
+};
+
+// The handlers, compiled against the MMU class BUS
+template <class BUS>
+struct CpuCore {
+  // Memory access. BUS is the concrete MMU class, so (if it's 'final')
+  // read() and write() are direct calls rather than virtual ones.
+  static inline uint8_t busRead(Cpu *c, uint16_t addr)
+  {
+    BUS *bus = static_cast<BUS *>(c->mmu);
+    uint8_t *p = bus->readPointers[addr >> 8];
+    return p ? p[addr & 0xFF] : bus->read(addr);
+  }
+
+  static inline void busWrite(Cpu *c, uint16_t addr, uint8_t val)
+  {
+    BUS *bus = static_cast<BUS *>(c->mmu);
+    uint8_t *p = bus->writePointers[addr >> 8];
+    if (p) {
+      p[addr & 0xFF] = val;
+#ifdef BLOCKCACHE
+      // write() takes care of this itself when we don't bypass it
+      c->invalidateCode(bus->writeCodePages[addr >> 8], addr & 0xFF);
+#endif
+    } else {
+      bus->write(addr, val);
+    }
+  }
+
+  static inline void setNZ(Cpu *c, uint8_t v)
+  {
+    c->flags = (c->flags & ~(F_N | F_Z)) | (v & 0x80) | (v ? 0 : F_Z);
+  }
+
+  static inline void push8(Cpu *c, uint8_t b)
+  {
+    WRITEMEM(0x100 + c->sp, b);
+    c->sp--;
+  }
+
+  static inline void push16(Cpu *c, uint16_t w)
+  {
+    push8(c, (w >> 8) & 0xFF);
+    push8(c, w & 0xFF);
+  }
+
+  static inline uint8_t pop8(Cpu *c)
+  {
+    c->sp++;
+    return READMEM(0x100 + c->sp);
+  }
+
+  static inline uint16_t pop16(Cpu *c)
+  {
+    uint8_t lsb = pop8(c);
+    uint8_t msb = pop8(c);
+    return (msb << 8) | lsb;
+  }
+
+  // Resolve an operand to an effective address. 'operand' holds the
+  // raw bytes that followed the opcode (low byte first).
+  template <addrmode M>
+  static inline uint16_t effectiveAddress(Cpu *c, uint16_t operand)
+  {
+    switch (M) {
+    case A_ZER:
+    case A_ABS:
+    default:
+      return operand;
+    case A_ZEX:
+      return (operand + c->x) & 0xFF;
+    case A_ZEY:
+      return (operand + c->y) & 0xFF;
+    case A_ABX:
+      return operand + c->x;
+    case A_ABY:
+      return operand + c->y;
+    case A_INX:
+      {
+	uint8_t zpL = operand + c->x;
+	uint8_t zpH = zpL + 1;
+	return READMEM(zpL) | (READMEM(zpH) << 8);
+      }
+    case A_INY:
+      {
+	uint8_t zpL = operand;
+	uint8_t zpH = zpL + 1;
+	return (READMEM(zpL) | (READMEM(zpH) << 8)) + c->y;
+      }
+    case A_ZIND:
+      {
+	// Wraps around zero-page
+	uint8_t zpL = operand;
+	uint8_t zpH = zpL + 1;
+	return READMEM(zpL) | (READMEM(zpH) << 8);
+      }
+    case A_ABI:
+      return READMEM(operand) | (READMEM((uint16_t)(operand + 1)) << 8);
+    case A_ABXI:
+      {
+	uint16_t addr = operand + c->x;
+	return READMEM(addr) | (READMEM((uint16_t)(addr + 1)) << 8);
+      }
+    }
+  }
+
+  // Fetch the value an instruction operates on. Immediate mode already
+  // has it in the operand.
+  template <addrmode M>
+  static inline uint8_t operandValue(Cpu *c, uint16_t operand)
+  {
+    if (M == A_IMM)
+      return operand & 0xFF;
+    return READMEM(effectiveAddress<M>(c, operand));
+  }
+
+  static inline uint8_t compare(Cpu *c, uint8_t reg, uint8_t v)
+  {
+    uint16_t tmp = reg - v;
+    CFLAG(F_C, tmp < 0x100);
+    CFLAG(F_Z, !(tmp & 0xFF));
+    CFLAG(F_N, tmp & 0x80);
+    return 0;
+  }
+
+  // Relative branches: taken branches cost one more cycle.
+  static inline uint8_t branch(Cpu *c, uint16_t operand, bool taken)
+  {
+    if (!taken)
+      return 0;
+    c->pc += (int8_t)(operand & 0xFF);
+    return 1;
+  }
+
+  /* Loads, stores and register transfers */
+
+  template <addrmode M> static uint8_t op_LDA(Cpu *c, uint16_t o) { c->a = operandValue<M>(c, o); setNZ(c, c->a); return 0; }
+  template <addrmode M> static uint8_t op_LDX(Cpu *c, uint16_t o) { c->x = operandValue<M>(c, o); setNZ(c, c->x); return 0; }
+  template <addrmode M> static uint8_t op_LDY(Cpu *c, uint16_t o) { c->y = operandValue<M>(c, o); setNZ(c, c->y); return 0; }
+  template <addrmode M> static uint8_t op_STA(Cpu *c, uint16_t o) { WRITEMEM(effectiveAddress<M>(c, o), c->a); return 0; }
+  template <addrmode M> static uint8_t op_STX(Cpu *c, uint16_t o) { WRITEMEM(effectiveAddress<M>(c, o), c->x); return 0; }
+  template <addrmode M> static uint8_t op_STY(Cpu *c, uint16_t o) { WRITEMEM(effectiveAddress<M>(c, o), c->y); return 0; }
+  template <addrmode M> static uint8_t op_STZ(Cpu *c, uint16_t o) { WRITEMEM(effectiveAddress<M>(c, o), 0x00); return 0; }
+
+  static uint8_t op_TAX(Cpu *c, uint16_t o) { c->x = c->a; setNZ(c, c->x); return 0; }
+  static uint8_t op_TAY(Cpu *c, uint16_t o) { c->y = c->a; setNZ(c, c->y); return 0; }
+  static uint8_t op_TXA(Cpu *c, uint16_t o) { c->a = c->x; setNZ(c, c->a); return 0; }
+  static uint8_t op_TYA(Cpu *c, uint16_t o) { c->a = c->y; setNZ(c, c->a); return 0; }
+  static uint8_t op_TSX(Cpu *c, uint16_t o) { c->x = c->sp; setNZ(c, c->x); return 0; }
+  static uint8_t op_TXS(Cpu *c, uint16_t o) { c->sp = c->x; return 0; }
+
+  /* Stack */
+
+  static uint8_t op_PHA(Cpu *c, uint16_t o) { push8(c, c->a); return 0; }
+  static uint8_t op_PHX(Cpu *c, uint16_t o) { push8(c, c->x); return 0; }
+  static uint8_t op_PHY(Cpu *c, uint16_t o) { push8(c, c->y); return 0; }
+  static uint8_t op_PHP(Cpu *c, uint16_t o) { push8(c, c->flags | F_B); return 0; }
+  static uint8_t op_PLA(Cpu *c, uint16_t o) { c->a = pop8(c); setNZ(c, c->a); return 0; }
+  static uint8_t op_PLX(Cpu *c, uint16_t o) { c->x = pop8(c); setNZ(c, c->x); return 0; }
+  static uint8_t op_PLY(Cpu *c, uint16_t o) { c->y = pop8(c); setNZ(c, c->y); return 0; }
+  static uint8_t op_PLP(Cpu *c, uint16_t o) { c->flags = pop8(c) | F_UNK; return 0; }
+
+  /* Logic and arithmetic */
+
+  template <addrmode M> static uint8_t op_AND(Cpu *c, uint16_t o) { c->a &= operandValue<M>(c, o); setNZ(c, c->a); return 0; }
+  template <addrmode M> static uint8_t op_ORA(Cpu *c, uint16_t o) { c->a |= operandValue<M>(c, o); setNZ(c, c->a); return 0; }
+  template <addrmode M> static uint8_t op_EOR(Cpu *c, uint16_t o) { c->a ^= operandValue<M>(c, o); setNZ(c, c->a); return 0; }
+  template <addrmode M> static uint8_t op_CMP(Cpu *c, uint16_t o) { return compare(c, c->a, operandValue<M>(c, o)); }
+  template <addrmode M> static uint8_t op_CPX(Cpu *c, uint16_t o) { return compare(c, c->x, operandValue<M>(c, o)); }
+  template <addrmode M> static uint8_t op_CPY(Cpu *c, uint16_t o) { return compare(c, c->y, operandValue<M>(c, o)); }
+
+  template <addrmode M>
+  static uint8_t op_BIT(Cpu *c, uint16_t o)
+  {
+    uint8_t m = operandValue<M>(c, o);
+    uint8_t v = c->a & m;
+    CFLAG(F_Z, v == 0);
+    if (M != A_IMM) {
+      CFLAG(F_N, (v & 0x80) | (m & 0x80));
+      CFLAG(F_V, m & 0x40);
+    }
+    return 0;
+  }
+
+  template <addrmode M>
+  static uint8_t op_TRB(Cpu *c, uint16_t o)
+  {
+    uint16_t addr = effectiveAddress<M>(c, o);
+    uint8_t m = READMEM(addr);
+    uint8_t v = c->a & m;
+    WRITEMEM(addr, m & ~c->a);
+    CFLAG(F_Z, v == 0);
+    return 0;
+  }
+
+  template <addrmode M>
+  static uint8_t op_TSB(Cpu *c, uint16_t o)
+  {
+    uint16_t addr = effectiveAddress<M>(c, o);
+    uint8_t m = READMEM(addr);
+    uint8_t v = c->a & m;
+    WRITEMEM(addr, m | c->a);
+    CFLAG(F_Z, v == 0);
+    return 0;
+  }
+
+  template <addrmode M>
+  static uint8_t op_ADC(Cpu *c, uint16_t o)
+  {
+    uint8_t B = operandValue<M>(c, o);
+    uint8_t a = c->a;
+    uint8_t Cin = (c->flags & F_C);
+    uint8_t Cout, Vout;
+    uint16_t Aout;
+    uint8_t extra = 0;
+
+    if ((c->flags & F_D) == 0x00) {
+      // Simple binary mode
+      Aout = a + B + Cin;
+      Vout = (a ^ Aout) & (B ^ Aout) & 0x80;
+      Cout = (Aout >= 0x100) ? 1 : 0;
+    } else {
+      // Decimal mode
+      extra = 1;
+      Aout = (a & 0x0F) + (B & 0x0F) + Cin;
+      int tmpOverflow = 0;
+      if (Aout >= 0x0A) {
+	tmpOverflow = 0x10;
+	Aout = (Aout + 0x06) & 0x0F;
+      }
+      Aout = Aout | (a & 0xF0);
+      Aout = Aout + (B & 0xF0) + tmpOverflow;
+
+      Vout = 0;
+      if ( ((a ^ B) & 0x80) == 0) {
+	if (((a ^ Aout) & 0x80)) {
+	  Vout = 1;
+	}
+      }
+
+      if (Aout >= 0xA0) {
+	Aout = Aout + 0x60;
+	Cout = 1;
+      } else {
+	Cout = 0;
+      }
+    }
+
+    c->a = Aout & 0xFF;
+    CFLAG(F_C, Cout);
+    CFLAG(F_V, Vout);
+    setNZ(c, c->a);
+    return extra;
+  }
+
+  template <addrmode M>
+  static uint8_t op_SBC(Cpu *c, uint16_t o)
+  {
+    uint8_t m = operandValue<M>(c, o);
+    uint8_t a = c->a;
+    uint8_t B = m ^ 0xFF;
+    uint8_t Cin = (c->flags & F_C);
+    uint8_t Cout, Vout;
+    int16_t Aout;
+    uint8_t extra = 0;
+
+    if ((c->flags & F_D) == 0) {
+      // Binary mode: same as ADC
+      Aout = a + B + Cin;
+      Vout = (a ^ Aout) & (B ^ Aout) & 0x80;
+      Cout = (Aout >= 0x100) ? 1 : 0;
+    } else {
+      // Decimal mode
+      extra = 1;
+
+      Aout = (a & 0x0F) + (B & 0x0F) + Cin;
+      if (Aout < 0x10) {
+	Aout = (Aout - 0x06) & 0x0F;
+      }
+      Aout = Aout + (a & 0xF0) + (B & 0xF0);
+      Vout = (a ^ Aout) & (B ^ Aout) & 0x80;
+      if (Aout < 0x100) {
+	Aout = (Aout + 0xa0) & 0xFF;
+      }
+      Cout = (Aout >= 0x100) ? 1 : 0;
+
+      B = m;
+      int8_t AL = (a & 0x0F) - (B & 0x0F) + (Cin - 1);
+      Aout = a - B + Cin - 1;
+      if (Aout < 0) {
+	Aout = Aout - 0x60;
+      }
+      if (AL < 0) {
+	Aout = Aout - 0x06;
+      }
+    }
+
+    c->a = Aout & 0xFF;
+    CFLAG(F_C, Cout);
+    CFLAG(F_V, Vout);
+    setNZ(c, c->a);
+    return extra;
+  }
+
+  /* Increments, decrements, shifts and rotates */
+
+  static uint8_t op_INX(Cpu *c, uint16_t o) { c->x++; setNZ(c, c->x); return 0; }
+  static uint8_t op_INY(Cpu *c, uint16_t o) { c->y++; setNZ(c, c->y); return 0; }
+  static uint8_t op_DEX(Cpu *c, uint16_t o) { c->x--; setNZ(c, c->x); return 0; }
+  static uint8_t op_DEY(Cpu *c, uint16_t o) { c->y--; setNZ(c, c->y); return 0; }
+  static uint8_t op_INC_ACC(Cpu *c, uint16_t o) { c->a++; setNZ(c, c->a); return 0; }
+  static uint8_t op_DEC_ACC(Cpu *c, uint16_t o) { c->a--; setNZ(c, c->a); return 0; }
+
+  static uint8_t op_ASL_ACC(Cpu *c, uint16_t o)
+  {
+    CFLAG(F_C, c->a & 0x80);
+    c->a <<= 1;
+    setNZ(c, c->a);
+    return 0;
+  }
+
+  static uint8_t op_LSR_ACC(Cpu *c, uint16_t o)
+  {
+    CFLAG(F_C, c->a & 0x01);
+    c->a >>= 1;
+    setNZ(c, c->a);
+    return 0;
+  }
+
+  static uint8_t op_ROL_ACC(Cpu *c, uint16_t o)
+  {
+    uint8_t v = (c->a << 1) | (c->flags & F_C);
+    CFLAG(F_C, c->a & 0x80);
+    c->a = v;
+    setNZ(c, c->a);
+    return 0;
+  }
+
+  static uint8_t op_ROR_ACC(Cpu *c, uint16_t o)
+  {
+    uint8_t v = (c->a >> 1) | ((c->flags & F_C) ? 0x80 : 0x00);
+    CFLAG(F_C, c->a & 0x01);
+    c->a = v;
+    setNZ(c, c->a);
+    return 0;
+  }
+
+  template <addrmode M>
+  static uint8_t op_INC(Cpu *c, uint16_t o)
+  {
+    uint16_t addr = effectiveAddress<M>(c, o);
+    uint8_t v = READMEM(addr) + 1;
+    setNZ(c, v);
+    WRITEMEM(addr, v);
+    return 0;
+  }
+
+  template <addrmode M>
+  static uint8_t op_DEC(Cpu *c, uint16_t o)
+  {
+    uint16_t addr = effectiveAddress<M>(c, o);
+    uint8_t v = READMEM(addr) - 1;
+    setNZ(c, v);
+    WRITEMEM(addr, v);
+    return 0;
+  }
+
+  template <addrmode M>
+  static uint8_t op_ASL(Cpu *c, uint16_t o)
+  {
+    uint16_t addr = effectiveAddress<M>(c, o);
+    uint8_t v = READMEM(addr);
+    CFLAG(F_C, v & 0x80);
+    v <<= 1;
+    setNZ(c, v);
+    WRITEMEM(addr, v);
+    return 0;
+  }
+
+  template <addrmode M>
+  static uint8_t op_LSR(Cpu *c, uint16_t o)
+  {
+    uint16_t addr = effectiveAddress<M>(c, o);
+    uint8_t v = READMEM(addr);
+    CFLAG(F_C, v & 0x01);
+    v >>= 1;
+    setNZ(c, v);
+    WRITEMEM(addr, v);
+    return 0;
+  }
+
+  template <addrmode M>
+  static uint8_t op_ROL(Cpu *c, uint16_t o)
+  {
+    uint16_t addr = effectiveAddress<M>(c, o);
+    uint8_t m = READMEM(addr);
+    uint8_t v = (m << 1) | (c->flags & F_C);
+    CFLAG(F_C, m & 0x80);
+    setNZ(c, v);
+    WRITEMEM(addr, v);
+    return 0;
+  }
+
+  template <addrmode M>
+  static uint8_t op_ROR(Cpu *c, uint16_t o)
+  {
+    uint16_t addr = effectiveAddress<M>(c, o);
+    uint8_t m = READMEM(addr);
+    uint8_t v = (m >> 1) | ((c->flags & F_C) ? 0x80 : 0x00);
+    CFLAG(F_C, m & 0x01);
+    setNZ(c, v);
+    WRITEMEM(addr, v);
+    return 0;
+  }
+
+  // not a real opcode; one of the 65c02 side-effect "illegal" opcodes
+  template <addrmode M>
+  static uint8_t op_DCP(Cpu *c, uint16_t o)
+  {
+    uint16_t addr = effectiveAddress<M>(c, o);
+    uint8_t v = READMEM(addr) - 1;
+    WRITEMEM(addr, v);
+    return compare(c, c->a, v);
+  }
+
+  /* Flags */
+
+  static uint8_t op_CLC(Cpu *c, uint16_t o) { c->flags &= ~F_C; return 0; }
+  static uint8_t op_CLD(Cpu *c, uint16_t o) { c->flags &= ~F_D; return 0; }
+  static uint8_t op_CLI(Cpu *c, uint16_t o) { c->flags &= ~F_I; return 0; }
+  static uint8_t op_CLV(Cpu *c, uint16_t o) { c->flags &= ~F_V; return 0; }
+  static uint8_t op_SEC(Cpu *c, uint16_t o) { c->flags |= F_C; return 0; }
+  static uint8_t op_SED(Cpu *c, uint16_t o) { c->flags |= F_D; return 0; }
+  static uint8_t op_SEI(Cpu *c, uint16_t o) { c->flags |= F_I; return 0; }
+
+  /* Branches, jumps and interrupts */
+
+  static uint8_t op_BPL(Cpu *c, uint16_t o) { return branch(c, o, !(c->flags & F_N)); }
+  static uint8_t op_BMI(Cpu *c, uint16_t o) { return branch(c, o, c->flags & F_N); }
+  static uint8_t op_BVC(Cpu *c, uint16_t o) { return branch(c, o, !(c->flags & F_V)); }
+  static uint8_t op_BVS(Cpu *c, uint16_t o) { return branch(c, o, c->flags & F_V); }
+  static uint8_t op_BCC(Cpu *c, uint16_t o) { return branch(c, o, !(c->flags & F_C)); }
+  static uint8_t op_BCS(Cpu *c, uint16_t o) { return branch(c, o, c->flags & F_C); }
+
+  static uint8_t op_BNE(Cpu *c, uint16_t o)
+  {
+#ifdef TESTHARNESS
+    if (!(c->flags & F_Z) && (int8_t)(o & 0xFF) == -2) {
+      printf("CPU halt (BNE busy loop)\n");
+      exit(0);
+    }
+#endif
+    return branch(c, o, !(c->flags & F_Z));
+  }
+
+  static uint8_t op_BEQ(Cpu *c, uint16_t o)
+  {
+#ifdef TESTHARNESS
+    if ((c->flags & F_Z) && (int8_t)(o & 0xFF) == -2) {
+      printf("CPU halt (BEQ busy loop)\n");
+      exit(0);
+    }
+#endif
+    return branch(c, o, c->flags & F_Z);
+  }
+
+  // BRA is always taken, and its extra cycle is already in the table.
+  static uint8_t op_BRA(Cpu *c, uint16_t o) { branch(c, o, true); return 0; }
+
+  // BBR and BBS have two operands: a zero-page location to test, and a
+  // relative branch destination.
+  template <uint8_t BIT>
+  static uint8_t op_BBR(Cpu *c, uint16_t o)
+  {
+    if (!(READMEM(o & 0xFF) & (1 << BIT))) {
+      c->pc += (int8_t)(o >> 8);
+    }
+    return 0;
+  }
+
+  template <uint8_t BIT>
+  static uint8_t op_BBS(Cpu *c, uint16_t o)
+  {
+    if (READMEM(o & 0xFF) & (1 << BIT)) {
+      c->pc += (int8_t)(o >> 8);
+    }
+    return 0;
+  }
+
+  template <uint8_t BIT>
+  static uint8_t op_RMB(Cpu *c, uint16_t o)
+  {
+    WRITEMEM(o & 0xFF, READMEM(o & 0xFF) & ~(1 << BIT));
+    return 0;
+  }
+
+  template <uint8_t BIT>
+  static uint8_t op_SMB(Cpu *c, uint16_t o)
+  {
+    WRITEMEM(o & 0xFF, READMEM(o & 0xFF) | (1 << BIT));
+    return 0;
+  }
+
+  template <addrmode M>
+  static uint8_t op_JMP(Cpu *c, uint16_t o)
+  {
+    uint16_t target = effectiveAddress<M>(c, o);
+#ifdef TESTHARNESS
+    if (target == c->pc-3) {
+      printf("CPU halt (JMP busy loop)\n");
+      exit(0);
+    }
+#endif
+    c->pc = target;
+    return 0;
+  }
+
+  template <addrmode M>
+  static uint8_t op_JSR(Cpu *c, uint16_t o)
+  {
+    push16(c, c->pc-1);
+    c->pc = effectiveAddress<M>(c, o);
+    return 0;
+  }
+
+  static uint8_t op_RTS(Cpu *c, uint16_t o) { c->pc = pop16(c) + 1; return 0; }
+
+  static uint8_t op_RTI(Cpu *c, uint16_t o)
+  {
+    c->flags = pop8(c);
+    c->pc = pop16(c);
+    return 0;
+  }
+
+  static uint8_t op_BRK(Cpu *c, uint16_t o) { c->brk(); return 0; }
+
+  static uint8_t op_NOP(Cpu *c, uint16_t o) { return 0; }
+  static uint8_t op_WAI(Cpu *c, uint16_t o) { return 0; }
+
+  // Illegal opcodes act as NOPs. Some of them consume operand bytes,
+  // which is reflected in their table length.
+  static uint8_t op_ILLEGAL(Cpu *c, uint16_t o)
+  {
+#ifdef VERBOSE_CPU_ERRORS
+    fprintf(stderr, "** Illegal opcode at or before address $%.4x\n", c->pc-1);
+#endif
+    return 0;
+  }
+
+  // Decode the instruction at 'addr'
+  static inline void decode(Cpu *c, uint16_t addr, decodedinsn_t *d)
+  {
+    const cpuhandler_t *h = &handlers[busRead(c, addr)];
+
+    d->fn = h->fn;
+    d->pc = addr;
+    d->length = h->length;
+    d->cycles = h->cycles;
+    d->operand = 0;
+    if (h->length > 1) {
+      d->operand = busRead(c, addr+1);
+      if (h->length > 2) {
+	d->operand |= (busRead(c, addr+2) << 8);
+      }
+    }
+  }
+
+  static const cpuhandler_t handlers[256];
+};
+
+#undef READMEM
+#undef WRITEMEM
+#undef CFLAG
+
+template <class BUS>
+const cpuhandler_t CpuCore<BUS>::handlers[256] = {
+  { op_BRK,              1, 7 }, // 0x00
+  { op_ORA<A_INX>,       2, 6 }, // 0x01
+  { op_ILLEGAL,          2, 2 }, // 0x02
+  { op_ILLEGAL,          1, 2 }, // 0x03
+  { op_TSB<A_ZER>,       2, 5 }, // 0x04
+  { op_ORA<A_ZER>,       2, 3 }, // 0x05
+  { op_ASL<A_ZER>,       2, 5 }, // 0x06
+  { op_RMB<0>,           2, 5 }, // 0x07
+  { op_PHP,              1, 3 }, // 0x08
+  { op_ORA<A_IMM>,       2, 2 }, // 0x09
+  { op_ASL_ACC,          1, 2 }, // 0x0A
+  { op_ILLEGAL,          1, 2 }, // 0x0B
+  { op_TSB<A_ABS>,       3, 6 }, // 0x0C
+  { op_ORA<A_ABS>,       3, 4 }, // 0x0D
+  { op_ASL<A_ABS>,       3, 6 }, // 0x0E
+  { op_BBR<0>,           3, 5 }, // 0x0F
+  { op_BPL,              2, 2 }, // 0x10
+  { op_ORA<A_INY>,       2, 5 }, // 0x11
+  { op_ORA<A_ZIND>,      2, 5 }, // 0x12
+  { op_ILLEGAL,          1, 2 }, // 0x13
+  { op_TRB<A_ZER>,       2, 5 }, // 0x14
+  { op_ORA<A_ZEX>,       2, 4 }, // 0x15
+  { op_ASL<A_ZEX>,       2, 6 }, // 0x16
+  { op_RMB<1>,           2, 5 }, // 0x17
+  { op_CLC,              1, 2 }, // 0x18
+  { op_ORA<A_ABY>,       3, 4 }, // 0x19
+  { op_INC_ACC,          1, 2 }, // 0x1A
+  { op_ILLEGAL,          1, 2 }, // 0x1B
+  { op_TRB<A_ABS>,       3, 6 }, // 0x1C
+  { op_ORA<A_ABX>,       3, 4 }, // 0x1D
+  { op_ASL<A_ABX>,       3, 6 }, // 0x1E
+  { op_BBR<1>,           3, 5 }, // 0x1F
+  { op_JSR<A_ABS>,       3, 6 }, // 0x20
+  { op_AND<A_INX>,       2, 6 }, // 0x21
+  { op_ILLEGAL,          2, 2 }, // 0x22
+  { op_ILLEGAL,          1, 2 }, // 0x23
+  { op_BIT<A_ZER>,       2, 3 }, // 0x24
+  { op_AND<A_ZER>,       2, 3 }, // 0x25
+  { op_ROL<A_ZER>,       2, 5 }, // 0x26
+  { op_RMB<2>,           2, 5 }, // 0x27
+  { op_PLP,              1, 4 }, // 0x28
+  { op_AND<A_IMM>,       2, 2 }, // 0x29
+  { op_ROL_ACC,          1, 2 }, // 0x2A
+  { op_ILLEGAL,          1, 2 }, // 0x2B
+  { op_BIT<A_ABS>,       3, 4 }, // 0x2C
+  { op_AND<A_ABS>,       3, 4 }, // 0x2D
+  { op_ROL<A_ABS>,       3, 6 }, // 0x2E
+  { op_BBR<2>,           3, 5 }, // 0x2F
+  { op_BMI,              2, 2 }, // 0x30
+  { op_AND<A_INY>,       2, 5 }, // 0x31
+  { op_AND<A_ZIND>,      2, 5 }, // 0x32
+  { op_ILLEGAL,          1, 2 }, // 0x33
+  { op_BIT<A_ZEX>,       2, 4 }, // 0x34
+  { op_AND<A_ZEX>,       2, 4 }, // 0x35
+  { op_ROL<A_ZEX>,       2, 6 }, // 0x36
+  { op_RMB<3>,           2, 5 }, // 0x37
+  { op_SEC,              1, 2 }, // 0x38
+  { op_AND<A_ABY>,       3, 4 }, // 0x39
+  { op_DEC_ACC,          1, 2 }, // 0x3A
+  { op_ILLEGAL,          1, 2 }, // 0x3B
+  { op_BIT<A_ABX>,       3, 4 }, // 0x3C
+  { op_AND<A_ABX>,       3, 4 }, // 0x3D
+  { op_ROL<A_ABX>,       3, 6 }, // 0x3E
+  { op_BBR<3>,           3, 5 }, // 0x3F
+  { op_RTI,              1, 6 }, // 0x40
+  { op_EOR<A_INX>,       2, 6 }, // 0x41
+  { op_ILLEGAL,          2, 2 }, // 0x42
+  { op_ILLEGAL,          1, 2 }, // 0x43
+  { op_ILLEGAL,          2, 2 }, // 0x44
+  { op_EOR<A_ZER>,       2, 3 }, // 0x45
+  { op_LSR<A_ZER>,       2, 5 }, // 0x46
+  { op_RMB<4>,           2, 5 }, // 0x47
+  { op_PHA,              1, 3 }, // 0x48
+  { op_EOR<A_IMM>,       2, 2 }, // 0x49
+  { op_LSR_ACC,          1, 2 }, // 0x4A
+  { op_ILLEGAL,          1, 2 }, // 0x4B
+  { op_JMP<A_ABS>,       3, 3 }, // 0x4C
+  { op_EOR<A_ABS>,       3, 4 }, // 0x4D
+  { op_LSR<A_ABS>,       3, 6 }, // 0x4E
+  { op_BBR<4>,           3, 5 }, // 0x4F
+  { op_BVC,              2, 2 }, // 0x50
+  { op_EOR<A_INY>,       2, 5 }, // 0x51
+  { op_EOR<A_ZIND>,      2, 5 }, // 0x52
+  { op_ILLEGAL,          1, 2 }, // 0x53
+  { op_ILLEGAL,          2, 2 }, // 0x54
+  { op_EOR<A_ZEX>,       2, 4 }, // 0x55
+  { op_LSR<A_ZEX>,       2, 6 }, // 0x56
+  { op_RMB<5>,           2, 5 }, // 0x57
+  { op_CLI,              1, 2 }, // 0x58
+  { op_EOR<A_ABY>,       3, 4 }, // 0x59
+  { op_PHY,              1, 3 }, // 0x5A
+  { op_ILLEGAL,          1, 2 }, // 0x5B
+  { op_ILLEGAL,          3, 2 }, // 0x5C
+  { op_EOR<A_ABX>,       3, 4 }, // 0x5D
+  { op_LSR<A_ABX>,       3, 6 }, // 0x5E
+  { op_BBR<5>,           3, 5 }, // 0x5F
+  { op_RTS,              1, 6 }, // 0x60
+  { op_ADC<A_INX>,       2, 6 }, // 0x61
+  { op_ILLEGAL,          2, 2 }, // 0x62
+  { op_ILLEGAL,          1, 2 }, // 0x63
+  { op_STZ<A_ZER>,       2, 3 }, // 0x64
+  { op_ADC<A_ZER>,       2, 3 }, // 0x65
+  { op_ROR<A_ZER>,       2, 5 }, // 0x66
+  { op_RMB<6>,           2, 5 }, // 0x67
+  { op_PLA,              1, 4 }, // 0x68
+  { op_ADC<A_IMM>,       2, 2 }, // 0x69
+  { op_ROR_ACC,          1, 2 }, // 0x6A
+  { op_ILLEGAL,          1, 2 }, // 0x6B
+  { op_JMP<A_ABI>,       3, 6 }, // 0x6C
+  { op_ADC<A_ABS>,       3, 4 }, // 0x6D
+  { op_ROR<A_ABS>,       3, 6 }, // 0x6E
+  { op_BBR<6>,           3, 5 }, // 0x6F
+  { op_BVS,              2, 2 }, // 0x70
+  { op_ADC<A_INY>,       2, 5 }, // 0x71
+  { op_ADC<A_ZIND>,      2, 5 }, // 0x72
+  { op_ILLEGAL,          1, 2 }, // 0x73
+  { op_STZ<A_ZEX>,       2, 4 }, // 0x74
+  { op_ADC<A_ZEX>,       2, 4 }, // 0x75
+  { op_ROR<A_ZEX>,       2, 6 }, // 0x76
+  { op_RMB<7>,           2, 5 }, // 0x77
+  { op_SEI,              1, 2 }, // 0x78
+  { op_ADC<A_ABY>,       3, 4 }, // 0x79
+  { op_PLY,              1, 4 }, // 0x7A
+  { op_ILLEGAL,          1, 2 }, // 0x7B
+  { op_JMP<A_ABXI>,      3, 6 }, // 0x7C
+  { op_ADC<A_ABX>,       3, 4 }, // 0x7D
+  { op_ROR<A_ABX>,       3, 6 }, // 0x7E
+  { op_BBR<7>,           3, 5 }, // 0x7F
+  { op_BRA,              2, 3 }, // 0x80
+  { op_STA<A_INX>,       2, 6 }, // 0x81
+  { op_ILLEGAL,          2, 2 }, // 0x82
+  { op_ILLEGAL,          1, 2 }, // 0x83
+  { op_STY<A_ZER>,       2, 3 }, // 0x84
+  { op_STA<A_ZER>,       2, 3 }, // 0x85
+  { op_STX<A_ZER>,       2, 3 }, // 0x86
+  { op_SMB<0>,           2, 5 }, // 0x87
+  { op_DEY,              1, 2 }, // 0x88
+  { op_BIT<A_IMM>,       2, 2 }, // 0x89
+  { op_TXA,              1, 2 }, // 0x8A
+  { op_ILLEGAL,          1, 2 }, // 0x8B
+  { op_STY<A_ABS>,       3, 4 }, // 0x8C
+  { op_STA<A_ABS>,       3, 4 }, // 0x8D
+  { op_STX<A_ABS>,       3, 4 }, // 0x8E
+  { op_BBS<0>,           3, 5 }, // 0x8F
+  { op_BCC,              2, 2 }, // 0x90
+  { op_STA<A_INY>,       2, 6 }, // 0x91
+  { op_STA<A_ZIND>,      2, 5 }, // 0x92
+  { op_ILLEGAL,          1, 2 }, // 0x93
+  { op_STY<A_ZEX>,       2, 4 }, // 0x94
+  { op_STA<A_ZEX>,       2, 4 }, // 0x95
+  { op_STX<A_ZEY>,       2, 4 }, // 0x96
+  { op_SMB<1>,           2, 5 }, // 0x97
+  { op_TYA,              1, 2 }, // 0x98
+  { op_STA<A_ABY>,       3, 5 }, // 0x99
+  { op_TXS,              1, 2 }, // 0x9A
+  { op_ILLEGAL,          1, 2 }, // 0x9B
+  { op_STZ<A_ABS>,       3, 4 }, // 0x9C
+  { op_STA<A_ABX>,       3, 5 }, // 0x9D
+  { op_STZ<A_ABX>,       3, 5 }, // 0x9E
+  { op_BBS<1>,           3, 5 }, // 0x9F
+  { op_LDY<A_IMM>,       2, 2 }, // 0xA0
+  { op_LDA<A_INX>,       2, 6 }, // 0xA1
+  { op_LDX<A_IMM>,       2, 2 }, // 0xA2
+  { op_ILLEGAL,          1, 2 }, // 0xA3
+  { op_LDY<A_ZER>,       2, 3 }, // 0xA4
+  { op_LDA<A_ZER>,       2, 3 }, // 0xA5
+  { op_LDX<A_ZER>,       2, 3 }, // 0xA6
+  { op_SMB<2>,           2, 5 }, // 0xA7
+  { op_TAY,              1, 2 }, // 0xA8
+  { op_LDA<A_IMM>,       2, 2 }, // 0xA9
+  { op_TAX,              1, 2 }, // 0xAA
+  { op_ILLEGAL,          1, 2 }, // 0xAB
+  { op_LDY<A_ABS>,       3, 4 }, // 0xAC
+  { op_LDA<A_ABS>,       3, 4 }, // 0xAD
+  { op_LDX<A_ABS>,       3, 4 }, // 0xAE
+  { op_BBS<2>,           3, 5 }, // 0xAF
+  { op_BCS,              2, 2 }, // 0xB0
+  { op_LDA<A_INY>,       2, 5 }, // 0xB1
+  { op_LDA<A_ZIND>,      2, 5 }, // 0xB2
+  { op_ILLEGAL,          1, 2 }, // 0xB3
+  { op_LDY<A_ZEX>,       2, 4 }, // 0xB4
+  { op_LDA<A_ZEX>,       2, 4 }, // 0xB5
+  { op_LDX<A_ZEY>,       2, 4 }, // 0xB6
+  { op_SMB<3>,           2, 5 }, // 0xB7
+  { op_CLV,              1, 2 }, // 0xB8
+  { op_LDA<A_ABY>,       3, 4 }, // 0xB9
+  { op_TSX,              1, 2 }, // 0xBA
+  { op_ILLEGAL,          1, 2 }, // 0xBB
+  { op_LDY<A_ABX>,       3, 4 }, // 0xBC
+  { op_LDA<A_ABX>,       3, 4 }, // 0xBD
+  { op_LDX<A_ABY>,       3, 4 }, // 0xBE
+  { op_BBS<3>,           3, 5 }, // 0xBF
+  { op_CPY<A_IMM>,       2, 2 }, // 0xC0
+  { op_CMP<A_INX>,       2, 6 }, // 0xC1
+  { op_ILLEGAL,          2, 2 }, // 0xC2
+  { op_ILLEGAL,          1, 2 }, // 0xC3
+  { op_CPY<A_ZER>,       2, 3 }, // 0xC4
+  { op_CMP<A_ZER>,       2, 3 }, // 0xC5
+  { op_DEC<A_ZER>,       2, 5 }, // 0xC6
+  { op_SMB<4>,           2, 5 }, // 0xC7
+  { op_INY,              1, 2 }, // 0xC8
+  { op_CMP<A_IMM>,       2, 2 }, // 0xC9
+  { op_DEX,              1, 2 }, // 0xCA
+  { op_WAI,              1, 2 }, // 0xCB
+  { op_CPY<A_ABS>,       3, 4 }, // 0xCC
+  { op_CMP<A_ABS>,       3, 4 }, // 0xCD
+  { op_DEC<A_ABS>,       3, 6 }, // 0xCE
+  { op_BBS<4>,           3, 5 }, // 0xCF
+  { op_BNE,              2, 2 }, // 0xD0
+  { op_CMP<A_INY>,       2, 5 }, // 0xD1
+  { op_CMP<A_ZIND>,      2, 5 }, // 0xD2
+  { op_ILLEGAL,          1, 2 }, // 0xD3
+  { op_ILLEGAL,          2, 2 }, // 0xD4
+  { op_CMP<A_ZEX>,       2, 4 }, // 0xD5
+  { op_DEC<A_ZEX>,       2, 6 }, // 0xD6
+  { op_SMB<5>,           2, 5 }, // 0xD7
+  { op_CLD,              1, 2 }, // 0xD8
+  { op_CMP<A_ABY>,       3, 4 }, // 0xD9
+  { op_PHX,              1, 3 }, // 0xDA
+  { op_DCP<A_ABY>,       3, 2 }, // 0xDB
+  { op_ILLEGAL,          3, 2 }, // 0xDC
+  { op_CMP<A_ABX>,       3, 4 }, // 0xDD
+  { op_DEC<A_ABX>,       3, 6 }, // 0xDE
+  { op_BBS<5>,           3, 5 }, // 0xDF
+  { op_CPX<A_IMM>,       2, 2 }, // 0xE0
+  { op_SBC<A_INX>,       2, 6 }, // 0xE1
+  { op_ILLEGAL,          2, 2 }, // 0xE2
+  { op_ILLEGAL,          1, 2 }, // 0xE3
+  { op_CPX<A_ZER>,       2, 3 }, // 0xE4
+  { op_SBC<A_ZER>,       2, 3 }, // 0xE5
+  { op_INC<A_ZER>,       2, 5 }, // 0xE6
+  { op_SMB<6>,           2, 5 }, // 0xE7
+  { op_INX,              1, 2 }, // 0xE8
+  { op_SBC<A_IMM>,       2, 2 }, // 0xE9
+  { op_NOP,              1, 2 }, // 0xEA
+  { op_ILLEGAL,          1, 2 }, // 0xEB
+  { op_CPX<A_ABS>,       3, 4 }, // 0xEC
+  { op_SBC<A_ABS>,       3, 4 }, // 0xED
+  { op_INC<A_ABS>,       3, 6 }, // 0xEE
+  { op_BBS<6>,           3, 5 }, // 0xEF
+  { op_BEQ,              2, 2 }, // 0xF0
+  { op_SBC<A_INY>,       2, 5 }, // 0xF1
+  { op_SBC<A_ZIND>,      2, 5 }, // 0xF2
+  { op_ILLEGAL,          1, 2 }, // 0xF3
+  { op_ILLEGAL,          2, 2 }, // 0xF4
+  { op_SBC<A_ZEX>,       2, 4 }, // 0xF5
+  { op_INC<A_ZEX>,       2, 6 }, // 0xF6
+  { op_SMB<7>,           2, 5 }, // 0xF7
+  { op_SED,              1, 2 }, // 0xF8
+  { op_SBC<A_ABY>,       3, 4 }, // 0xF9
+  { op_PLX,              1, 4 }, // 0xFA
+  { op_ILLEGAL,          1, 2 }, // 0xFB
+  { op_ILLEGAL,          3, 2 }, // 0xFC
+  { op_SBC<A_ABX>,       3, 4 }, // 0xFD
+  { op_INC<A_ABX>,       3, 6 }, // 0xFE
+  { op_BBS<7>,           3, 5 }, // 0xFF
+};
+
+#ifdef BLOCKCACHE
+// Number of cached blocks (must be a power of 2), and the longest
+// straight-line run of instructions kept in one block
+#define BLOCKCACHESIZE 1024
+#define BLOCKMAXINSNS 16
+
+// Number of times a block has to be entered before Cpu::Run() starts
+// running it (and the blocks it links to) in one go
+#define HOTBLOCKTHRESHOLD 8
+
+// A run of instructions starting at 'pc' in MMU code page 'page',
+// valid as long as that page's generation counter hasn't moved.
+struct decodedblock_t {
+  uint16_t pc;
+  uint16_t page;
+  uint32_t generation;
+  uint8_t count;
+  uint8_t hits;
+  // The block we went to after this one last time, and the memory map
+  // that was in place when we did
+  decodedblock_t *link;
+  uint32_t linkMapGeneration;
+  decodedinsn_t insns[BLOCKMAXINSNS];
+};
+#endif
+
+#endif
@@ -26,6 +26,25 @@ extern Disassembler dis;
 // To exit on illegals:
 //#define EXIT_ON_ILLEGAL
 
+// define THREADEDCPU to use the table-dispatched core in cpu-threaded.h
+// instead of the decode switches in Cpu::step()
+//#define THREADEDCPU
+
+// define BLOCKCACHE (with THREADEDCPU) to keep runs of decoded
+// instructions around instead of re-fetching them on every step
+//#define BLOCKCACHE
+
+// define HOTBLOCKS (with BLOCKCACHE) to let Cpu::Run() execute
+// frequently-used blocks back to back, without going through step()
+//#define HOTBLOCKS
+
+// define PROFILER to count instructions and cycles per guest address
+// (see profiler.h)
+//#define PROFILER
+#ifdef PROFILER
+#include "profiler.h"
+#endif
+
 // Macros to set negative and zero flags based on param, X, Y, whatever
 #define SETNZ  { FLAG(F_N, param & 0x80); FLAG(F_Z, !param); }
 #define SETNZX { FLAG(F_N, x & 0x80);     FLAG(F_Z, !x); }
@@ -34,12 +53,40 @@ extern Disassembler dis;
 
 #define FLAG(bit, condition) { if (condition) {flags |= bit;} else {flags &= ~bit;} }
 
-#define writemem(addr, val) mmu->write(addr, val)
-#define readmem(addr) mmu->read(addr)
+#define writemem(addr, val) cpuWrite(this, addr, val)
+#define readmem(addr) mmu->readFast(addr)
+
+static inline void cpuWrite(Cpu *c, uint16_t addr, uint8_t val)
+{
+  if (c->mmu->writeFast(addr, val)) {
+#ifdef BLOCKCACHE
+    // MMU::write() takes care of this itself when we don't bypass it
+    c->invalidateCode(c->mmu->writeCodePages[addr >> 8], addr & 0xFF);
+#endif
+  }
+}
 
 // serialize suspend/restore token
 #define CPUMAGIC 0x65
 
+#ifdef THREADEDCPU
+// CPUBUS (see cpu.h) has to be a complete type for the threaded core
+#ifdef TESTHARNESS
+#include "util/testmmu.h"
+#elif !defined(TEENSYDUINO)
+#include "applemmu.h"
+#endif
+#include "cpu-threaded.h"
+#endif
+
+#if defined(BLOCKCACHE) && !defined(THREADEDCPU)
+#error BLOCKCACHE requires THREADEDCPU
+#endif
+
+#if defined(HOTBLOCKS) && (!defined(BLOCKCACHE) || defined(DEBUGSTEPS))
+#error HOTBLOCKS requires BLOCKCACHE and does not work with DEBUGSTEPS
+#endif
+
 optype_t opcodes[256] = {
   { O_BRK,     A_IMP,     7 }, // 0x00
   { O_ORA    , A_INX    , 6 }, // 0x01 [2]  i.e. "ORA ($44,X)"
@@ -312,17 +359,30 @@ optype_t opcodes[256] = {
 Cpu::Cpu()
 {
   mmu = NULL;
+  cycles = 0;
+  instructions = 0;
+#ifdef BLOCKCACHE
+  blocks = new decodedblock_t[BLOCKCACHESIZE];
+  memset(blocks, 0, sizeof(decodedblock_t) * BLOCKCACHESIZE);
+  memset(codeGeneration, 0, sizeof(codeGeneration));
+  memset(codeBytes, 0, sizeof(codeBytes));
+  mapGeneration = 0;
+  flushCodeCache();
+#endif
   Reset();
 }
 
 Cpu::~Cpu()
 {
   mmu = NULL;
+#ifdef BLOCKCACHE
+  delete[] blocks;
+#endif
 }
 
 bool Cpu::Serialize(int8_t fh)
 {
-  uint8_t buf[13] = { CPUMAGIC,
+  uint8_t buf[17] = { CPUMAGIC,
 		      (pc >> 8) & 0xFF,
 		      (pc     ) & 0xFF,
 		      sp,
@@ -330,13 +390,17 @@ bool Cpu::Serialize(int8_t fh)
 		      x,
 		      y,
 		      flags,
+		      (uint8_t)((cycles >> 56) & 0xFF),
+		      (uint8_t)((cycles >> 48) & 0xFF),
+		      (uint8_t)((cycles >> 40) & 0xFF),
+		      (uint8_t)((cycles >> 32) & 0xFF),
 		      (uint8_t)((cycles >> 24) & 0xFF),
 		      (uint8_t)((cycles >> 16) & 0xFF),
 		      (uint8_t)((cycles >>  8) & 0xFF),
 		      (uint8_t)((cycles      ) & 0xFF),
 		      irqPending ? (uint8_t)1 : (uint8_t)0 };
 
-  if (g_filemanager->write(fh, buf, 13) != 13)
+  if (g_filemanager->write(fh, buf, 17) != 17)
     return false;
 
   if (!mmu->Serialize(fh)) {
@@ -356,8 +420,8 @@ bool Cpu::Serialize(int8_t fh)
 
 bool Cpu::Deserialize(int8_t fh)
 {
-  uint8_t buf[13];
-  if (g_filemanager->read(fh, buf, 13) != 13)
+  uint8_t buf[17];
+  if (g_filemanager->read(fh, buf, 17) != 17)
     return false;
   if (buf[0] != CPUMAGIC)
     return false;
@@ -368,9 +432,12 @@ bool Cpu::Deserialize(int8_t fh)
   y = buf[6];
   flags = buf[7];
 
-  cycles = (buf[8] << 24) | (buf[9] << 16) | (buf[10] << 8) | buf[11];
+  cycles = 0;
+  for (int i=8; i<16; i++) {
+    cycles = (cycles << 8) | buf[i];
+  }
 
-  irqPending = buf[12];
+  irqPending = buf[16];
 
   if (!mmu->Deserialize(fh)) {
 #ifndef TEENSYDUINO
@@ -379,6 +446,11 @@ bool Cpu::Deserialize(int8_t fh)
     return false;
   }
 
+#ifdef BLOCKCACHE
+  // All of memory was just replaced
+  flushCodeCache();
+#endif
+
   if (g_filemanager->read(fh, buf, 1) != 1)
     return false;
   if (buf[0] != CPUMAGIC)
@@ -390,6 +462,14 @@ bool Cpu::Deserialize(int8_t fh)
   return true;
 }
 
+void Cpu::SetMMU(CPUBUS *mmu)
+{
+  this->mmu = mmu;
+#ifdef BLOCKCACHE
+  flushCodeCache();
+#endif
+}
+
 void Cpu::Reset()
 {
   a = 0;
@@ -406,9 +486,14 @@ void Cpu::Reset()
 
   sp = 0xFD;
 
-  cycles = 6; // according to the datasheet, the reset routine takes 6 clock cycles
+  // According to the datasheet, the reset routine takes 6 clock
+  // cycles. The cycle counter itself keeps running, since device
+  // events are scheduled against it.
+  cycles += 6;
 
   realtimeProcessing = false;
+  idling = false;
+  idleUntil = 0;
 }
 
 void Cpu::nmi()
@@ -476,11 +561,20 @@ void Cpu::irq()
   cycles += 2;
 }
 
-uint8_t Cpu::Run(uint8_t numSteps)
+uint16_t Cpu::Run(uint16_t numSteps)
 {
-  uint8_t runtime = 0;
+  uint16_t runtime = 0;
   realtimeProcessing = false;
   while (runtime < numSteps && !realtimeProcessing) {
+#ifdef HOTBLOCKS
+    if (!irqPending) {
+      uint16_t ran = runHotBlocks(numSteps - runtime);
+      if (ran) {
+	runtime += ran;
+	continue;
+      }
+    }
+#endif
     runtime += step();
   }
   return runtime;
@@ -493,6 +587,12 @@ uint8_t Cpu::step()
     irq();
   }
 
+  instructions++;
+
+#ifdef PROFILER
+  uint16_t profilePC = pc;
+#endif
+
 #ifdef DEBUGSTEPS
   static uint8_t cmdbuf[10];
   static char buf[50];
@@ -522,7 +622,30 @@ uint8_t Cpu::step()
 	 );
 
 #endif
-  
+
+#ifdef THREADEDCPU
+  // Decode (or find already-decoded) the handler for this opcode, with
+  // its addressing mode compiled in, plus its operand, length and base
+  // cycle count; then dispatch straight to it.
+  const decodedinsn_t *d = NULL;
+  decodedinsn_t uncached;
+#ifdef BLOCKCACHE
+  d = cachedInstruction();
+#endif
+  if (!d) {
+    CpuCore<CPUBUS>::decode(this, pc, &uncached);
+    d = &uncached;
+  }
+  pc += d->length;
+
+  uint8_t cyclesThisStep = d->cycles + d->fn(this, d->operand);
+  cycles += cyclesThisStep;
+#ifdef PROFILER
+  g_profiler.record(mmu->codePage(profilePC >> 8), profilePC, cyclesThisStep);
+#endif
+
+  return cyclesThisStep;
+#else
   uint8_t m = readmem(pc++);
 
   optype_t opcode = opcodes[m];
@@ -619,26 +742,26 @@ uint8_t Cpu::step()
   case A_INY:
     // indirect indexed Y - refers to zero-page memory by one byte
     {
-      uint8_t zpL = mmu->read(pc++);
+      uint8_t zpL = mmu->readFast(pc++);
       uint8_t zpH = zpL+1;
-      param = ( mmu->read(zpL) | (mmu->read(zpH) << 8) ) + y;
+      param = ( mmu->readFast(zpL) | (mmu->readFast(zpH) << 8) ) + y;
     }
     break;
   case A_INX:
     {
-      uint8_t zpL = mmu->read(pc++) + x;
+      uint8_t zpL = mmu->readFast(pc++) + x;
       uint8_t zpH = zpL+1;
-      param = ( mmu->read(zpL) | (mmu->read(zpH) << 8) );
+      param = ( mmu->readFast(zpL) | (mmu->readFast(zpH) << 8) );
     }
     break;
   case A_ZIND:
     {
-      uint8_t a = mmu->read(pc);
+      uint8_t a = mmu->readFast(pc);
       if (a == 0xFF) {
 	// Wrap around zero-page
-	param = mmu->read(0xFF) | (mmu->read(0) << 8);
+	param = mmu->readFast(0xFF) | (mmu->readFast(0) << 8);
       } else {
-	param = mmu->read(a) | (mmu->read(a+1) << 8);
+	param = mmu->readFast(a) | (mmu->readFast(a+1) << 8);
       }
       pc++;
     }
@@ -983,7 +1106,7 @@ uint8_t Cpu::step()
     break;
   case O_INC:
     {
-      uint8_t v = mmu->read(param) + 1;
+      uint8_t v = mmu->readFast(param) + 1;
       FLAG(F_N, v & 0x80);
       FLAG(F_Z, v == 0);
       writemem(param, v);
@@ -991,7 +1114,7 @@ uint8_t Cpu::step()
     break;
   case O_DEC:
     {
-      uint8_t v = mmu->read(param) - 1;
+      uint8_t v = mmu->readFast(param) - 1;
       FLAG(F_N, v & 0x80);
       FLAG(F_Z, v == 0);
       writemem(param, v);
@@ -1000,7 +1123,7 @@ uint8_t Cpu::step()
   case O_DCP:
     // not a real opcode; one of the 65c02 side-effect "illegal" opcodes
     {
-      uint8_t v = mmu->read(param) - 1;
+      uint8_t v = mmu->readFast(param) - 1;
       FLAG(F_N, v & 0x80);
       FLAG(F_Z, v == 0);
       writemem(param, v);
@@ -1173,10 +1296,176 @@ uint8_t Cpu::step()
 
   // And finally update our executed cycle count with the runtime
   cycles += cyclesThisStep;
+#ifdef PROFILER
+  g_profiler.record(mmu->codePage(profilePC >> 8), profilePC, cyclesThisStep);
+#endif
 
   return cyclesThisStep;
+#endif
+}
+
+#ifdef BLOCKCACHE
+// Is curBlock/curInsn still the instruction at pc, and still valid?
+inline bool Cpu::inCachedBlock()
+{
+  decodedblock_t *b = curBlock;
+  return (b &&
+	  curInsn < b->count &&
+	  b->insns[curInsn].pc == pc &&
+	  curMapGeneration == mapGeneration &&
+	  codeGeneration[b->page] == b->generation);
+}
+
+// Find the decoded instruction at pc, or NULL if it can't be cached.
+const decodedinsn_t *Cpu::cachedInstruction()
+{
+  // Most of the time we're just walking through the current block
+  if (!inCachedBlock() && !syncBlock()) {
+    return NULL;
+  }
+
+  return &curBlock->insns[curInsn++];
 }
 
+// Point curBlock/curInsn at the instruction at pc, finding or decoding
+// a block that starts there if we have to. Returns false if pc isn't
+// in cacheable memory.
+bool Cpu::syncBlock()
+{
+  if (inCachedBlock()) {
+    return true;
+  }
+
+  decodedblock_t *prev = curBlock;
+  curBlock = NULL;
+
+  // If the memory map hasn't changed, the block we went to after this
+  // one last time is probably where we're going now
+  decodedblock_t *b = NULL;
+  if (prev && prev->linkMapGeneration == mapGeneration) {
+    b = prev->link;
+    if (b && (b->pc != pc ||
+	      b->generation != codeGeneration[b->page] ||
+	      !b->count)) {
+      b = NULL;
+    }
+  }
+
+  if (!b) {
+    uint16_t page = mmu->codePage(pc >> 8);
+    if (page == NOCODEPAGE) {
+      return false;
+    }
+
+    b = &blocks[(pc ^ (page << 5)) & (BLOCKCACHESIZE-1)];
+    if (b->pc != pc ||
+	b->page != page ||
+	b->generation != codeGeneration[page] ||
+	!b->count) {
+      decodeBlock(b, page);
+      if (!b->count) {
+	return false;
+      }
+    }
+  }
+
+  if (prev) {
+    prev->link = b;
+    prev->linkMapGeneration = mapGeneration;
+  }
+  if (b->hits < 0xFF) {
+    b->hits++;
+  }
+
+  curBlock = b;
+  curMapGeneration = mapGeneration;
+  curInsn = 0;
+  return true;
+}
+
+// Decode a straight run of instructions from pc, up to the first
+// branch/jump or the end of the page.
+void Cpu::decodeBlock(decodedblock_t *b, uint16_t page)
+{
+  b->pc = pc;
+  b->page = page;
+  b->generation = codeGeneration[page];
+  b->count = 0;
+  b->hits = 0;
+  b->link = NULL;
+
+  uint16_t addr = pc;
+  while (b->count < BLOCKMAXINSNS) {
+    uint8_t m = readmem(addr);
+    if ((addr & 0xFF) + CpuCore<CPUBUS>::handlers[m].length > 0x100) {
+      // Would straddle the page; the next page may be mapped
+      // differently, so leave it to the uncached path
+      break;
+    }
+    CpuCore<CPUBUS>::decode(this, addr, &b->insns[b->count++]);
+    for (uint8_t i=0; i<CpuCore<CPUBUS>::handlers[m].length; i++) {
+      uint8_t offset = (addr + i) & 0xFF;
+      codeBytes[page][offset >> 3] |= (1 << (offset & 7));
+    }
+    addr += CpuCore<CPUBUS>::handlers[m].length;
+    if ((addr & 0xFF) == 0) {
+      // Ran off the end of the page
+      break;
+    }
+
+    optype_t o = opcodes[m];
+    if (o.mode == A_REL || o.mode == A_ZPREL ||
+	o.op == O_JMP || o.op == O_JSR || o.op == O_RTS ||
+	o.op == O_RTI || o.op == O_BRK) {
+      break;
+    }
+  }
+}
+
+#ifdef HOTBLOCKS
+// Run hot blocks back to back until we've used up 'budget' cycles, run
+// in to something that has to go through step() (an interrupt, cold
+// or uncacheable code) or realtime processing is requested. This has
+// to stop exactly where the step() loop in Run() would have.
+uint16_t Cpu::runHotBlocks(uint16_t budget)
+{
+  uint16_t ran = 0;
+
+  do {
+    if (!inCachedBlock() &&
+	(!syncBlock() || curBlock->hits < HOTBLOCKTHRESHOLD)) {
+      break;
+    }
+    const decodedinsn_t *d = &curBlock->insns[curInsn++];
+#ifdef PROFILER
+    uint16_t profilePC = pc;
+#endif
+    pc += d->length;
+    uint8_t c = d->cycles + d->fn(this, d->operand);
+    cycles += c;
+    ran += c;
+    instructions++;
+#ifdef PROFILER
+    g_profiler.record(curBlock->page, profilePC, c);
+#endif
+  } while (ran < budget && !realtimeProcessing && !irqPending);
+
+  return ran;
+}
+#endif
+
+void Cpu::flushCodeCache()
+{
+  for (uint16_t i=0; i<CODEPAGES; i++) {
+    codeGeneration[i]++;
+  }
+  memset(codeBytes, 0, sizeof(codeBytes));
+  mapGeneration++;
+  curBlock = NULL;
+  curInsn = 0;
+}
+#endif
+
 uint8_t Cpu::X()
 {
   return x;
@@ -1243,3 +1532,28 @@ void Cpu::realtime()
 {
   realtimeProcessing = true;
 }
+
+void Cpu::idle(uint64_t until)
+{
+  idleUntil = until;
+  idling = true;
+  // End this Run() so the host gets to see it
+  realtimeProcessing = true;
+}
+
+// Move the clock forward to 'to' without running anything, as long as
+// we're still idle; we're done idling once we reach idleUntil.
+void Cpu::skipIdleCycles(uint64_t to)
+{
+  if (!idling)
+    return;
+
+  if (to >= idleUntil) {
+    to = idleUntil;
+    idling = false;
+  }
+  if (to > cycles) {
+    mmu->idleSkipped(to - cycles);
+    cycles = to;
+  }
+}
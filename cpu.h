@@ -3,9 +3,33 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 class MMU;
 
+// The threaded core is compiled against the one MMU class the program
+// uses, so that its memory accesses avoid virtual calls; SetMMU() only
+// accepts that class. The Teensy build stays fully polymorphic.
+#if defined(THREADEDCPU) && !defined(TEENSYDUINO)
+#ifdef TESTHARNESS
+class TestMMU;
+#define CPUBUS TestMMU
+#else
+class AppleMMU;
+#define CPUBUS AppleMMU
+#endif
+#else
+#define CPUBUS MMU
+#endif
+
+#ifdef BLOCKCACHE
+struct decodedblock_t;
+struct decodedinsn_t;
+
+// Largest page number an MMU's codePage() may return
+#define CODEPAGES 1024
+#endif
+
 enum addrmode {
   A_ILLEGAL,
   A_IMM,
@@ -151,7 +175,7 @@ class Cpu {
   void brk();
   void irq();
 
-  uint8_t Run(uint8_t numSteps);
+  uint16_t Run(uint16_t numSteps);
   uint8_t step();
 
   uint8_t X();
@@ -171,10 +195,49 @@ class Cpu {
   uint16_t popS16();
 
  public:
-  void SetMMU(MMU *mmu) { this->mmu = mmu; }
+  void SetMMU(CPUBUS *mmu);
 
   void realtime();
 
+  // Idle-loop support. The MMU calls idle() when it sees the guest
+  // spinning on a soft switch with nothing going on, and the host may
+  // then skip the clock ahead (up to idleUntil) instead of running the
+  // loop. wake() ends that early - when a key is pressed, say.
+  void idle(uint64_t until);
+  void wake() { idling = false; }
+  void skipIdleCycles(uint64_t to);
+
+#ifdef BLOCKCACHE
+  // Decoded-block cache maintenance. The MMU calls these when memory
+  // that may hold code is written, or when the memory map changes.
+  // Only writes that land on bytes we've actually decoded cost anything.
+  void invalidateCode(uint16_t page, uint8_t offset) {
+    if (codeBytes[page][offset >> 3] & (1 << (offset & 7))) {
+      codeGeneration[page]++;
+      memset(codeBytes[page], 0, sizeof(codeBytes[page]));
+    }
+  }
+  void invalidateCodeMapping() { mapGeneration++; }
+  void flushCodeCache();
+
+ protected:
+  inline bool inCachedBlock();
+  const decodedinsn_t *cachedInstruction();
+  bool syncBlock();
+  void decodeBlock(decodedblock_t *b, uint16_t page);
+#ifdef HOTBLOCKS
+  uint16_t runHotBlocks(uint16_t budget);
+#endif
+
+  decodedblock_t *blocks;
+  decodedblock_t *curBlock;
+  uint8_t curInsn;
+  uint32_t curMapGeneration;
+  uint32_t mapGeneration;
+  uint32_t codeGeneration[CODEPAGES];
+  uint8_t codeBytes[CODEPAGES][32]; // bitmap of decoded bytes per page
+#endif
+
  public:
   uint16_t pc;
   uint8_t sp;
@@ -183,13 +246,17 @@ class Cpu {
   uint8_t y;
   uint8_t flags;
 
-  uint32_t cycles;
+  uint64_t cycles; // 64 bits, so it won't wrap in any realistic uptime
+  uint64_t instructions; // for speed reporting only; not serialized
 
   bool irqPending;
   
   MMU *mmu;
 
   bool realtimeProcessing;
+
+  volatile bool idling;
+  uint64_t idleUntil;
 };
 
 
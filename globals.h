@@ -13,6 +13,7 @@
 #include "physicalprinter.h"
 #include "vmui.h"
 #include "vmram.h"
+#include "scheduler.h"
 
 // display modes
 enum {
@@ -47,6 +48,7 @@ extern VMui *g_ui;
 extern int8_t g_volume;
 extern uint8_t g_displayType;
 extern VMRam g_ram;
+extern Scheduler g_scheduler;
 extern volatile bool g_inInterrupt;
 extern volatile uint8_t g_debugMode;
 extern bool g_prioritizeDisplay;
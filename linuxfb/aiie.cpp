@@ -16,20 +16,22 @@
 #include "appleui.h"
 #include "bios.h"
 #include "nix-prefs.h"
+#include "nix-pacing.h"
 
 #include "globals.h"
 
 #include "timeutil.h"
 
-//#define SHOWFPS
+#ifdef PROFILER
+#include "profiler.h"
+#endif
+
 //#define SHOWPC
 //#define DEBUGCPU
 //#define SHOWMEMPAGE
 
 BIOS bios;
 
-static struct timespec nextInstructionTime, startTime;
-
 #define NB_ENABLE 1
 #define NB_DISABLE 0
 
@@ -42,6 +44,9 @@ char disk2name[256] = "\0";
 
 volatile bool wantSuspend = false;
 volatile bool wantResume = false;
+#if defined(PROFILER) || defined(MEMHEATMAP)
+volatile bool wantProfile = false;
+#endif
 
 void doDebugging();
 void readPrefs();
@@ -52,6 +57,13 @@ void sigint_handler(int n)
   send_rst = 1;
 }
 
+#if defined(PROFILER) || defined(MEMHEATMAP)
+void sigusr1_handler(int n)
+{
+  wantProfile = true;
+}
+#endif
+
 void nonblock(int state)
 {
   struct termios ttystate;
@@ -88,10 +100,6 @@ void write(void *arg, uint16_t address, uint8_t v)
 }
 
 static void *cpu_thread(void *dummyptr) {
-  struct timespec currentTime;
-  struct timespec nextCycleTime;
-  uint32_t nextSpeakerCycle = 0;
-
 #if 0
   int policy;
   struct sched_param param;
@@ -100,10 +108,7 @@ static void *cpu_thread(void *dummyptr) {
   pthread_setschedparam(pthread_self(), policy, &param);
 #endif
     
-  _init_darwin_shim();
-  do_gettime(&startTime);
-      printf("Start time: %lu,%lu\n", startTime.tv_sec, startTime.tv_nsec);
-  do_gettime(&nextInstructionTime);
+  restartClock();
 
   printf("free-running\n");
   while (1) {
@@ -115,6 +120,18 @@ static void *cpu_thread(void *dummyptr) {
       printf("BIOS block complete\n");
     }
     
+#if defined(PROFILER) || defined(MEMHEATMAP)
+    if (wantProfile) {
+#ifdef PROFILER
+      g_profiler.dump("profile");
+#endif
+#ifdef MEMHEATMAP
+      ((AppleMMU *)g_vm->getMMU())->dumpHeatmap("heatmap");
+#endif
+      wantProfile = false;
+    }
+#endif
+
     if (wantSuspend) {
       printf("CPU halted; suspending VM\n");
       g_vm->Suspend("suspend.vm");
@@ -130,54 +147,19 @@ static void *cpu_thread(void *dummyptr) {
       wantResume = false;
     }
 
-    do_gettime(&currentTime);
-
-    /* The speaker is our priority. The CPU runs in batches anyway,
-       sometimes a little behind and sometimes a little ahead; but the
-       speaker has to be right on time. */
-
-    struct timespec diff;
-    
-#if 0
-    // Wait until nextSpeakerCycle
-    timespec_add_cycles(&startTime, nextSpeakerCycle, &nextCycleTime);
-    
-    diff = tsSubtract(nextCycleTime, currentTime);
-    if (diff.tv_sec >= 0 || diff.tv_nsec >= 0) {
-      nanosleep(&diff, NULL);
-    }
+    // Keys the host has queued (this can wake an idle CPU)
+    g_vm->getKeyboard()->processKeys();
 
-    // Speaker runs 48 cycles behind the CPU (an arbitrary number)
-    if (nextSpeakerCycle >= 48) {
-      timespec_add_cycles(&startTime, nextSpeakerCycle-48, &nextCycleTime);
-      uint64_t microseconds = nextCycleTime.tv_sec * 1000000 +
-	(double)nextCycleTime.tv_nsec / 1000.0;
-      g_speaker->maintainSpeaker(nextSpeakerCycle-48, microseconds);
-    }
-
-    // Bump speaker cycle for next go-round
-    nextSpeakerCycle++;
-#endif
-
-    /* Next up is the CPU. */
-
-    // tsSubtract doesn't return negatives; it bounds at 0.
-    diff = tsSubtract(nextInstructionTime, currentTime);
-
-    uint8_t executed = 0;
-    if (diff.tv_sec == 0 && diff.tv_nsec == 0) {
+    uint16_t executed = 0;
+    if (cpuReady(!send_rst)) {
 #ifdef DEBUGCPU
       executed = g_cpu->Run(1);
 #else
-      executed = g_cpu->Run(24);
+      executed = g_cpu->Run(g_scheduler.runnableCycles(g_cpu->cycles, unthrottled ? 255 : 24));
 #endif
-      // calculate the real time that we should be at now, and schedule
-      // that as our next instruction time
-      timespec_add_cycles(&startTime, g_cpu->cycles, &nextInstructionTime);
-
-      // The paddles need to be triggered in real-time on the CPU
-      // clock. That happens from the VM's CPU maintenance poller.
-      ((AppleVM *)g_vm)->cpuMaintenance(g_cpu->cycles);
+      // The paddles (and disk, and keyboard repeat) need to happen in
+      // real-time on the CPU clock.
+      g_scheduler.runEvents(g_cpu->cycles);
 
 #ifdef DEBUGCPU
       {
@@ -269,6 +251,23 @@ int main(int argc, char *argv[])
   int newVT;
   int initialVT;
   
+  int ch;
+  while ((ch = getopt(argc, argv, "ut")) != -1) {
+    switch (ch) {
+    case 'u':
+      printf("Running at unlimited speed\n");
+      freeRunning = true;
+      break;
+    case 't':
+      printf("Running at unlimited speed while a disk is spinning\n");
+      diskTurbo = true;
+      break;
+    default:
+      printf("Usage: %s [-u] [-t] [disk1 [disk2]]\n", argv[0]);
+      exit(1);
+    }
+  }
+
   if ((fd=open("/dev/console", O_WRONLY)) < 0) {
     perror("opening /dev/console");
     exit(1);
@@ -300,6 +299,7 @@ int main(int argc, char *argv[])
 
   sleep(2); // kinda random, hopefully sloppy? - to make startTime != 0,0
   printf("starting time consistency check\n");
+  struct timespec startTime, nextInstructionTime;
   do_gettime(&startTime);
   for (int i=0; i<10000000; i++) {
 
@@ -348,7 +348,7 @@ int main(int argc, char *argv[])
   g_keyboard = new LinuxKeyboard(g_vm->getKeyboard());
 
   // Now that the VM exists and it has created an MMU, we tell the CPU how to access memory through the MMU.
-  g_cpu->SetMMU(g_vm->getMMU());
+  g_cpu->SetMMU((AppleMMU *)g_vm->getMMU());
 
   // Now that all the virtual hardware is glued together, reset the VM
   g_vm->Reset();
@@ -359,16 +359,16 @@ int main(int argc, char *argv[])
   /* Load prefs & reset globals appropriately now */
   readPrefs();
 
-  if (argc >= 2) {
-    printf("Inserting disk %s\n", argv[1]);
-    ((AppleVM *)g_vm)->insertDisk(0, argv[1]);
-    strcpy(disk1name, argv[1]);
+  if (optind < argc) {
+    printf("Inserting disk %s\n", argv[optind]);
+    ((AppleVM *)g_vm)->insertDisk(0, argv[optind]);
+    strcpy(disk1name, argv[optind]);
   }
 
-  if (argc == 3) {
-    printf("Inserting disk %s\n", argv[2]);
-    ((AppleVM *)g_vm)->insertDisk(1, argv[2]);
-    strcpy(disk2name, argv[2]);
+  if (optind + 1 < argc) {
+    printf("Inserting disk %s\n", argv[optind+1]);
+    ((AppleVM *)g_vm)->insertDisk(1, argv[optind+1]);
+    strcpy(disk2name, argv[optind+1]);
   }
 
   // FIXME: fixed test disk...
@@ -378,6 +378,9 @@ int main(int argc, char *argv[])
   nonblock(NB_ENABLE);
 
   signal(SIGINT, sigint_handler);
+#if defined(PROFILER) || defined(MEMHEATMAP)
+  signal(SIGUSR1, sigusr1_handler);
+#endif
 
   printf("creating CPU thread\n");
   if (!pthread_create(&cpuThreadID, NULL, &cpu_thread, (void *)NULL)) {
@@ -402,25 +405,21 @@ int main(int argc, char *argv[])
 
       g_biosInterrupt = false;
 
-      // clear the CPU next-step counters
-      g_cpu->cycles = 0;
-      do_gettime(&startTime);
-      do_gettime(&nextInstructionTime);
+      // restart the clock
+      restartClock();
 
       // Drain the speaker queue (FIXME: a little hacky)
       g_speaker->maintainSpeaker(-1, -1);
 
-      /* FIXME                                                                  
-      // Force the display to redraw                                            
-      ((AppleDisplay*)(g_vm->vmdisplay))->modeChange();                         
-      */
+      // The BIOS drew over the screen; redraw all of it
+      ((AppleDisplay*)(g_vm->vmdisplay))->modeChange();
 
       // Poll the keyboard before we start, so we can do selftest on startup
       g_keyboard->maintainKeyboard();
     }
     
     
-    static uint32_t usleepcycles = 16384; // step-down for display drawing. Dynamically updated based on FPS calculations.
+    uint32_t frame = ((AppleDisplay *)g_vm->vmdisplay)->frameCount();
 
     g_ui->blit();
     if (g_vm->vmdisplay->needsRedraw()) {
@@ -436,34 +435,8 @@ int main(int argc, char *argv[])
     g_ui->drawPercentageUIElement(UIePowerPercentage, 100);
 
     doDebugging();
-    
-    // calculate FPS & dynamically step up/down as necessary
-    static time_t startAt = time(NULL);
-    static uint32_t loopCount = 0;
-    loopCount++;
-    uint32_t lenSecs = time(NULL) - startAt;
-    if (lenSecs >= 5) {
-      float fps = loopCount / lenSecs;
-
-#ifdef SHOWFPS
-      char buf[25];
-      sprintf(buf, "%f FPS [delay %u]", fps, usleepcycles);
-      g_display->debugMsg(buf);
-#endif
-
-      if (fps > 60) {
-	usleepcycles *= 2;
-      } else if (fps < 40) {
-	usleepcycles /= 2;
-      }
 
-      // reset the counter & we'll adjust again in 5 seconds
-      loopCount = 0;
-      startAt = time(NULL);
-    }
-    if (usleepcycles >= 2) {
-      usleep(usleepcycles);
-    }
+    waitForFrame(frame);
 
 #ifdef SHOWPC
     {
@@ -526,7 +499,7 @@ void doDebugging()
     g_display->debugMsg(buf);
     break;
   case D_SHOWCYCLES:
-    sprintf(buf, "%X", g_cpu->cycles);
+    sprintf(buf, "%llX", (unsigned long long)g_cpu->cycles);
     g_display->debugMsg(buf);
     break;
     /*                                                                          
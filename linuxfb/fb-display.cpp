@@ -4,6 +4,7 @@
 #include <sys/ioctl.h>
 
 #include "fb-display.h"
+#include "nix-pixels.h"
 
 #include "bios-font.h"
 #include "images.h"
@@ -35,9 +36,33 @@ const uint16_t loresPixelColors[16] = { 0x0000, // 0 black
 					0xFFFF  // 15 white
 };
 
+// Work out the 5/6/5 value of every color index in every display
+// type, so blit() is just a table lookup per pixel
+void FBDisplay::buildPalettes()
+{
+  for (uint8_t i=0; i<16; i++) {
+    uint16_t color = loresPixelColors[i];
+
+    // Tricky. Grayscale from luminance. Turn each value into a
+    // 5-bit value, so they have equal weights; then calculate
+    // luminance; then turn that back in to 5/6/5.
+    float fv = (0.2125 * ((color & 0xF800) >> 11));
+    fv += (0.7154 * ((color & 0x07E0) >> 6)); // 6 bits of green
+					      // turned in to 5
+					      // bits
+    fv += (0.0721 * ((color & 0x001F)));
+
+    palettes[m_blackAndWhite][i] = ((uint16_t)fv << 11) | ((uint16_t)fv << 6) | ((uint16_t)fv);
+    palettes[m_monochrome][i] = ((uint16_t)fv << 6);
+    palettes[m_ntsclike][i] = color;
+    palettes[m_perfectcolor][i] = color;
+  }
+}
+
 FBDisplay::FBDisplay()
 {
   memset((void *)videoBuffer, 0, sizeof(videoBuffer));
+  buildPalettes();
 
   fb_fd = open("/dev/fb0",O_RDWR);
   //Get variable screen information
@@ -102,42 +127,16 @@ void FBDisplay::drawImageOfSizeAt(const uint8_t *img,
 
 void FBDisplay::blit(AiieRect r)
 {
-  for (uint16_t y=r.top*2; y<r.bottom*2; y++) {
-    for (uint16_t x=r.left*2; x<r.right*2; x++) {
-      uint8_t colorIdx = videoBuffer[y*FBDISPLAY_WIDTH+x];
-
-      uint16_t color;
-      color = loresPixelColors[colorIdx];
-
-      if (g_displayType == m_monochrome) {
-	// Tricky. Grayscale from luminance. Turn each value into a
-        // 5-bit value, so they have equal weights; then calculate
-        // luminance; then turn that back in to 5/6/5.
-	float fv = (0.2125 * ((color & 0xF800) >> 11));
-        fv += (0.7154 * ((color & 0x07E0) >> 6)); // 6 bits of green
-						  // turned in to 5
-						  // bits
-	fv += (0.0721 * ((color & 0x001F)));
-
-        color = ((uint16_t)fv << 6);
-      }
-      else if (g_displayType == m_blackAndWhite) {
-        // Tricky. Grayscale from luminance. Turn each value into a
-        // 5-bit value, so they have equal weights; then calculate
-        // luminance; then turn that back in to 5/6/5.
-        float fv = (0.2125 * ((color & 0xF800) >> 11));
-        fv += (0.7154 * ((color & 0x07E0) >> 6)); // 6 bits of green
-						  // turned in to 5
-						  // bits
-        fv += (0.0721 * ((color & 0x001F)));
-
-        color = ((uint16_t)fv << 11) | ((uint16_t)fv << 6) | ((uint16_t)fv);
-      }
+  const uint16_t *palette = palettes[g_displayType & 3];
+  // r is inclusive: a change to one scanline has top == bottom
+  uint16_t left = r.left*2;
+  uint16_t width = (r.right - r.left + 1)*2;
 
+  for (uint16_t y=r.top*2; y<(r.bottom+1)*2; y++) {
+    palettize565(rowBuffer, (const uint8_t *)&videoBuffer[y*FBDISPLAY_WIDTH+left], palette, width);
 
-      long location = (x+vinfo.xoffset+SCREENINSET_X) * (vinfo.bits_per_pixel/8) + (y+vinfo.yoffset+SCREENINSET_Y) * finfo.line_length;
-      *((uint16_t*)(fbp + location)) = color;
-    }
+    long location = (left+vinfo.xoffset+SCREENINSET_X) * (vinfo.bits_per_pixel/8) + (y+vinfo.yoffset+SCREENINSET_Y) * finfo.line_length;
+    copyRow(fbp + location, rowBuffer, width * sizeof(uint16_t));
   }
 
   if (overlayMessage[0]) {
@@ -255,24 +254,60 @@ void FBDisplay::cachePixel(uint16_t x, uint16_t y, uint8_t color)
 // "DoubleWide" means "please double the X because I'm in low-res width mode"
 void FBDisplay::cacheDoubleWidePixel(uint16_t x, uint16_t y, uint8_t color)
 {
-  videoBuffer[y*2*FBDISPLAY_WIDTH+x*2] = color;
-  videoBuffer[y*2*FBDISPLAY_WIDTH+x*2+1] = color;
-
-  videoBuffer[(y*2+1)*FBDISPLAY_WIDTH+x*2] = color;
-  videoBuffer[(y*2+1)*FBDISPLAY_WIDTH+x*2+1] = color;
+  widenPixel2x2((uint8_t *)&videoBuffer[y*2*FBDISPLAY_WIDTH+x*2],
+		(uint8_t *)&videoBuffer[(y*2+1)*FBDISPLAY_WIDTH+x*2],
+		color);
 }
 
 void FBDisplay::cache2DoubleWidePixels(uint16_t x, uint16_t y, uint8_t colorB, uint8_t colorA)
 {
-  videoBuffer[y*2*FBDISPLAY_WIDTH+x*2] = colorA;
-  videoBuffer[y*2*FBDISPLAY_WIDTH+x*2+1] = colorA;
+  widenPixelPair2x2((uint8_t *)&videoBuffer[y*2*FBDISPLAY_WIDTH+x*2],
+		    (uint8_t *)&videoBuffer[(y*2+1)*FBDISPLAY_WIDTH+x*2],
+		    colorA, colorB);
+}
+
+// The bulk versions write straight in to videoBuffer, a row (and its
+// doubled twin) at a time
+
+void FBDisplay::cacheDoubleWideFill(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t color)
+{
+  for (uint16_t y2=y; y2<y+h; y2++) {
+    memset((uint8_t *)&videoBuffer[y2*2*FBDISPLAY_WIDTH+x*2], color, w*2);
+    memset((uint8_t *)&videoBuffer[(y2*2+1)*FBDISPLAY_WIDTH+x*2], color, w*2);
+  }
+}
+
+void FBDisplay::cacheDoubleWideRun(uint16_t x, uint16_t y, const uint8_t *colors, uint16_t count)
+{
+  widenPixels2x2((uint8_t *)&videoBuffer[y*2*FBDISPLAY_WIDTH+x*2],
+		 (uint8_t *)&videoBuffer[(y*2+1)*FBDISPLAY_WIDTH+x*2],
+		 colors, count);
+}
 
-  videoBuffer[y*2*FBDISPLAY_WIDTH+x*2+2] = colorB;
-  videoBuffer[y*2*FBDISPLAY_WIDTH+x*2+3] = colorB;
+void FBDisplay::cacheRun(uint16_t x, uint16_t y, const uint8_t *colors, uint16_t count)
+{
+  memcpy((uint8_t *)&videoBuffer[y*2*FBDISPLAY_WIDTH+x], colors, count);
+  memcpy((uint8_t *)&videoBuffer[(y*2+1)*FBDISPLAY_WIDTH+x], colors, count);
+}
 
-  videoBuffer[(y*2+1)*FBDISPLAY_WIDTH+x*2] = colorA;
-  videoBuffer[(y*2+1)*FBDISPLAY_WIDTH+x*2+1] = colorA;
+void FBDisplay::cacheDoubleWideGlyph(uint16_t x, uint16_t y, const uint8_t *rows, uint8_t width, uint8_t fg, uint8_t bg)
+{
+  uint8_t pixels[8];
+  for (uint8_t r=0; r<8; r++) {
+    for (uint8_t n=0; n<width; n++) {
+      pixels[n] = (rows[r] & (1<<n)) ? fg : bg;
+    }
+    cacheDoubleWideRun(x, y+r, pixels, width);
+  }
+}
 
-  videoBuffer[(y*2+1)*FBDISPLAY_WIDTH+x*2+2] = colorB;
-  videoBuffer[(y*2+1)*FBDISPLAY_WIDTH+x*2+3] = colorB;
+void FBDisplay::cacheGlyph(uint16_t x, uint16_t y, const uint8_t *rows, uint8_t width, uint8_t fg, uint8_t bg)
+{
+  uint8_t pixels[8];
+  for (uint8_t r=0; r<8; r++) {
+    for (uint8_t n=0; n<width; n++) {
+      pixels[n] = (rows[r] & (1<<n)) ? fg : bg;
+    }
+    cacheRun(x, y+r, pixels, width);
+  }
 }
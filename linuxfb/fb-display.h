@@ -32,11 +32,24 @@ class FBDisplay : public PhysicalDisplay {
   virtual void cachePixel(uint16_t x, uint16_t y, uint8_t color);
   virtual void cacheDoubleWidePixel(uint16_t x, uint16_t y, uint8_t color);
   virtual void cache2DoubleWidePixels(uint16_t x, uint16_t y, uint8_t colorA, uint8_t colorB);
+
+  virtual void cacheDoubleWideFill(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t color);
+  virtual void cacheDoubleWideRun(uint16_t x, uint16_t y, const uint8_t *colors, uint16_t count);
+  virtual void cacheRun(uint16_t x, uint16_t y, const uint8_t *colors, uint16_t count);
+  virtual void cacheDoubleWideGlyph(uint16_t x, uint16_t y, const uint8_t *rows, uint8_t width, uint8_t fg, uint8_t bg);
+  virtual void cacheGlyph(uint16_t x, uint16_t y, const uint8_t *rows, uint8_t width, uint8_t fg, uint8_t bg);
 				      
   
  private:
+  void buildPalettes();
+
   volatile uint8_t videoBuffer[FBDISPLAY_HEIGHT * FBDISPLAY_WIDTH];
 
+  // videoBuffer color index to 5/6/5, for each g_displayType
+  uint16_t palettes[4][16];
+  // one converted row on its way to the framebuffer
+  uint16_t rowBuffer[FBDISPLAY_WIDTH];
+
   int fb_fd;
   struct fb_fix_screeninfo finfo;
   struct fb_var_screeninfo vinfo;
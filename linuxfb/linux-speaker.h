@@ -14,8 +14,8 @@ class LinuxSpeaker : public PhysicalSpeaker {
 
   virtual void begin();
   
-  virtual void toggle(uint32_t c);
-  virtual void maintainSpeaker(uint32_t c, uint64_t microseconds);
+  virtual void toggle(uint64_t c);
+  virtual void maintainSpeaker(uint64_t c, uint64_t microseconds);
   virtual void beginMixing();
   virtual void mixOutput(uint8_t v);
 };
@@ -34,7 +34,7 @@ static int do_gettime(struct timespec *tp) {
 // adds the number of nanoseconds that 'cycles' takes to *start and
 // returns it in *out
 static void timespec_add_cycles(struct timespec *start,
-			 int32_t cycles,
+			 uint64_t cycles,
 			 struct timespec *out)
 {
   out->tv_sec = start->tv_sec;
@@ -51,10 +51,10 @@ static void timespec_add_cycles(struct timespec *start,
   }
 }
 
-static unsigned long cycles_since_time(struct timespec *start)
+static uint64_t cycles_since_time(struct timespec *start)
 {
-  unsigned long ret = start->tv_sec * CYCLES_PER_SECOND;
-  ret += (double)((double)start->tv_nsec * (double)0.001023 + (double) 0.01); // 0.01 for rounding error; one cycle ~= 977517nS, and 977517 * .000001023 is only 0.999999891.
+  uint64_t ret = (uint64_t)start->tv_sec * CYCLES_PER_SECOND;
+  ret += (double)((double)start->tv_nsec * (double)CYCLES_PER_SECOND / (double)NANOSECONDS_PER_SECOND + (double) 0.01); // 0.01 for rounding error; one cycle ~= 977517nS, and 977517 * .000001023 is only 0.999999891.
   return ret;
 }
 
@@ -2,9 +2,18 @@
 #define __MMU_H
 
 #include <stdint.h>
+#include <string.h>
+
+// Returned by codePage() for memory that can't be cached as code
+#define NOCODEPAGE 0xFFFF
 
 class MMU {
  public:
+  MMU() {
+    memset(readPointers, 0, sizeof(readPointers));
+    memset(writePointers, 0, sizeof(writePointers));
+    memset(writeCodePages, 0, sizeof(writeCodePages));
+  }
   virtual ~MMU() {}
 
   virtual void Reset() = 0;
@@ -13,8 +22,45 @@ class MMU {
   virtual void write(uint16_t mem, uint8_t val) = 0;
   virtual uint8_t readDirect(uint16_t address, uint8_t fromPage) = 0;
 
+  // Identifies the memory currently mapped in to CPU page 'hi', so
+  // that the CPU can cache decoded instructions from it. Pages with
+  // read side effects (I/O and the like) must return NOCODEPAGE.
+  virtual uint16_t codePage(uint8_t hi) { return NOCODEPAGE; }
+
+  // Tells the MMU that the CPU skipped 'cycles' of an idle loop (see
+  // Cpu::idle()) instead of running it, in case the loop had state of
+  // its own to keep up to date.
+  virtual void idleSkipped(uint64_t cycles) {}
+
   virtual bool Serialize(int8_t fd) = 0;
   virtual bool Deserialize(int8_t fd) = 0;
+
+  // Common-case memory access for the CPU: plain RAM and ROM pages are
+  // one table lookup away; anything else goes through read()/write().
+  inline uint8_t readFast(uint16_t address) {
+    uint8_t *p = readPointers[address >> 8];
+    return p ? p[address & 0xFF] : read(address);
+  }
+
+  // Returns true if the write went straight to memory, bypassing write()
+  inline bool writeFast(uint16_t address, uint8_t v) {
+    uint8_t *p = writePointers[address >> 8];
+    if (p) {
+      p[address & 0xFF] = v;
+      return true;
+    }
+    write(address, v);
+    return false;
+  }
+
+ public:
+  // Host memory currently mapped in to each CPU page. NULL means the
+  // page has side effects (I/O, soft switches, write-protected ROM...)
+  // and has to go through read()/write(). writeCodePages[] is the
+  // codePage() number of the memory behind each writePointers[] entry.
+  uint8_t *readPointers[256];
+  uint8_t *writePointers[256];
+  uint16_t writeCodePages[256];
 };
 
 #endif
@@ -0,0 +1,122 @@
+#include <math.h>
+#include <string.h>
+#include "nix-blep.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// How much of the signal the leaky integrator keeps from one sample
+// to the next; this sets the DC blocker's corner at a few Hz
+#define BLEPLEAK 0.9995f
+
+// Where the sinc's cutoff sits, as a fraction of the output's Nyquist
+// frequency - a little short of it, so the short kernel can roll off
+#define BLEPCUTOFF 0.9
+
+float BlepSynth::kernel[BLEPPHASES][BLEPTAPS];
+
+void BlepSynth::buildKernel()
+{
+  for (uint8_t p = 0; p < BLEPPHASES; p++) {
+    double frac = (double)p / BLEPPHASES;
+    double sum = 0;
+    for (uint8_t k = 0; k < BLEPTAPS; k++) {
+      // The edge is centered between taps BLEPTAPS/2-1 and BLEPTAPS/2,
+      // 'frac' of the way along
+      double x = k - (BLEPTAPS/2 - 1) - frac;
+      double sinc = (x == 0) ? 1.0 : sin(M_PI * BLEPCUTOFF * x) / (M_PI * BLEPCUTOFF * x);
+      // Blackman window over the kernel's width
+      double w = (x + BLEPTAPS/2) / BLEPTAPS;
+      double window = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+      kernel[p][k] = sinc * window;
+      sum += kernel[p][k];
+    }
+    // Each step has to come out exactly 'delta' high
+    for (uint8_t k = 0; k < BLEPTAPS; k++) {
+      kernel[p][k] /= sum;
+    }
+  }
+}
+
+BlepSynth::BlepSynth()
+{
+  static bool kernelBuilt = false;
+  if (!kernelBuilt) {
+    buildKernel();
+    kernelBuilt = true;
+  }
+
+  reset();
+}
+
+void BlepSynth::reset()
+{
+  blockSize = 0;
+  level = 0;
+  memset(deltas, 0, sizeof(deltas));
+}
+
+void BlepSynth::beginBlock(uint16_t count)
+{
+  if (count > BLEPMAXBLOCK)
+    count = BLEPMAXBLOCK;
+  blockSize = count;
+  // The first BLEPTAPS are what's left over from the last block
+  memset(&deltas[BLEPTAPS], 0, count * sizeof(float));
+}
+
+void BlepSynth::addStep(float position, float delta)
+{
+  if (position < 0)
+    position = 0;
+  uint32_t fixed = position * BLEPPHASES;
+  uint16_t idx = fixed / BLEPPHASES;
+  if (idx >= blockSize)
+    idx = blockSize - 1;
+  const float *k = kernel[fixed % BLEPPHASES];
+  float *d = &deltas[idx];
+
+#if defined(__SSE2__)
+  __m128 v = _mm_set1_ps(delta);
+  for (uint8_t i = 0; i < BLEPTAPS; i += 4) {
+    __m128 sum = _mm_add_ps(_mm_loadu_ps(d + i), _mm_mul_ps(v, _mm_load_ps(k + i)));
+    _mm_storeu_ps(d + i, sum);
+  }
+#else
+  for (uint8_t i = 0; i < BLEPTAPS; i++) {
+    d[i] += delta * k[i];
+  }
+#endif
+}
+
+void BlepSynth::endBlock(int16_t *out)
+{
+  // The integrator is one long dependency chain, so that part's
+  // scalar...
+  float l = level;
+  for (uint16_t i = 0; i < blockSize; i++) {
+    l = l * BLEPLEAK + deltas[i];
+    filtered[i] = l;
+  }
+  level = l;
+
+  // ... but the conversion to 16 bits isn't
+  uint16_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 8 <= blockSize; i += 8) {
+    __m128i a = _mm_cvtps_epi32(_mm_load_ps(&filtered[i]));
+    __m128i b = _mm_cvtps_epi32(_mm_load_ps(&filtered[i+4]));
+    _mm_storeu_si128((__m128i *)&out[i], _mm_packs_epi32(a, b));
+  }
+#endif
+  for (; i < blockSize; i++) {
+    float s = filtered[i];
+    if (s > 32767) s = 32767;
+    if (s < -32768) s = -32768;
+    out[i] = lrintf(s);
+  }
+
+  // Keep the tails of edges that spilled past the end
+  memmove(deltas, &deltas[blockSize], BLEPTAPS * sizeof(float));
+}
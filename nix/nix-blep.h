@@ -0,0 +1,49 @@
+#ifndef __NIX_BLEP_H
+#define __NIX_BLEP_H
+
+#include <stdint.h>
+
+/* Band-limited step synthesis for the host speaker.
+ *
+ * The Apple's speaker is a square wave whose edges land on arbitrary
+ * CPU cycles. Rather than write levels straight in to the output (and
+ * alias every edge to the nearest sample), each edge adds a
+ * band-limited impulse - a windowed sinc, looked up at the edge's
+ * fractional sample position - to a buffer of differences. Running
+ * that through a leaky integrator gives back the band-limited square
+ * wave, with the DC taken out.
+ *
+ * Output is produced a block at a time: beginBlock(), then addStep()
+ * for each edge inside the block, then endBlock() to get the samples.
+ */
+
+#define BLEPTAPS 16      // samples each edge is spread over
+#define BLEPPHASES 64    // fractional sample positions we resolve
+#define BLEPMAXBLOCK 1024
+
+class BlepSynth {
+ public:
+  BlepSynth();
+
+  void beginBlock(uint16_t count);
+  // A step of 'delta' (in output sample units) 'position' samples in
+  // to the block; 0 <= position < count
+  void addStep(float position, float delta);
+  void endBlock(int16_t *out);
+
+  void reset();
+
+ private:
+  uint16_t blockSize;
+  float level; // leaky integrator state
+
+  // Differences for this block, plus the tails of edges near its end
+  // that carry over in to the next one
+  float deltas[BLEPMAXBLOCK + BLEPTAPS] __attribute__((aligned(16)));
+  float filtered[BLEPMAXBLOCK] __attribute__((aligned(16)));
+
+  static float kernel[BLEPPHASES][BLEPTAPS] __attribute__((aligned(16)));
+  static void buildKernel();
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "appledisplay.h"
+#include "applevm.h"
+#include "cpu.h"
+#include "globals.h"
+
+#include "nix-pacing.h"
+
+bool freeRunning = false;
+bool diskTurbo = false;
+volatile bool unthrottled = false;
+
+// How long to nap (in microseconds) while the guest is idle, between
+// checks for input
+#define IDLENAP 1000
+
+// How often (in seconds) free-running mode reports its speed
+#define SPEEDREPORTSECS 5
+
+// How long the display thread waits for a frame at most, and how
+// often it looks
+#define HOSTFRAMEUSECS 16667
+#define FRAMEPOLLUSECS 1000
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+// The host time (in nanoseconds) at which the CPU was at startCycles
+static uint64_t startNanos = 0;
+static uint64_t startCycles = 0;
+
+static uint64_t nanosNow()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * NANOSECONDS_PER_SECOND + now.tv_nsec;
+}
+
+// The cycle the CPU should have reached by host time 'nanos'
+static uint64_t cycleAt(uint64_t nanos)
+{
+  return startCycles + (uint64_t)((double)(nanos - startNanos) * g_speed / NANOSECONDS_PER_SECOND);
+}
+
+// The host time at which the CPU should reach 'cycle'
+static uint64_t nanosAt(uint64_t cycle)
+{
+  return startNanos + (uint64_t)((double)(cycle - startCycles) * NANOSECONDS_PER_SECOND / g_speed);
+}
+
+void restartClock()
+{
+  startCycles = g_cpu->cycles;
+  startNanos = nanosNow();
+}
+
+// In free-running mode, print how fast the emulated machine is
+// actually going. Only looks at the clock about once per emulated
+// million cycles, so it costs next to nothing.
+static void reportSpeed()
+{
+  static uint64_t lastReport = 0;
+  static uint64_t lastCycles = 0;
+  static uint64_t lastInstructions = 0;
+  static uint64_t nextCheck = 0;
+
+  if (g_cpu->cycles < nextCheck)
+    return;
+  nextCheck = g_cpu->cycles + 1000000;
+
+  uint64_t now = nanosNow();
+  if (lastReport == 0) {
+    lastReport = now;
+    lastCycles = g_cpu->cycles;
+    lastInstructions = g_cpu->instructions;
+    return;
+  }
+
+  if (now - lastReport < SPEEDREPORTSECS * NANOSECONDS_PER_SECOND)
+    return;
+
+  double secs = (double)(now - lastReport) / NANOSECONDS_PER_SECOND;
+  printf("%.2f emulated MHz, %.0f instructions/sec\n",
+	 (double)(g_cpu->cycles - lastCycles) / secs / 1000000.0,
+	 (double)(g_cpu->instructions - lastInstructions) / secs);
+
+  lastReport = now;
+  lastCycles = g_cpu->cycles;
+  lastInstructions = g_cpu->instructions;
+}
+
+bool cpuReady(bool canIdle)
+{
+  // Disk turbo: run flat out while a drive is spinning, then pick the
+  // real-time clock back up from wherever the CPU has got to.
+  bool wasUnthrottled = unthrottled;
+  unthrottled = freeRunning ||
+    (diskTurbo && ((AppleVM *)g_vm)->disk6->motorIsOn());
+  if (wasUnthrottled && !unthrottled)
+    restartClock();
+
+  if (g_cpu->idling && canIdle) {
+    // The guest is only polling the keyboard or VBL. Skip its loop:
+    // either straight away, or by napping and letting the clock
+    // catch up with real time (until a key wakes the CPU).
+    if (unthrottled) {
+      g_cpu->skipIdleCycles(g_cpu->idleUntil);
+    } else {
+      g_cpu->skipIdleCycles(cycleAt(nanosNow()));
+      if (g_cpu->idling) {
+	usleep(IDLENAP);
+	return false;
+      }
+    }
+  }
+
+  if (unthrottled) {
+    if (freeRunning)
+      reportSpeed();
+    return true;
+  }
+
+  // Sleep until real time catches up with the CPU
+  uint64_t due = nanosAt(g_cpu->cycles);
+  uint64_t now = nanosNow();
+  if (due > now) {
+    struct timespec wait;
+    wait.tv_sec = (due - now) / NANOSECONDS_PER_SECOND;
+    wait.tv_nsec = (due - now) % NANOSECONDS_PER_SECOND;
+    nanosleep(&wait, NULL);
+    return false;
+  }
+  return true;
+}
+
+void waitForFrame(uint32_t lastFrame)
+{
+  AppleDisplay *display = (AppleDisplay *)g_vm->vmdisplay;
+  uint64_t start = nanosNow();
+  while (1) {
+    usleep(FRAMEPOLLUSECS);
+    if (!unthrottled && display->frameCount() != lastFrame)
+      return;
+    if (nanosNow() - start >= HOSTFRAMEUSECS * 1000ULL)
+      return;
+  }
+}
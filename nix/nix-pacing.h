@@ -0,0 +1,39 @@
+#ifndef __NIXPACING_H
+#define __NIXPACING_H
+
+#include <stdint.h>
+
+// How the *nix hosts keep time: the CPU thread's real-time pacing, the
+// unthrottled modes, and napping through the guest's idle loops; and
+// the display thread's wait for the next frame.
+
+// -u: run the CPU as fast as the host allows, instead of in real time
+extern bool freeRunning;
+
+// -t: also run unthrottled whenever a disk drive's motor is on, and
+// drop back to real time once it spins down
+extern bool diskTurbo;
+
+// Whether the CPU is currently running without real-time pacing
+extern volatile bool unthrottled;
+
+// Tie real time to the CPU's current cycle. Called before the CPU
+// starts, and whenever it's been stopped (for the BIOS, say);
+// pending device events stay where they are on the CPU's clock.
+void restartClock();
+
+// Called once per pass of the CPU loop. Returns true if it's time to
+// run the next batch of instructions, or false (after napping, if
+// there was time to kill) if the loop should go around again first.
+// The guest's idle polling is only skipped if canIdle is set.
+bool cpuReady(bool canIdle);
+
+// The display thread draws once per emulated frame: it naps until the
+// CPU reaches the next vertical blank, and then draws whatever is
+// newest - so if drawing falls behind, frames are skipped rather than
+// queued. It never waits longer than one 60Hz host frame, so the UI
+// and keyboard keep going while the guest is stopped, and when the CPU
+// is running unthrottled that's all it waits for.
+void waitForFrame(uint32_t lastFrame);
+
+#endif
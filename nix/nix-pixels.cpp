@@ -0,0 +1,188 @@
+#include "nix-pixels.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+void widenPixels2x2(uint8_t *row0, uint8_t *row1, const uint8_t *src, uint16_t count)
+{
+  uint16_t i = 0;
+
+#if defined(__AVX2__)
+  for (; i + 32 <= count; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    // unpack works within each 128-bit lane, so put source bytes 0-7
+    // and 8-15 in the low halves of the two lanes first
+    v = _mm256_permute4x64_epi64(v, 0xD8);
+    __m256i lo = _mm256_unpacklo_epi8(v, v); // pixels 0-15
+    __m256i hi = _mm256_unpackhi_epi8(v, v); // pixels 16-31
+    _mm256_storeu_si256((__m256i *)(row0 + i*2), lo);
+    _mm256_storeu_si256((__m256i *)(row0 + i*2 + 32), hi);
+    _mm256_storeu_si256((__m256i *)(row1 + i*2), lo);
+    _mm256_storeu_si256((__m256i *)(row1 + i*2 + 32), hi);
+  }
+#endif
+#if defined(__SSE2__)
+  for (; i + 16 <= count; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i lo = _mm_unpacklo_epi8(v, v);
+    __m128i hi = _mm_unpackhi_epi8(v, v);
+    _mm_storeu_si128((__m128i *)(row0 + i*2), lo);
+    _mm_storeu_si128((__m128i *)(row0 + i*2 + 16), hi);
+    _mm_storeu_si128((__m128i *)(row1 + i*2), lo);
+    _mm_storeu_si128((__m128i *)(row1 + i*2 + 16), hi);
+  }
+#endif
+
+  for (; i < count; i++) {
+    widenPixel2x2(row0 + i*2, row1 + i*2, src[i]);
+  }
+}
+
+// The SIMD lookups below hold the palette as one 16-byte table per
+// byte of the output pixel, and use pshufb to index all of them at once.
+
+void palettize32(uint32_t *dst, const uint8_t *src, const uint32_t *palette, uint16_t count)
+{
+  uint16_t i = 0;
+
+#if defined(__SSSE3__)
+  uint8_t tables[4][16];
+  for (uint8_t c=0; c<16; c++) {
+    for (uint8_t b=0; b<4; b++) {
+      tables[b][c] = palette[c] >> (b * 8);
+    }
+  }
+  const __m128i mask = _mm_set1_epi8(0x0F);
+
+#if defined(__AVX2__)
+  __m256i wt[4];
+  for (uint8_t b=0; b<4; b++) {
+    wt[b] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables[b]));
+  }
+  const __m256i wmask = _mm256_set1_epi8(0x0F);
+  for (; i + 32 <= count; i += 32) {
+    __m256i idx = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + i)), wmask);
+    __m256i b0 = _mm256_shuffle_epi8(wt[0], idx);
+    __m256i b1 = _mm256_shuffle_epi8(wt[1], idx);
+    __m256i b2 = _mm256_shuffle_epi8(wt[2], idx);
+    __m256i b3 = _mm256_shuffle_epi8(wt[3], idx);
+    __m256i lo01 = _mm256_unpacklo_epi8(b0, b1);
+    __m256i hi01 = _mm256_unpackhi_epi8(b0, b1);
+    __m256i lo23 = _mm256_unpacklo_epi8(b2, b3);
+    __m256i hi23 = _mm256_unpackhi_epi8(b2, b3);
+    // Each of these holds 4 pixels from each lane: p0-3 and p16-19, etc.
+    __m256i p0 = _mm256_unpacklo_epi16(lo01, lo23);
+    __m256i p4 = _mm256_unpackhi_epi16(lo01, lo23);
+    __m256i p8 = _mm256_unpacklo_epi16(hi01, hi23);
+    __m256i p12 = _mm256_unpackhi_epi16(hi01, hi23);
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute2x128_si256(p0, p4, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + i + 8), _mm256_permute2x128_si256(p8, p12, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + i + 16), _mm256_permute2x128_si256(p0, p4, 0x31));
+    _mm256_storeu_si256((__m256i *)(dst + i + 24), _mm256_permute2x128_si256(p8, p12, 0x31));
+  }
+#endif
+
+  __m128i t0 = _mm_loadu_si128((const __m128i *)tables[0]);
+  __m128i t1 = _mm_loadu_si128((const __m128i *)tables[1]);
+  __m128i t2 = _mm_loadu_si128((const __m128i *)tables[2]);
+  __m128i t3 = _mm_loadu_si128((const __m128i *)tables[3]);
+  for (; i + 16 <= count; i += 16) {
+    __m128i idx = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + i)), mask);
+    __m128i b0 = _mm_shuffle_epi8(t0, idx);
+    __m128i b1 = _mm_shuffle_epi8(t1, idx);
+    __m128i b2 = _mm_shuffle_epi8(t2, idx);
+    __m128i b3 = _mm_shuffle_epi8(t3, idx);
+    __m128i lo01 = _mm_unpacklo_epi8(b0, b1);
+    __m128i hi01 = _mm_unpackhi_epi8(b0, b1);
+    __m128i lo23 = _mm_unpacklo_epi8(b2, b3);
+    __m128i hi23 = _mm_unpackhi_epi8(b2, b3);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(lo01, lo23));
+    _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(lo01, lo23));
+    _mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpacklo_epi16(hi01, hi23));
+    _mm_storeu_si128((__m128i *)(dst + i + 12), _mm_unpackhi_epi16(hi01, hi23));
+  }
+#endif
+
+  for (; i < count; i++) {
+    dst[i] = palette[src[i] & 0x0F];
+  }
+}
+
+void palettize565(uint16_t *dst, const uint8_t *src, const uint16_t *palette, uint16_t count)
+{
+  uint16_t i = 0;
+
+#if defined(__SSSE3__)
+  uint8_t tables[2][16];
+  for (uint8_t c=0; c<16; c++) {
+    tables[0][c] = palette[c] & 0xFF;
+    tables[1][c] = palette[c] >> 8;
+  }
+  const __m128i mask = _mm_set1_epi8(0x0F);
+
+#if defined(__AVX2__)
+  __m256i wlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables[0]));
+  __m256i whi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables[1]));
+  const __m256i wmask = _mm256_set1_epi8(0x0F);
+  for (; i + 32 <= count; i += 32) {
+    __m256i idx = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + i)), wmask);
+    __m256i lo = _mm256_shuffle_epi8(wlo, idx);
+    __m256i hi = _mm256_shuffle_epi8(whi, idx);
+    __m256i p0 = _mm256_unpacklo_epi8(lo, hi); // p0-7 and p16-23
+    __m256i p8 = _mm256_unpackhi_epi8(lo, hi); // p8-15 and p24-31
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute2x128_si256(p0, p8, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + i + 16), _mm256_permute2x128_si256(p0, p8, 0x31));
+  }
+#endif
+
+  __m128i tlo = _mm_loadu_si128((const __m128i *)tables[0]);
+  __m128i thi = _mm_loadu_si128((const __m128i *)tables[1]);
+  for (; i + 16 <= count; i += 16) {
+    __m128i idx = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + i)), mask);
+    __m128i lo = _mm_shuffle_epi8(tlo, idx);
+    __m128i hi = _mm_shuffle_epi8(thi, idx);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi8(lo, hi));
+    _mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpackhi_epi8(lo, hi));
+  }
+#endif
+
+  for (; i < count; i++) {
+    dst[i] = palette[src[i] & 0x0F];
+  }
+}
+
+void copyRow(void *dst, const void *src, uint32_t bytes)
+{
+#if defined(__SSE2__)
+  uint8_t *d = (uint8_t *)dst;
+  const uint8_t *s = (const uint8_t *)src;
+
+  // Line up the destination, then stream whole 16-byte blocks past
+  // the cache
+  uint32_t head = (16 - ((uintptr_t)d & 15)) & 15;
+  if (head > bytes)
+    head = bytes;
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  bytes -= head;
+
+  while (bytes >= 16) {
+    _mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+    d += 16;
+    s += 16;
+    bytes -= 16;
+  }
+  memcpy(d, s, bytes);
+  _mm_sfence();
+#else
+  memcpy(dst, src, bytes);
+#endif
+}
@@ -0,0 +1,42 @@
+#ifndef __NIX_PIXELS_H
+#define __NIX_PIXELS_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Pixel pushing for the SDL and linuxfb display drivers.
+ *
+ * The VM draws in to an 8-bit buffer of color indexes (0-15), doubled
+ * in both directions; these turn runs of that in to host pixels. Each
+ * has a plain C version, plus SSE2, SSSE3 and AVX2 versions that are
+ * used when the compiler is targeting them (see HOSTARCH in the
+ * Makefile).
+ */
+
+// Writes 'count' source pixels twice each, across both row0 and row1
+void widenPixels2x2(uint8_t *row0, uint8_t *row1, const uint8_t *src, uint16_t count);
+
+// Looks up 'count' color indexes in a 16-entry palette
+void palettize32(uint32_t *dst, const uint8_t *src, const uint32_t *palette, uint16_t count);
+void palettize565(uint16_t *dst, const uint8_t *src, const uint16_t *palette, uint16_t count);
+
+// Copies a finished row out to video memory, bypassing the cache where
+// we can - the framebuffer is only ever written
+void copyRow(void *dst, const void *src, uint32_t bytes);
+
+// One- and two-pixel versions of widenPixels2x2, for cache*Pixel()
+static inline void widenPixel2x2(uint8_t *row0, uint8_t *row1, uint8_t c)
+{
+  uint8_t v[2] = { c, c };
+  memcpy(row0, v, 2);
+  memcpy(row1, v, 2);
+}
+
+static inline void widenPixelPair2x2(uint8_t *row0, uint8_t *row1, uint8_t a, uint8_t b)
+{
+  uint8_t v[4] = { a, a, b, b };
+  memcpy(row0, v, 4);
+  memcpy(row1, v, 4);
+}
+
+#endif
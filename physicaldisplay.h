@@ -35,7 +35,51 @@ class PhysicalDisplay {
 
   // Then the direct-pixel methods
   virtual void cachePixel(uint16_t x, uint16_t y, uint8_t color) = 0;
-  
+
+  // Bulk versions of the above, so a whole lores block, character or
+  // run of hires pixels is one call. These are written in terms of the
+  // per-pixel methods; drivers with a flat buffer should do better.
+
+  // A w x h rectangle of double-wide pixels
+  virtual void cacheDoubleWideFill(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t color) {
+    for (uint16_t y2=y; y2<y+h; y2++) {
+      for (uint16_t x2=x; x2<x+w; x2++) {
+	cacheDoubleWidePixel(x2, y2, color);
+      }
+    }
+  }
+
+  // 'count' double-wide pixels in a row, left to right
+  virtual void cacheDoubleWideRun(uint16_t x, uint16_t y, const uint8_t *colors, uint16_t count) {
+    for (uint16_t i=0; i<count; i++) {
+      cacheDoubleWidePixel(x+i, y, colors[i]);
+    }
+  }
+
+  // ... and the same at full width
+  virtual void cacheRun(uint16_t x, uint16_t y, const uint8_t *colors, uint16_t count) {
+    for (uint16_t i=0; i<count; i++) {
+      cachePixel(x+i, y, colors[i]);
+    }
+  }
+
+  // An 8-row glyph, 'width' pixels wide: bit n of rows[r] is pixel x+n
+  // on line y+r, drawn in 'fg' if it's set and 'bg' if it isn't
+  virtual void cacheDoubleWideGlyph(uint16_t x, uint16_t y, const uint8_t *rows, uint8_t width, uint8_t fg, uint8_t bg) {
+    for (uint8_t r=0; r<8; r++) {
+      for (uint8_t n=0; n<width; n++) {
+	cacheDoubleWidePixel(x+n, y+r, (rows[r] & (1<<n)) ? fg : bg);
+      }
+    }
+  }
+  virtual void cacheGlyph(uint16_t x, uint16_t y, const uint8_t *rows, uint8_t width, uint8_t fg, uint8_t bg) {
+    for (uint8_t r=0; r<8; r++) {
+      for (uint8_t n=0; n<width; n++) {
+	cachePixel(x+n, y+r, (rows[r] & (1<<n)) ? fg : bg);
+      }
+    }
+  }
+
  protected:
   char overlayMessage[40];
 };
@@ -0,0 +1,104 @@
+#ifdef PROFILER
+
+#include "profiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+Profiler g_profiler;
+
+static void dumpAtExit()
+{
+  g_profiler.dump("profile");
+}
+
+Profiler::Profiler()
+{
+  reset();
+  atexit(dumpAtExit);
+}
+
+void Profiler::reset()
+{
+  memset(counts, 0, sizeof(counts));
+  memset(cycleTotals, 0, sizeof(cycleTotals));
+  memset(mappedAt, 0, sizeof(mappedAt));
+}
+
+static const uint64_t *sortTotals;
+
+static int byCyclesDescending(const void *a, const void *b)
+{
+  uint64_t ca = sortTotals[*(const uint32_t *)a];
+  uint64_t cb = sortTotals[*(const uint32_t *)b];
+  if (ca == cb)
+    return 0;
+  return (ca < cb) ? 1 : -1;
+}
+
+// Writes <basename>.txt (the report) and <basename>.bin (the raw counters)
+bool Profiler::dump(const char *basename)
+{
+  char fn[256];
+
+  snprintf(fn, sizeof(fn), "%s.bin", basename);
+  FILE *f = fopen(fn, "wb");
+  if (!f) {
+    printf("Unable to write profile to %s\n", fn);
+    return false;
+  }
+  bool ok = (fwrite(counts, sizeof(counts), 1, f) == 1 &&
+	     fwrite(cycleTotals, sizeof(cycleTotals), 1, f) == 1);
+  fclose(f);
+  if (!ok) {
+    printf("Short write to %s\n", fn);
+    return false;
+  }
+
+  // Every address that ran at all, busiest first
+  uint32_t *order = (uint32_t *)malloc(sizeof(uint32_t) * PROFILEBANKS * 256);
+  if (!order)
+    return false;
+  uint32_t used = 0;
+  uint64_t totalCycles = 0;
+  for (uint32_t i=0; i<PROFILEBANKS * 256; i++) {
+    if (counts[i]) {
+      order[used++] = i;
+      totalCycles += cycleTotals[i];
+    }
+  }
+  sortTotals = cycleTotals;
+  qsort(order, used, sizeof(uint32_t), byCyclesDescending);
+
+  snprintf(fn, sizeof(fn), "%s.txt", basename);
+  f = fopen(fn, "w");
+  if (!f) {
+    printf("Unable to write profile to %s\n", fn);
+    free(order);
+    return false;
+  }
+  fprintf(f, "%llu cycles profiled at %u addresses\n\n",
+	  (unsigned long long)totalCycles, used);
+  fprintf(f, "bank   addr   instructions           cycles      %%\n");
+  for (uint32_t i=0; i<used; i++) {
+    uint32_t idx = order[i];
+    uint32_t bank = idx >> 8;
+    uint16_t addr = (bank < PROFILEPAGES ? mappedAt[bank] : bank - PROFILEPAGES) << 8 | (idx & 0xFF);
+    if (bank < PROFILEPAGES)
+      fprintf(f, "%4u", bank);
+    else
+      fprintf(f, "  io");
+    fprintf(f, "  $%04X  %12u  %15llu  %5.2f\n",
+	    addr, counts[idx], (unsigned long long)cycleTotals[idx],
+	    totalCycles ? 100.0 * cycleTotals[idx] / totalCycles : 0.0);
+  }
+  fclose(f);
+  free(order);
+
+  printf("Profile of %u addresses written to %s.txt and %s.bin\n",
+	 used, basename, basename);
+  return true;
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef __PROFILER_H
+#define __PROFILER_H
+
+#include <stdint.h>
+
+/* Per-address execution profile of guest code.
+ *
+ * Build with -DPROFILER to turn this on; without it, none of this is
+ * compiled in to the CPU. Every instruction adds its cycles to a
+ * counter for the address it ran from - keyed by the memory that was
+ * mapped there (the MMU's codePage()), so that the same address in
+ * main RAM, aux RAM, either language card bank or ROM is kept apart.
+ * Addresses the MMU won't name a page for (I/O, slot ROM) are counted
+ * by their CPU address instead.
+ *
+ * dump() writes a text report, busiest addresses first, and a flat
+ * binary file: PROFILEBANKS*256 uint32_t instruction counts followed by
+ * PROFILEBANKS*256 uint64_t cycle totals, in host byte order. Bank b
+ * below PROFILEPAGES is codePage() b; bank PROFILEPAGES+n is CPU page
+ * $n with no code page.
+ */
+
+#define PROFILEPAGES 1024
+#define PROFILEBANKS (PROFILEPAGES + 256)
+
+class Profiler {
+ public:
+  Profiler();
+
+  // Count one instruction run from 'pc', in code page 'page' (or
+  // NOCODEPAGE), that took 'cycles'
+  void record(uint16_t page, uint16_t pc, uint8_t cycles) {
+    uint32_t bank = (page < PROFILEPAGES) ? page : PROFILEPAGES + (pc >> 8);
+    uint32_t idx = (bank << 8) | (pc & 0xFF);
+    counts[idx]++;
+    cycleTotals[idx] += cycles;
+    mappedAt[bank] = pc >> 8;
+  }
+
+  void reset();
+  bool dump(const char *basename);
+
+ private:
+  uint32_t counts[PROFILEBANKS * 256];
+  uint64_t cycleTotals[PROFILEBANKS * 256];
+  uint8_t mappedAt[PROFILEBANKS]; // CPU page each bank last ran at
+};
+
+extern Profiler g_profiler;
+
+#endif
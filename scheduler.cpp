@@ -0,0 +1,109 @@
+#include "scheduler.h"
+
+#include <string.h>
+
+Scheduler::Scheduler()
+{
+  memset(deadline, 0, sizeof(deadline));
+  memset(handler, 0, sizeof(handler));
+  memset(handlerObj, 0, sizeof(handlerObj));
+  memset(heapPos, 0xFF, sizeof(heapPos));
+  count = 0;
+}
+
+void Scheduler::setHandler(uint8_t event, eventHandler_t h, void *obj)
+{
+  handler[event] = h;
+  handlerObj[event] = obj;
+}
+
+void Scheduler::schedule(uint8_t event, uint64_t when)
+{
+  if (event >= EVT_MAX)
+    return;
+
+  if (heapPos[event] == 0xFF) {
+    heap[count] = event;
+    heapPos[event] = count;
+    count++;
+    deadline[event] = when;
+    siftUp(heapPos[event]);
+    return;
+  }
+
+  // Already pending; move it
+  uint64_t old = deadline[event];
+  deadline[event] = when;
+  if (when < old)
+    siftUp(heapPos[event]);
+  else
+    siftDown(heapPos[event]);
+}
+
+void Scheduler::cancel(uint8_t event)
+{
+  if (event < EVT_MAX && heapPos[event] != 0xFF)
+    removeAt(heapPos[event]);
+}
+
+void Scheduler::fireEvents(uint64_t now)
+{
+  while (count && deadline[heap[0]] <= now) {
+    uint8_t event = heap[0];
+    removeAt(0);
+    // The handler is free to schedule this (or any other) event again
+    if (handler[event])
+      handler[event](handlerObj[event], event, deadline[event]);
+  }
+}
+
+void Scheduler::removeAt(uint8_t idx)
+{
+  uint8_t event = heap[idx];
+  count--;
+  if (idx != count) {
+    swap(idx, count);
+    // The event we moved in might belong on either side of idx
+    uint8_t moved = heap[idx];
+    siftUp(idx);
+    siftDown(heapPos[moved]);
+  }
+  heapPos[event] = 0xFF;
+}
+
+void Scheduler::siftUp(uint8_t idx)
+{
+  while (idx > 0) {
+    uint8_t parent = (idx - 1) / 2;
+    if (deadline[heap[parent]] <= deadline[heap[idx]])
+      break;
+    swap(idx, parent);
+    idx = parent;
+  }
+}
+
+void Scheduler::siftDown(uint8_t idx)
+{
+  while (1) {
+    uint8_t smallest = idx;
+    uint8_t l = idx * 2 + 1;
+    uint8_t r = l + 1;
+    if (l < count && deadline[heap[l]] < deadline[heap[smallest]])
+      smallest = l;
+    if (r < count && deadline[heap[r]] < deadline[heap[smallest]])
+      smallest = r;
+    if (smallest == idx)
+      break;
+    swap(idx, smallest);
+    idx = smallest;
+  }
+}
+
+void Scheduler::swap(uint8_t i, uint8_t j)
+{
+  uint8_t t = heap[i];
+  heap[i] = heap[j];
+  heap[j] = t;
+  heapPos[heap[i]] = i;
+  heapPos[heap[j]] = j;
+}
@@ -0,0 +1,77 @@
+#ifndef __SCHEDULER_H
+#define __SCHEDULER_H
+
+#include <stdint.h>
+
+/* Device deadlines on the CPU's cycle clock.
+ *
+ * Each event can be pending at most once; scheduling it again just
+ * moves its deadline. Pending events are kept in a small binary
+ * min-heap so the host loop only has to compare the cycle counter
+ * against the earliest deadline after each CPU batch.
+ */
+
+enum {
+  EVT_PADDLE0 = 0,
+  EVT_PADDLE1,
+  EVT_KEYREPEAT,
+  EVT_DISK1SPINDOWN,
+  EVT_DISK2SPINDOWN,
+  EVT_DISK1FLUSH,
+  EVT_DISK2FLUSH,
+  EVT_VBL,
+  EVT_MAX
+};
+
+#define NOEVENT 0xFFFFFFFFFFFFFFFFULL
+
+// Called with the object passed to setHandler(), the event that fired,
+// and the cycle it was scheduled for
+typedef void (*eventHandler_t)(void *obj, uint8_t event, uint64_t when);
+
+class Scheduler {
+ public:
+  Scheduler();
+
+  void setHandler(uint8_t event, eventHandler_t handler, void *obj);
+
+  void schedule(uint8_t event, uint64_t when);
+  void cancel(uint8_t event);
+  bool isPending(uint8_t event) { return heapPos[event] != 0xFF; }
+
+  uint64_t nextEvent() { return count ? deadline[heap[0]] : NOEVENT; }
+
+  // How many cycles the CPU can run, starting at 'now', before the next
+  // event is due - at least 1 and at most 'limit'
+  uint16_t runnableCycles(uint64_t now, uint16_t limit) {
+    uint64_t next = nextEvent();
+    if (next <= now)
+      return 1;
+    if (next - now < limit)
+      return next - now;
+    return limit;
+  }
+
+  // Fire every event that's due at or before 'now'
+  void runEvents(uint64_t now) {
+    if (count && deadline[heap[0]] <= now)
+      fireEvents(now);
+  }
+
+ private:
+  void fireEvents(uint64_t now);
+  void removeAt(uint8_t idx);
+  void siftUp(uint8_t idx);
+  void siftDown(uint8_t idx);
+  void swap(uint8_t i, uint8_t j);
+
+  uint64_t deadline[EVT_MAX];
+  eventHandler_t handler[EVT_MAX];
+  void *handlerObj[EVT_MAX];
+
+  uint8_t heap[EVT_MAX];    // pending events, earliest deadline first
+  uint8_t heapPos[EVT_MAX]; // where each event is in heap[]; 0xFF if idle
+  uint8_t count;
+};
+
+#endif
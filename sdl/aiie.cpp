@@ -14,21 +14,21 @@
 #include "appleui.h"
 #include "bios.h"
 #include "nix-prefs.h"
+#include "nix-pacing.h"
 #include "debugger.h"
 
 #include "globals.h"
 
-#include "timeutil.h"
+#ifdef PROFILER
+#include "profiler.h"
+#endif
 
-//#define SHOWFPS
 //#define SHOWPC
 //#define SHOWMEMPAGE
 
 BIOS bios;
 Debugger debugger;
 
-struct timespec nextInstructionTime, startTime;
-
 #define NB_ENABLE 1
 #define NB_DISABLE 0
 
@@ -41,6 +41,9 @@ char disk2name[256] = "\0";
 
 volatile bool wantSuspend = false;
 volatile bool wantResume = false;
+#if defined(PROFILER) || defined(MEMHEATMAP)
+volatile bool wantProfile = false;
+#endif
 
 volatile bool cpuDebuggerRunning = false;
 
@@ -56,6 +59,13 @@ void sigint_handler(int n)
   //  ((AppleVM*)g_vm)->disk6->disk[0]->dumpInfo();
 }
 
+#if defined(PROFILER) || defined(MEMHEATMAP)
+void sigusr1_handler(int n)
+{
+  wantProfile = true;
+}
+#endif
+
 void nonblock(int state)
 {
   struct termios ttystate;
@@ -92,8 +102,6 @@ void write(void *arg, uint16_t address, uint8_t v)
 }
 
 static void *cpu_thread(void *dummyptr) {
-  struct timespec currentTime;
-
 #if 0
   int policy;
   struct sched_param param;
@@ -102,10 +110,7 @@ static void *cpu_thread(void *dummyptr) {
   pthread_setschedparam(pthread_self(), policy, &param);
 #endif
     
-  _init_darwin_shim();
-  do_gettime(&startTime);
-      printf("Start time: %lu,%lu\n", startTime.tv_sec, startTime.tv_nsec);
-  do_gettime(&nextInstructionTime);
+  restartClock();
 
   printf("free-running\n");
 
@@ -122,6 +127,18 @@ static void *cpu_thread(void *dummyptr) {
       printf("BIOS block complete\n");
     }
 
+#if defined(PROFILER) || defined(MEMHEATMAP)
+    if (wantProfile) {
+#ifdef PROFILER
+      g_profiler.dump("profile");
+#endif
+#ifdef MEMHEATMAP
+      ((AppleMMU *)g_vm->getMMU())->dumpHeatmap("heatmap");
+#endif
+      wantProfile = false;
+    }
+#endif
+
     if (wantSuspend) {
       printf("CPU halted; suspending VM\n");
       g_vm->Suspend("suspend.vm");
@@ -137,41 +154,30 @@ static void *cpu_thread(void *dummyptr) {
       wantResume = false;
     }
 
-    do_gettime(&currentTime);
-
-    // Determine the next CPU runtime (nextInstructionTime)
-    timespec_add_cycles(&startTime, g_cpu->cycles, &nextInstructionTime);
-
-    // Sleep until the CPU is ready to run.
-
-    // tsSubtract doesn't return negatives; it bounds at zero. So if
-    // either result is zero then it's time to run something.
+    // Keys the host has queued (this can wake an idle CPU)
+    g_vm->getKeyboard()->processKeys();
 
-    struct timespec cpudiff = tsSubtract(nextInstructionTime, currentTime);
+    // The audio thread keeps its distance from here
+    g_speaker->maintainSpeaker(g_cpu->cycles, 0);
 
-    if (cpudiff.tv_sec > 0 || cpudiff.tv_nsec > 0) {
-      // Sleep until the it's ready and loop...
-      nanosleep(&cpudiff, NULL);
-      continue;
-    }
-
-    if (cpudiff.tv_sec == 0 && cpudiff.tv_nsec == 0) {
+    if (cpuReady(!debugger.active() && !send_rst)) {
       // Run the CPU; it's caught up to "real time"
 
-      uint8_t executed = 0;
+      uint16_t executed = 0;
       if (debugger.active()) {
 	// With the debugger running, we need to single-step through
 	// instructions.
 	executed = g_cpu->Run(1);
       } else {
 	// Otherwise we can run a bunch of instructions at once to
-	// save on the overhead.
-	executed = g_cpu->Run(24);
+	// save on the overhead. (Even more of them if we're not
+	// keeping real time.)
+	executed = g_cpu->Run(g_scheduler.runnableCycles(g_cpu->cycles, unthrottled ? 255 : 24));
       }
 
-      // The paddles need to be triggered in real-time on the CPU
-      // clock. That happens from the VM's CPU maintenance poller.
-      ((AppleVM *)g_vm)->cpuMaintenance(g_cpu->cycles);
+      // The paddles (and disk, and keyboard repeat) need to happen in
+      // real-time on the CPU clock.
+      g_scheduler.runEvents(g_cpu->cycles);
 
       if (debugger.active()) {
 	debugger.step();
@@ -218,7 +224,7 @@ int main(int argc, char *argv[])
   g_keyboard = new SDLKeyboard(g_vm->getKeyboard());
 
   // Now that the VM exists and it has created an MMU, we tell the CPU how to access memory through the MMU.
-  g_cpu->SetMMU(g_vm->getMMU());
+  g_cpu->SetMMU((AppleMMU *)g_vm->getMMU());
 
   // Now that all the virtual hardware is glued together, reset the VM
   g_vm->Reset();
@@ -230,16 +236,37 @@ int main(int argc, char *argv[])
   /* Load prefs & reset globals appropriately now */
   readPrefs();
 
-  if (argc >= 2) {
-    printf("Inserting disk %s\n", argv[1]);
-    ((AppleVM *)g_vm)->insertDisk(0, argv[1]);
-    strcpy(disk1name, argv[1]);
+  int ch;
+  while ((ch = getopt(argc, argv, "utl:")) != -1) {
+    switch (ch) {
+    case 'u':
+      printf("Running at unlimited speed\n");
+      freeRunning = true;
+      break;
+    case 't':
+      printf("Running at unlimited speed while a disk is spinning\n");
+      diskTurbo = true;
+      break;
+    case 'l':
+      // audio latency, in milliseconds
+      ((SDLSpeaker *)g_speaker)->setLatency(atoi(optarg));
+      break;
+    default:
+      printf("Usage: %s [-u] [-t] [-l latency-ms] [disk1 [disk2]]\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  if (optind < argc) {
+    printf("Inserting disk %s\n", argv[optind]);
+    ((AppleVM *)g_vm)->insertDisk(0, argv[optind]);
+    strcpy(disk1name, argv[optind]);
   }
 
-  if (argc == 3) {
-    printf("Inserting disk %s\n", argv[2]);
-    ((AppleVM *)g_vm)->insertDisk(1, argv[2]);
-    strcpy(disk2name, argv[2]);
+  if (optind + 1 < argc) {
+    printf("Inserting disk %s\n", argv[optind+1]);
+    ((AppleVM *)g_vm)->insertDisk(1, argv[optind+1]);
+    strcpy(disk2name, argv[optind+1]);
   }
 
   // FIXME: fixed test disk...
@@ -248,6 +275,9 @@ int main(int argc, char *argv[])
   nonblock(NB_ENABLE);
 
   signal(SIGINT, sigint_handler);
+#if defined(PROFILER) || defined(MEMHEATMAP)
+  signal(SIGUSR1, sigusr1_handler);
+#endif
   signal(SIGPIPE, SIG_IGN); // debugger might have a SIGPIPE happen if the remote end drops
 
   printf("creating CPU thread\n");
@@ -258,7 +288,7 @@ int main(int argc, char *argv[])
 
   g_speaker->begin();
 
-  uint32_t lastCycleCount = -1;
+  uint64_t lastCycleCount = -1;
   while (1) {
 
     if (g_biosInterrupt) {
@@ -276,24 +306,21 @@ int main(int argc, char *argv[])
 
       g_biosInterrupt = false;
 
-      // clear the CPU next-step counters
-      g_cpu->cycles = 0;
-      do_gettime(&startTime);
-      do_gettime(&nextInstructionTime);
+      // restart the clock
+      restartClock();
 
-      // FIXME: drain whatever's in the speaker queue
+      // (the speaker throws away what it had queued while the BIOS
+      // was up)
 
-      /* FIXME
-      // Force the display to redraw
+      // The BIOS drew over the screen; redraw all of it
       ((AppleDisplay*)(g_vm->vmdisplay))->modeChange();
-      */
 
       // Poll the keyboard before we start, so we can do selftest on startup
       g_keyboard->maintainKeyboard();
     }
 
 
-    static uint32_t usleepcycles = 16384*4; // step-down for display drawing. Dynamically updated based on FPS calculations.
+    uint32_t frame = ((AppleDisplay *)g_vm->vmdisplay)->frameCount();
 
     if (g_vm->vmdisplay->needsRedraw()) {
       AiieRect what = g_vm->vmdisplay->getDirtyRect();
@@ -311,33 +338,7 @@ int main(int argc, char *argv[])
 
     g_ui->drawPercentageUIElement(UIePowerPercentage, 100);
 
-    // calculate FPS & dynamically step up/down as necessary
-    static time_t startAt = time(NULL);
-    static uint32_t loopCount = 0;
-    loopCount++;
-    uint32_t lenSecs = time(NULL) - startAt;
-    if (lenSecs >= 5) {
-      float fps = loopCount / lenSecs;
-
-#ifdef SHOWFPS
-      char buf[25];
-      sprintf(buf, "%f FPS [delay %u]", fps, usleepcycles);
-      g_display->debugMsg(buf);
-#endif
-
-      if (fps > 30 && usleepcycles < 0x3FFFFFFF) {
-	usleepcycles *= 2;
-      } else if (fps < 20 && usleepcycles > 0xF) {
-	usleepcycles /= 2;
-      }
-
-      // reset the counter & we'll adjust again in 5 seconds
-      loopCount = 0;
-      startAt = time(NULL);
-    }
-    if (usleepcycles >= 2) {
-      usleep(usleepcycles);
-    }
+    waitForFrame(frame);
 
 #ifdef SHOWPC
     {
@@ -409,7 +410,7 @@ void doDebugging()
     g_display->debugMsg(buf);
     break;
   case D_SHOWCYCLES:
-    sprintf(buf, "%X", g_cpu->cycles);
+    sprintf(buf, "%llX", (unsigned long long)g_cpu->cycles);
     g_display->debugMsg(buf);
     break;
     /*
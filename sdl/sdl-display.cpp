@@ -1,5 +1,6 @@
 #include <ctype.h> // isgraph
 #include "sdl-display.h"
+#include "nix-pixels.h"
 
 #include "bios-font.h"
 #include "images.h"
@@ -31,9 +32,28 @@ const uint8_t loresPixelColors[16][3] = { { 0, 0, 0 }, // black
 					  { 255, 255, 255 } // white
 };
 
+// Work out the ARGB value of every color index in every display
+// type, so blit() is just a table lookup per pixel
+void SDLDisplay::buildPalettes()
+{
+  for (uint8_t i=0; i<16; i++) {
+    uint8_t r = loresPixelColors[i][0];
+    uint8_t g = loresPixelColors[i][1];
+    uint8_t b = loresPixelColors[i][2];
+    uint8_t fv = 0.2125 * r + 0.7154 * g + 0.0721 * b;
+
+    palettes[m_blackAndWhite][i] = 0xFF000000 | (fv << 16) | (fv << 8) | fv;
+    palettes[m_monochrome][i] = 0xFF000000 | (fv << 8);
+    palettes[m_ntsclike][i] = 0xFF000000 | (r << 16) | (g << 8) | b;
+    palettes[m_perfectcolor][i] = palettes[m_ntsclike][i];
+  }
+}
+
 SDLDisplay::SDLDisplay()
 {
   memset(videoBuffer, 0, sizeof(videoBuffer));
+  memset(frameBuffer, 0, sizeof(frameBuffer));
+  buildPalettes();
 
   // FIXME: abstract constants
   screen = SDL_CreateWindow("Aiie!",
@@ -48,10 +68,21 @@ SDLDisplay::SDLDisplay()
   SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255); // set to white
   SDL_RenderClear(renderer); // clear it to the selected color
   SDL_RenderPresent(renderer); // perform the render
+
+  // The VM area goes up as one texture per frame, rather than a point
+  // at a time
+  vmTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+				SDL_TEXTUREACCESS_STREAMING,
+				SDLDISPLAY_VMWIDTH, SDLDISPLAY_VMHEIGHT);
+  if (!vmTexture) {
+    printf("Unable to create VM texture: %s\n", SDL_GetError());
+  }
 }
 
 SDLDisplay::~SDLDisplay()
 {
+  if (vmTexture)
+    SDL_DestroyTexture(vmTexture);
   SDL_Quit();
 }
 
@@ -98,28 +129,31 @@ void SDLDisplay::blit(AiieRect r)
   // not the border. We don't support updating the border *except* by
   // drawing directly to the screen device...
 
-  for (uint16_t y=r.top*2; y<r.bottom*2; y++) {
-    for (uint16_t x=r.left*2; x<r.right*2; x++) {
-      uint8_t colorIdx = videoBuffer[y*SDLDISPLAY_WIDTH+x];
-
-      uint8_t r, g, b;
-      r = loresPixelColors[colorIdx][0];
-      g = loresPixelColors[colorIdx][1];
-      b = loresPixelColors[colorIdx][2];
+  // r is inclusive: a change to one scanline has top == bottom
+  SDL_Rect dirty = { r.left*2, r.top*2,
+		     (r.right - r.left + 1)*2, (r.bottom - r.top + 1)*2 };
+  if (dirty.x + dirty.w > SDLDISPLAY_VMWIDTH)
+    dirty.w = SDLDISPLAY_VMWIDTH - dirty.x;
+  if (dirty.y + dirty.h > SDLDISPLAY_VMHEIGHT)
+    dirty.h = SDLDISPLAY_VMHEIGHT - dirty.y;
+
+  if (vmTexture && dirty.w > 0 && dirty.h > 0) {
+    const uint32_t *palette = palettes[g_displayType & 3];
+    for (int y=dirty.y; y<dirty.y+dirty.h; y++) {
+      palettize32(&frameBuffer[y*SDLDISPLAY_VMWIDTH + dirty.x],
+		  &videoBuffer[y*SDLDISPLAY_WIDTH + dirty.x],
+		  palette, dirty.w);
+    }
 
-      if (g_displayType == m_monochrome) {
-	float fv = 0.2125 * r + 0.7154 * g + 0.0721 * b;
-	r = b = 0;
-	g = fv;
-      }
-      else if (g_displayType == m_blackAndWhite) {
-	float fv = 0.2125 * r + 0.7154 * g + 0.0721 * b;
-	r = g = b = fv;
-      }
+    SDL_UpdateTexture(vmTexture, &dirty,
+		      &frameBuffer[dirty.y*SDLDISPLAY_VMWIDTH + dirty.x],
+		      SDLDISPLAY_VMWIDTH * sizeof(uint32_t));
 
-      SDL_SetRenderDrawColor(renderer, r, g, b, 255);
-      SDL_RenderDrawPoint(renderer, x+SCREENINSET_X, y+SCREENINSET_Y);
-    }
+    // The rest of the texture still holds the last frame, so copy all
+    // of it; the renderer keeps whatever UI is drawn outside it
+    SDL_Rect where = { SCREENINSET_X, SCREENINSET_Y,
+		       SDLDISPLAY_VMWIDTH, SDLDISPLAY_VMHEIGHT };
+    SDL_RenderCopy(renderer, vmTexture, NULL, &where);
   }
 
   if (overlayMessage[0]) {
@@ -234,26 +268,60 @@ void SDLDisplay::cachePixel(uint16_t x, uint16_t y, uint8_t color)
 // "DoubleWide" means "please double the X because I'm in low-res width mode"
 void SDLDisplay::cacheDoubleWidePixel(uint16_t x, uint16_t y, uint8_t color)
 {
-  videoBuffer[y*2*SDLDISPLAY_WIDTH+x*2] = color;
-  videoBuffer[y*2*SDLDISPLAY_WIDTH+x*2+1] = color;
-
-  videoBuffer[(y*2+1)*SDLDISPLAY_WIDTH+x*2] = color;
-  videoBuffer[(y*2+1)*SDLDISPLAY_WIDTH+x*2+1] = color;
+  widenPixel2x2(&videoBuffer[y*2*SDLDISPLAY_WIDTH+x*2],
+		&videoBuffer[(y*2+1)*SDLDISPLAY_WIDTH+x*2],
+		color);
 }
 
 void SDLDisplay::cache2DoubleWidePixels(uint16_t x, uint16_t y, uint8_t colorB, uint8_t colorA)
 {
-  videoBuffer[y*2*SDLDISPLAY_WIDTH+x*2] = colorA;
-  videoBuffer[y*2*SDLDISPLAY_WIDTH+x*2+1] = colorA;
+  widenPixelPair2x2(&videoBuffer[y*2*SDLDISPLAY_WIDTH+x*2],
+		    &videoBuffer[(y*2+1)*SDLDISPLAY_WIDTH+x*2],
+		    colorA, colorB);
+}
+
+// The bulk versions write straight in to videoBuffer, a row (and its
+// doubled twin) at a time
 
-  videoBuffer[y*2*SDLDISPLAY_WIDTH+x*2+2] = colorB;
-  videoBuffer[y*2*SDLDISPLAY_WIDTH+x*2+3] = colorB;
+void SDLDisplay::cacheDoubleWideFill(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t color)
+{
+  for (uint16_t y2=y; y2<y+h; y2++) {
+    memset(&videoBuffer[y2*2*SDLDISPLAY_WIDTH+x*2], color, w*2);
+    memset(&videoBuffer[(y2*2+1)*SDLDISPLAY_WIDTH+x*2], color, w*2);
+  }
+}
 
-  videoBuffer[(y*2+1)*SDLDISPLAY_WIDTH+x*2] = colorA;
-  videoBuffer[(y*2+1)*SDLDISPLAY_WIDTH+x*2+1] = colorA;
+void SDLDisplay::cacheDoubleWideRun(uint16_t x, uint16_t y, const uint8_t *colors, uint16_t count)
+{
+  widenPixels2x2(&videoBuffer[y*2*SDLDISPLAY_WIDTH+x*2],
+		 &videoBuffer[(y*2+1)*SDLDISPLAY_WIDTH+x*2],
+		 colors, count);
+}
 
-  videoBuffer[(y*2+1)*SDLDISPLAY_WIDTH+x*2+2] = colorB;
-  videoBuffer[(y*2+1)*SDLDISPLAY_WIDTH+x*2+3] = colorB;
+void SDLDisplay::cacheRun(uint16_t x, uint16_t y, const uint8_t *colors, uint16_t count)
+{
+  memcpy(&videoBuffer[y*2*SDLDISPLAY_WIDTH+x], colors, count);
+  memcpy(&videoBuffer[(y*2+1)*SDLDISPLAY_WIDTH+x], colors, count);
 }
 
+void SDLDisplay::cacheDoubleWideGlyph(uint16_t x, uint16_t y, const uint8_t *rows, uint8_t width, uint8_t fg, uint8_t bg)
+{
+  uint8_t pixels[8];
+  for (uint8_t r=0; r<8; r++) {
+    for (uint8_t n=0; n<width; n++) {
+      pixels[n] = (rows[r] & (1<<n)) ? fg : bg;
+    }
+    cacheDoubleWideRun(x, y+r, pixels, width);
+  }
+}
 
+void SDLDisplay::cacheGlyph(uint16_t x, uint16_t y, const uint8_t *rows, uint8_t width, uint8_t fg, uint8_t bg)
+{
+  uint8_t pixels[8];
+  for (uint8_t r=0; r<8; r++) {
+    for (uint8_t n=0; n<width; n++) {
+      pixels[n] = (rows[r] & (1<<n)) ? fg : bg;
+    }
+    cacheRun(x, y+r, pixels, width);
+  }
+}
@@ -12,6 +12,10 @@
 #define SDLDISPLAY_WIDTH (320*2)
 #define SDLDISPLAY_HEIGHT (240*2)
 
+// The part of the window that the VM draws in to
+#define SDLDISPLAY_VMWIDTH 560
+#define SDLDISPLAY_VMHEIGHT 384
+
 class SDLDisplay : public PhysicalDisplay {
  public:
   SDLDisplay();
@@ -37,12 +41,26 @@ class SDLDisplay : public PhysicalDisplay {
   virtual void cacheDoubleWidePixel(uint16_t x, uint16_t y, uint8_t color);
   virtual void cache2DoubleWidePixels(uint16_t x, uint16_t y, uint8_t colorA, uint8_t colorB);
 
+  virtual void cacheDoubleWideFill(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t color);
+  virtual void cacheDoubleWideRun(uint16_t x, uint16_t y, const uint8_t *colors, uint16_t count);
+  virtual void cacheRun(uint16_t x, uint16_t y, const uint8_t *colors, uint16_t count);
+  virtual void cacheDoubleWideGlyph(uint16_t x, uint16_t y, const uint8_t *rows, uint8_t width, uint8_t fg, uint8_t bg);
+  virtual void cacheGlyph(uint16_t x, uint16_t y, const uint8_t *rows, uint8_t width, uint8_t fg, uint8_t bg);
+
 
  private:
+  void buildPalettes();
+
   uint8_t videoBuffer[SDLDISPLAY_HEIGHT * SDLDISPLAY_WIDTH];
 
+  // ARGB copy of the VM area, uploaded to vmTexture in blit()
+  uint32_t frameBuffer[SDLDISPLAY_VMHEIGHT * SDLDISPLAY_VMWIDTH];
+  // videoBuffer color index to ARGB, for each g_displayType
+  uint32_t palettes[4][16];
+
   SDL_Window *screen;
   SDL_Renderer *renderer;
+  SDL_Texture *vmTexture;
 };
 
 #endif
@@ -1,6 +1,6 @@
 #include "sdl-speaker.h"
-#include <pthread.h>
 #include <unistd.h>
+#include <atomic>
 
 extern "C"
 {
@@ -9,76 +9,131 @@ extern "C"
 };
 
 #include "globals.h"
-
-#include "timeutil.h"
-
-// FIXME: 4096 is the right value here, I'm just debugging
-#define SDLSIZE (4096)
+#include "spscring.h"
+#include "nix-blep.h"
+
+#define SPEAKERRATE 48000
+
+/* Rate control. The audio thread plays toggles a fixed time behind the
+ * CPU (targetLag); since the host's audio clock and the CPU's pacing
+ * never quite agree, it watches how far behind it really is, and
+ * stretches or squeezes the cycles-per-sample ratio to hold that
+ * steady. If it ever drifts out of range anyway, it just jumps back.
+ */
+#define LAGSMOOTHING 0.05  // how much each callback's lag reading counts
+#define RATEKP 1.0         // ratio change per second of lag error
+#define RATEKI 2.0         // ... and per second-squared of it, integrated
+#define MAXRATEADJUST 0.005
+// Output swing for one speaker toggle (toggles queue 0/127)
+#define SPEAKERSTEP (12000.0f / 127.0f)
+
+// One speaker toggle: the CPU cycle it happened on, and the level it
+// left the speaker at
+struct SpeakerEvent {
+  uint64_t cycle;
+  uint8_t level;
+};
 
 // FIXME: Globals; ick.
-static volatile uint32_t bufIdx = 0;
-static uint8_t soundBuf[44100];
-static pthread_mutex_t togmutex = PTHREAD_MUTEX_INITIALIZER;
-static struct timespec sdlEmptyTime, sdlStartTime;
-extern struct timespec startTime; // defined in aiie (main)
+static SPSCRing<SpeakerEvent, SPEAKERQUEUESIZE> speakerQueue;
+static std::atomic<uint64_t> cpuCycle(0); // where the CPU's got to
+static uint16_t latencyMs = SPEAKERLATENCY;
+static double targetLag; // seconds
+extern volatile bool unthrottled; // not keeping real time, so there's nothing to play
+
+// Where the audio thread has got to on the CPU's clock: the cycle the
+// next sample is for, and the level the speaker's at there. Only the
+// audio thread touches these.
+static double sampleCycle = 0;
+static uint8_t sampleLevel = 0;
+static BlepSynth synth;
+static bool resync = true;
+static double lagAverage; // cycles
+static double rateIntegral;
 
 static void audioCallback(void *unused, Uint8 *stream, int len)
 {
-  pthread_mutex_lock(&togmutex);
+  int16_t *out = (int16_t *)stream;
+  len /= sizeof(int16_t);
+
   if (g_biosInterrupt) {
     // While the BIOS is running, we don't put samples in the audio
-    // queue.
-    memset(stream, 0x80, len);
-    pthread_mutex_unlock(&togmutex);
+    // queue; and nothing from before it is worth playing after.
+    while (speakerQueue.peek())
+      speakerQueue.pop();
+    synth.reset();
+    resync = true;
+    memset(stream, 0, len * sizeof(int16_t));
     return;
   }
 
-  // calculate when the buffer will be empty again
-  do_gettime(&sdlEmptyTime);
-  timespec_add_us(&sdlEmptyTime, ((float)len * (float)1000000)/(float)44100, &sdlEmptyTime);
-  sdlEmptyTime = tsSubtract(sdlEmptyTime, sdlStartTime);
-
-  static uint8_t lastKnownSample = 0; // saved for when the apple is quiescent
-
-  if (bufIdx >= len) {
-    memcpy(stream, soundBuf, len);
-    lastKnownSample = stream[len-1];
-
-    if (bufIdx > len) {
-      // move the remaining data down
-      memcpy(soundBuf, &soundBuf[len], bufIdx - len + 1);
-      bufIdx -= len;
+  // Toggles are played back targetLag behind where the CPU is now, so
+  // there's always a whole callback's worth of them queued up by the
+  // time we need them
+  double cyclesPerSample = (double)g_speed / SPEAKERRATE;
+  double target = targetLag * g_speed;
+  double lag = (double)cpuCycle.load(std::memory_order_relaxed) - sampleCycle;
+
+  if (resync || lag < 0 || lag > 2 * target) {
+    // Just starting, or back from a stall or a stretch of running
+    // unthrottled; anything still queued from before is stale
+    sampleCycle += lag - target;
+    lagAverage = target;
+    rateIntegral = 0;
+    resync = false;
+
+    // Toggles from before the new position would all land on the
+    // first sample as one spurious step. Drop them, just keeping the
+    // level they leave the speaker at.
+    const SpeakerEvent *stale;
+    while ((stale = speakerQueue.peek()) && stale->cycle < sampleCycle) {
+      sampleLevel = stale->level;
+      speakerQueue.pop();
     }
   } else {
-    if (bufIdx) {
-      // partial buffer exists
-      memcpy(stream, soundBuf, bufIdx);
-
-      // and it's a partial underrun
-      memset(&stream[bufIdx], lastKnownSample, len-bufIdx);
-      bufIdx = 0;
-    } else {
-      // Total audio underrun. This is normal if nothing is toggling the
-      // speaker; we stay at the last known level.
-      memset(stream, lastKnownSample, len);
+    lagAverage += (lag - lagAverage) * LAGSMOOTHING;
+    double error = (lagAverage - target) / g_speed;
+    rateIntegral += error * len / SPEAKERRATE;
+    double adjust = RATEKP * error + RATEKI * rateIntegral;
+    if (adjust > MAXRATEADJUST) adjust = MAXRATEADJUST;
+    if (adjust < -MAXRATEADJUST) adjust = -MAXRATEADJUST;
+    // Falling behind means playing more cycles per sample
+    cyclesPerSample *= 1.0 + adjust;
+  }
+
+  const SpeakerEvent *e = speakerQueue.peek();
+
+  // Each toggle becomes a band-limited step at its exact (fractional)
+  // sample position. With nothing left to play, the output settles
+  // back to silence: it's normal for nothing to be toggling the
+  // speaker.
+  while (len > 0) {
+    uint16_t count = (len > BLEPMAXBLOCK) ? BLEPMAXBLOCK : len;
+    double blockEnd = sampleCycle + count * cyclesPerSample;
+
+    synth.beginBlock(count);
+    while (e && e->cycle < blockEnd) {
+      if (e->level != sampleLevel) {
+	synth.addStep((e->cycle - sampleCycle) / cyclesPerSample,
+		      (e->level - sampleLevel) * SPEAKERSTEP);
+	sampleLevel = e->level;
+      }
+      speakerQueue.pop();
+      e = speakerQueue.peek();
     }
+    synth.endBlock(out);
+
+    sampleCycle = blockEnd;
+    out += count;
+    len -= count;
   }
-  pthread_mutex_unlock(&togmutex);
 }
 
-void ResetDCFilter(); // FIXME: remove
-
 SDLSpeaker::SDLSpeaker()
 {
   toggleState = false;
   mixerValue = 0x80;
 
-  pthread_mutex_init(&togmutex, NULL);
-
-  _init_darwin_shim();
-
-  ResetDCFilter();
-
   lastCycleCount = 0;
   lastSampleCount = 0;
 }
@@ -87,133 +142,67 @@ SDLSpeaker::~SDLSpeaker()
 {
 }
 
+void SDLSpeaker::setLatency(uint16_t ms)
+{
+  latencyMs = ms;
+}
+
 void SDLSpeaker::begin()
 {
-  do_gettime(&sdlStartTime);
-  do_gettime(&sdlEmptyTime);
-  sdlEmptyTime = tsSubtract(sdlEmptyTime, sdlStartTime);
+  // The device's own buffer is about a quarter of the latency (as a
+  // power of two); the rest is how far behind the CPU we play, which
+  // has to be at least a couple of those buffers.
+  uint16_t samples = SPEAKERMAXBUFFER;
+  while (samples > SPEAKERMINBUFFER && samples * 4000 > latencyMs * SPEAKERRATE)
+    samples /= 2;
+  double bufferTime = (double)samples / SPEAKERRATE;
+  targetLag = latencyMs / 1000.0 - bufferTime;
+  if (targetLag < 2 * bufferTime)
+    targetLag = 2 * bufferTime;
 
   SDL_AudioSpec audioDevice;
-  SDL_AudioSpec audioActual;
   SDL_memset(&audioDevice, 0, sizeof(audioDevice));
-  audioDevice.freq = 44100; // count of 8-bit samples
-  audioDevice.format = AUDIO_U8;
+  audioDevice.freq = SPEAKERRATE;
+  audioDevice.format = AUDIO_S16SYS;
   audioDevice.channels = 1;
-  audioDevice.samples = SDLSIZE; // SDLSIZE 8-bit samples @ 44100Hz: 4096 is about 1/10th second out of sync
+  audioDevice.samples = samples;
   audioDevice.callback = audioCallback;
   audioDevice.userdata = NULL;
 
-  memset(&soundBuf[0], 0, SDLSIZE);
-  bufIdx = SDLSIZE/2; // FIXME: why? Shouldn't this just be 0?
-
-  SDL_OpenAudio(&audioDevice, &audioActual); // FIXME retval
-  printf("Actual: freq %d channels %d samples %d\n", 
-	 audioActual.freq, audioActual.channels, audioActual.samples);
+  // No 'obtained' spec: SDL converts from this to whatever the
+  // hardware wants, so the callback always gets what it asked for
+  if (SDL_OpenAudio(&audioDevice, NULL) < 0) {
+    printf("ERROR: unable to open audio: %s\n", SDL_GetError());
+    return;
+  }
+  printf("Audio: freq %d channels %d samples %d, %.1fms behind the CPU\n",
+	 audioDevice.freq, audioDevice.channels, audioDevice.samples,
+	 targetLag * 1000);
   SDL_PauseAudio(0);
 }
 
-void SDLSpeaker::toggle(uint32_t c)
+void SDLSpeaker::toggle(uint64_t c)
 {
-  pthread_mutex_lock(&togmutex);
-
-  /* Figuring out what to do:
-   *
-   * The wallclock time we started the app is in startTime.
-   *
-   * The wallclock time when the SDL audio buffer will be totally
-   * drained is in sdlEmptyTime. When that time comes, we want to have
-   * at least SDLSIZE samples in soundBuf[] - which is currently filled
-   * to bufIdx samples.
-   * 
-   * So given the cycle number at which this toggle happened (c), we
-   * know we need to fill soundBuf[bufIdx..?] with either 0 or 127
-   * (adjusted for volume). The end of that area that we need to fill is 
-   * based on what time cycle 'c' refers to, 
-   *
-   * The wallclock time of cycle (c) is calculable from 
-   *   timespec_add_cycles(&startTime, c, &outputTime);
-   *
-   * And the point at which the SDL buffer will be drained is the same
-   * as the time at which soundBuf begins. So the difference between
-   * the two tells us where the end point is.
-   *
-   * Then we need to fill soundBuf[bufIdx .. endPoint] with that 0 or 127, 
-   * and set bufIdx = endPoint.
-   *
-   * Bonus: if it looks like we're not filling enough buffer, then we
-   * should tell the emulation layer above to run more cycles in bulk
-   * to build up more speaker backlog.
-   */
-
-  // calculate the timespec that refers to the cycle where this
-  // speaker toggle happened
-  struct timespec blipTime;
-  timespec_add_cycles(&startTime, c, &blipTime);
-  timespec_add_us(&blipTime, ((float)SDLSIZE * (float)1000000)/(float)44100, &blipTime); // it's delayed one SDL buffer naturally, and there's some drift between the start of the CPU and the start of the speaker. :/
-  
-  // determine how long there will be between the start of the buffer
-  // and that cycle time. (tsSubtract bounds at 0 and is never
-  // negative.)
-  struct timespec timeOffset = tsSubtract(blipTime, sdlEmptyTime);
-
-  // Turn that in to a sample index in the soundBuf[] buffer. There are 44100 of them per second,
-  // so this is straightforward
-  float newIdx = (float)timeOffset.tv_sec + ((float)timeOffset.tv_nsec / (float)NANOSECONDS_PER_SECOND);
-  newIdx *= 44100.0;
-
-  if (newIdx >= sizeof(soundBuf)) {
-    // Buffer overrun
-    printf("ERROR: buffer overrun, dropping data\n");
-    newIdx = sizeof(soundBuf)-1;
-  }
+  if (unthrottled)
+    return;
 
-  // Flip the toggle state
+  // Flip the toggle state, and pass it on to the audio thread with
+  // the cycle it happened on; audioCallback() works out which sample
+  // that is.
   toggleState = !toggleState;
 
-  // Fill from bufIdx .. newIdx and set bufIdx to newIdx when done
-  if (newIdx > bufIdx) {
-    long count = (long)newIdx - bufIdx;
-    memset(&soundBuf[bufIdx], toggleState ? 127 : 0, count);
-    bufIdx = newIdx;
-  } else {
-    // Why are we backtracking? This does happen, and it's a bug.
-    if (newIdx >= 1) {
-      bufIdx = newIdx-1;
-      long count = (long)newIdx - bufIdx;
-      memset(&soundBuf[bufIdx], toggleState ? 127 : 0, count);
-      bufIdx = newIdx;
-    } else {
-      // ... and it's zero?
-    }
-  }
-
-  pthread_mutex_unlock(&togmutex);
-}
-
-// FIXME: make methods
-uint16_t dcFilterState = 0;
-
-void ResetDCFilter()
-{
-  dcFilterState = 32768 + 10000;
-}
-
-int16_t DCFilter(int16_t in)
-{
-  if (dcFilterState == 0)
-    return 0;
-
-  if (dcFilterState >= 32768) {
-    dcFilterState--;
-    return in;
+  SpeakerEvent e = { c, (uint8_t)(toggleState ? 127 : 0) };
+  if (!speakerQueue.push(e)) {
+    // Buffer overrun
+    printf("ERROR: speaker queue full, dropping data\n");
   }
-
-  return ( (int32_t)in * (int32_t)dcFilterState-- ) / (int32_t)32768;
 }
 
-
-void SDLSpeaker::maintainSpeaker(uint32_t c, uint64_t microseconds)
+// Called from the CPU loop with the current cycle, so the audio thread
+// knows how far behind it is even when nothing's being played
+void SDLSpeaker::maintainSpeaker(uint64_t c, uint64_t microseconds)
 {
+  cpuCycle.store(c, std::memory_order_relaxed);
 }
 
 void SDLSpeaker::beginMixing()
@@ -5,7 +5,14 @@
 #include <stdint.h>
 #include "physicalspeaker.h"
 
-#define SPEAKERQUEUESIZE 1024
+#define SPEAKERQUEUESIZE 8192 // toggles; a power of two
+
+// Default time from a $C030 toggle to the sound coming out, in
+// milliseconds (see setLatency()), and the range of audio device
+// buffer sizes (in samples) used to get there
+#define SPEAKERLATENCY 40
+#define SPEAKERMINBUFFER 128
+#define SPEAKERMAXBUFFER 4096
 
 class SDLSpeaker : public PhysicalSpeaker {
  public:
@@ -13,9 +20,10 @@ class SDLSpeaker : public PhysicalSpeaker {
   virtual ~SDLSpeaker();
 
   virtual void begin();
+  void setLatency(uint16_t ms); // before begin()
 
-  virtual void toggle(uint32_t c);
-  virtual void maintainSpeaker(uint32_t c, uint64_t microseconds);
+  virtual void toggle(uint64_t c);
+  virtual void maintainSpeaker(uint64_t c, uint64_t microseconds);
   virtual void beginMixing();
   virtual void mixOutput(uint8_t v);
 
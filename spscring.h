@@ -0,0 +1,49 @@
+#ifndef __SPSCRING_H
+#define __SPSCRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+/* Lock-free FIFO between exactly one producer thread and one consumer
+ * thread. SIZE has to be a power of two.
+ *
+ * Each side only ever writes its own index, and publishes it with a
+ * release store after touching the slot, so neither side waits on the
+ * other: push() fails when the ring is full, and peek() returns NULL
+ * when it's empty.
+ */
+
+template <class T, uint32_t SIZE>
+class SPSCRing {
+ public:
+  SPSCRing() : head(0), tail(0) {}
+
+  // Producer side
+  bool push(const T &v) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == SIZE)
+      return false; // full
+    slots[h & (SIZE-1)] = v;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side: look at the oldest entry, then pop() it when done
+  const T *peek() {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire))
+      return NULL;
+    return &slots[t & (SIZE-1)];
+  }
+  void pop() {
+    tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+ private:
+  T slots[SIZE];
+  std::atomic<uint32_t> head; // next slot to write
+  std::atomic<uint32_t> tail; // next slot to read
+};
+
+#endif
@@ -0,0 +1 @@
+../cpu-threaded.h
\ No newline at end of file
@@ -0,0 +1 @@
+../scheduler.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../scheduler.h
\ No newline at end of file
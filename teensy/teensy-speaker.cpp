@@ -15,7 +15,7 @@ TeensySpeaker::~TeensySpeaker()
 {
 }
 
-void TeensySpeaker::toggle(uint32_t c)
+void TeensySpeaker::toggle(uint64_t c)
 {
   toggleState = !toggleState;
 
@@ -26,7 +26,7 @@ void TeensySpeaker::toggle(uint32_t c)
   analogWriteDAC0(mixerValue);
 }
 
-void TeensySpeaker::maintainSpeaker(uint32_t c, uint64_t runtimeInMicros)
+void TeensySpeaker::maintainSpeaker(uint64_t c, uint64_t runtimeInMicros)
 {
   // Nothing to do here. We can't run the speaker async, b/c not
   // enough CPU time. So we run the CPU close to sync and hope that
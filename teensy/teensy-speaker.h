@@ -10,8 +10,8 @@ class TeensySpeaker : public PhysicalSpeaker {
 
   virtual void begin() {};
 
-  virtual void toggle(uint32_t c);
-  virtual void maintainSpeaker(uint32_t c, uint64_t runtimeInMicros);
+  virtual void toggle(uint64_t c);
+  virtual void maintainSpeaker(uint64_t c, uint64_t runtimeInMicros);
 
   virtual void beginMixing();
   virtual void mixOutput(uint8_t v);
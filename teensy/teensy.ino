@@ -25,8 +25,10 @@
 #include "globals.h"
 #include "teensy-crash.h"
 
-uint32_t nextInstructionMicros;
-uint32_t startMicros;
+// These are on micros64()'s clock
+uint64_t nextInstructionMicros;
+uint64_t startMicros;
+uint64_t startCycles = 0; // the CPU cycle at startMicros
 
 BIOS bios;
 
@@ -35,6 +37,19 @@ BIOS bios;
 
 static   time_t getTeensy3Time() {  return Teensy3Clock.get(); }
 
+// micros() wraps every 71.6 minutes, which would stall the pacing in
+// runCPU(); this keeps a 64-bit count of its ticks instead. It has to
+// be called at least that often, which runCPU() does.
+static uint64_t micros64()
+{
+  static uint64_t total = 0;
+  static uint32_t last = 0;
+  uint32_t now = micros();
+  total += (uint32_t)(now - last);
+  last = now;
+  return total;
+}
+
 #define ESP_TXD 51
 #define ESP_CHPD 52
 #define ESP_RST 53
@@ -123,7 +138,7 @@ void setup()
   println("Reading prefs");
   readPrefs(); // read from eeprom and set anything we need setting
 
-  startMicros = nextInstructionMicros = micros();
+  startMicros = nextInstructionMicros = micros64();
 
   // Debugging: insert a disk on startup...
   //  ((AppleVM *)g_vm)->insertDisk(0, "/A2DISKS/UTIL/mock2dem.dsk", false);
@@ -188,10 +203,10 @@ void biosInterrupt()
     g_display->debugMsg("");
   }
 
-  // clear the CPU next-step counters
-  g_cpu->cycles = 0;
-  nextInstructionMicros = micros();
-  startMicros = micros();
+  // restart the clock; pending device events stay where they are
+  // on the CPU's cycle counter
+  startCycles = g_cpu->cycles;
+  startMicros = nextInstructionMicros = micros64();
   // Drain the speaker queue (FIXME: a little hacky)
   g_speaker->maintainSpeaker(-1, -1);
 
@@ -221,20 +236,31 @@ void runCPU()
   // cycles, b/c we're calling this interrupt (runCPU, that is) just
   // about 1/3 as fast as we should; and the speaker is updated
   // directly from within it, so it needs to be real-ish time.
-  if (micros() > nextInstructionMicros) {
+  uint64_t now = micros64();
+  if (now > nextInstructionMicros) {
     // Debugging: to watch when the CPU is triggered...
     //    static bool debugState = false;
     //    debugState = !debugState;
     //    digitalWrite(56, debugState);
     
-    uint8_t executed = g_cpu->Run(24);
+    // Keys loop() has queued (this can wake an idle CPU)
+    g_vm->getKeyboard()->processKeys();
+
+    if (g_cpu->idling) {
+      // The guest is only polling the keyboard or VBL. Rather than run
+      // its loop, let the clock catch up with real time (until a key
+      // wakes the CPU).
+      g_cpu->skipIdleCycles(startCycles + (uint64_t)((double)(now - startMicros) / (double)SPEEDCTL));
+    } else {
+      g_cpu->Run(g_scheduler.runnableCycles(g_cpu->cycles, 24));
+    }
 
     // The CPU of the Apple //e ran at 1.023 MHz. Adjust when we think
     // the next instruction should run based on how long the execution
     // was ((1000/1023) * numberOfCycles) - which is about 97.8%.
-    nextInstructionMicros = startMicros + ((double)g_cpu->cycles * (double)SPEEDCTL);
+    nextInstructionMicros = startMicros + ((double)(g_cpu->cycles - startCycles) * (double)SPEEDCTL);
 
-    ((AppleVM *)g_vm)->cpuMaintenance(g_cpu->cycles);
+    g_scheduler.runEvents(g_cpu->cycles);
   }
 
   g_inInterrupt = false;
@@ -357,7 +383,7 @@ void doDebugging()
     g_display->debugMsg(buf);
     break;
   case D_SHOWCYCLES:
-    sprintf(buf, "%lX", g_cpu->cycles);
+    sprintf(buf, "%lX", (uint32_t)g_cpu->cycles);
     g_display->debugMsg(buf);
     break;
   case D_SHOWBATTERY:
@@ -0,0 +1,45 @@
+#ifndef __TRIPLEBUFFER_H
+#define __TRIPLEBUFFER_H
+
+#include <stdint.h>
+#include <atomic>
+
+/* Lock-free handoff of whole buffers from one producer thread to one
+ * consumer thread, by index in to three buffers the caller owns.
+ *
+ * The producer always has a buffer of its own to fill (writeIndex());
+ * publish() swaps it with the shared middle slot. The consumer's
+ * acquire() swaps its own buffer with the middle one if something new
+ * has been published since, so it always gets the newest complete
+ * buffer and never waits. Buffers the consumer didn't get to in time
+ * are just dropped.
+ */
+
+class TripleBuffer {
+ public:
+  TripleBuffer() : back(0), front(1), middle(2) {}
+
+  // Producer side
+  uint8_t writeIndex() { return back; }
+  void publish() {
+    back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEXMASK;
+  }
+
+  // Consumer side: returns true if readIndex() changed
+  bool acquire() {
+    if (!(middle.load(std::memory_order_relaxed) & FRESH))
+      return false;
+    front = middle.exchange(front, std::memory_order_acq_rel) & INDEXMASK;
+    return true;
+  }
+  uint8_t readIndex() { return front; }
+
+ private:
+  enum { INDEXMASK = 0x03, FRESH = 0x04 };
+
+  uint8_t back;
+  uint8_t front;
+  std::atomic<uint8_t> middle; // index, plus FRESH if not yet acquired
+};
+
+#endif
@@ -0,0 +1,41 @@
+// cpu.cpp again, as the switch core and under other names, so it can
+// be linked in beside whichever core the harness itself was built with
+#undef THREADEDCPU
+#undef BLOCKCACHE
+#undef HOTBLOCKS
+#define Cpu RefCpu
+#define opcodes refOpcodes
+#include "../cpu.cpp"
+#undef Cpu
+
+#include "refcpu.h"
+
+static RefCpu refcpu;
+
+void refcpuStart(MMU *mmu, uint16_t pc)
+{
+  refcpu.SetMMU(mmu);
+  refcpu.rst();
+  refcpu.pc = pc;
+}
+
+void refcpuRun(uint16_t numSteps)
+{
+  refcpu.Run(numSteps);
+}
+
+void refcpuRealtime()
+{
+  refcpu.realtime();
+}
+
+void refcpuRegisters(refregs_t *r)
+{
+  r->pc = refcpu.pc;
+  r->sp = refcpu.sp;
+  r->a = refcpu.a;
+  r->x = refcpu.x;
+  r->y = refcpu.y;
+  r->flags = refcpu.flags;
+  r->cycles = refcpu.cycles;
+}
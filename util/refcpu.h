@@ -0,0 +1,27 @@
+#ifndef __REFCPU_H
+#define __REFCPU_H
+
+#include <stdint.h>
+
+class MMU;
+
+// The lockstep (-l) reference CPU for the test harness. It's the plain
+// decode-switch core from cpu.cpp, built on its own in refcpu.cpp, so
+// it shares no handlers (and no block cache) with the core under test.
+
+typedef struct {
+  uint16_t pc;
+  uint8_t sp;
+  uint8_t a;
+  uint8_t x;
+  uint8_t y;
+  uint8_t flags;
+  uint64_t cycles;
+} refregs_t;
+
+void refcpuStart(MMU *mmu, uint16_t pc);
+void refcpuRun(uint16_t numSteps);
+void refcpuRealtime();
+void refcpuRegisters(refregs_t *r);
+
+#endif
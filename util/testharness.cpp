@@ -7,47 +7,81 @@
 
 #include "cpu.h"
 #include "mmu.h"
+#include "testmmu.h"
+#include "refcpu.h"
 
 bool running = true;
 bool verbose = false;
 unsigned long startpc = 0x400;
 
-class TestMMU : public MMU {
-public:
-  TestMMU() {}
-  virtual ~TestMMU() {}
+class FileManager;
 
-  virtual void Reset() {}
+FileManager *g_filemanager = NULL;
+Cpu cpu;
+TestMMU mmu(&cpu);
 
-  virtual uint8_t read(uint16_t mem) { if (mem == 0xBFF0 || mem == 0xF001) { return 'R'; } return ram[mem];}
-  virtual void write(uint16_t mem, uint8_t val) {
-    if (mem == 0xBFF0 || mem == 0xF001) {printf("%c", val); return;} 
-    if (mem == 0x202 || mem == 0x200) {
-      if (val == 240) { printf("All tests successful!\n"); running = 0; }
-      printf("Start test %d\n", val);
-    }
-    ram[mem] = val;}
-  virtual uint8_t readDirect(uint16_t address, uint8_t fromPage) { return read(address);}
+// Lockstep mode runs the switch core (see refcpu.h) over its own copy
+// of memory and compares the two after every Run()
+bool lockstep = false;
+TestMMU refmmu(NULL, true);
 
-  virtual bool Serialize(int8_t fd) { return false; }
-  virtual bool Deserialize(int8_t fd) { return false; }
+struct timespec startTime;
 
-  uint8_t ram[65536];
-};
+// Report wall time and the effective emulated clock rate, so that
+// changes to the CPU core can be compared against each other.
+void reportSpeed()
+{
+  struct timespec endTime;
+  clock_gettime(CLOCK_MONOTONIC, &endTime);
+  double elapsed = (endTime.tv_sec - startTime.tv_sec) +
+    (endTime.tv_nsec - startTime.tv_nsec) / 1000000000.0;
+
+  printf("%.3f seconds, %llu cycles: %.2f emulated MHz\n",
+	 elapsed, (unsigned long long)cpu.cycles,
+	 elapsed > 0 ? cpu.cycles / elapsed / 1000000.0 : 0);
+}
 
-class FileManager;
+void lockstepFailed(const char *what, refregs_t *ref)
+{
+  printf("Lockstep mismatch (%s) after cycle %llu\n", what, (unsigned long long)ref->cycles);
+  printf("  cpu: PC $%.4X A $%.2X X $%.2X Y $%.2X SP $%.2X P $%.2X cycles %llu\n",
+	 cpu.pc, cpu.a, cpu.x, cpu.y, cpu.sp, cpu.flags, (unsigned long long)cpu.cycles);
+  printf("  ref: PC $%.4X A $%.2X X $%.2X Y $%.2X SP $%.2X P $%.2X cycles %llu\n",
+	 ref->pc, ref->a, ref->x, ref->y, ref->sp, ref->flags, (unsigned long long)ref->cycles);
+  exit(1);
+}
 
-FileManager *g_filemanager = NULL;
-Cpu cpu;
-TestMMU mmu;
+void lockstepCompare(bool withMemory)
+{
+  refregs_t ref;
+  refcpuRegisters(&ref);
+
+  if (cpu.pc != ref.pc || cpu.a != ref.a || cpu.x != ref.x ||
+      cpu.y != ref.y || cpu.sp != ref.sp || cpu.flags != ref.flags ||
+      cpu.cycles != ref.cycles) {
+    lockstepFailed("registers", &ref);
+  }
+  if (withMemory && memcmp(mmu.ram, refmmu.ram, sizeof(mmu.ram))) {
+    lockstepFailed("memory", &ref);
+  }
+}
 
 int main(int argc, char *argv[])
 {
   int ch;
   int fd = -1;
 
-  while ((ch = getopt(argc, argv, "f:vs:")) != -1) {
+  uint8_t runSteps = 1;
+
+  while ((ch = getopt(argc, argv, "f:vs:lr:")) != -1) {
     switch (ch) {
+    case 'l':
+      lockstep = true;
+      break;
+    case 'r':
+      // cycles per cpu.Run() call
+      runSteps = atoi(optarg);
+      break;
     case 's':
       if (optarg[0] == '0' &&
 	  optarg[1] == 'x') {
@@ -90,7 +124,12 @@ int main(int argc, char *argv[])
   cpu.pc = startpc;
   //  cpu.Reset();
 
-  time_t startTime = time(NULL);
+  if (lockstep) {
+    memcpy(refmmu.ram, mmu.ram, sizeof(refmmu.ram));
+    refcpuStart(&refmmu, startpc);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &startTime);
   // call cpu.Run() in the worst possible way (most overhead)
   for (uint32_t i=0; running && i<1000000000; i++) {
     if (cpu.pc == 0x453a) {
@@ -103,18 +142,26 @@ int main(int argc, char *argv[])
       // end of the decimal mode tests
       int result = mmu.read(0x0b);
       printf("Test complete. Result: %s\n", result ? "failed" : "passed");
+      reportSpeed();
       exit(result);
     }
 
-    cpu.Run(1);
-    
+    cpu.Run(runSteps);
+
+    if (lockstep) {
+      refcpuRun(runSteps);
+      // Memory compares are expensive; do them every so often
+      lockstepCompare((i & 0xFFF) == 0);
+    }
+
     if (verbose) {
-      printf("time %u PC $%.4X OP $%.2X mem200 #%d mem202 #%d X 0x%.2X Y 0x%.2X A 0x%.2X SP 0x%.2X Status 0x%.2X\n", cpu.cycles, cpu.pc, mmu.read(cpu.pc), mmu.read(0x200), mmu.read(0x202), cpu.x, cpu.y, cpu.a, cpu.sp, cpu.flags);
+      printf("time %llu PC $%.4X OP $%.2X mem200 #%d mem202 #%d X 0x%.2X Y 0x%.2X A 0x%.2X SP 0x%.2X Status 0x%.2X\n", (unsigned long long)cpu.cycles, cpu.pc, mmu.read(cpu.pc), mmu.read(0x200), mmu.read(0x202), cpu.x, cpu.y, cpu.a, cpu.sp, cpu.flags);
     }
   }
-  time_t endTime = time(NULL);
-
-  printf("%ld seconds\n", endTime - startTime);
+  if (lockstep) {
+    lockstepCompare(true);
+  }
+  reportSpeed();
   printf("Ending PC: 0x%X\n", cpu.pc);
   
 }
@@ -0,0 +1,70 @@
+#ifndef __TESTMMU_H
+#define __TESTMMU_H
+
+#include <stdio.h>
+
+#include "cpu.h"
+#include "mmu.h"
+#include "refcpu.h"
+
+extern bool running;
+
+// Each TestMMU knows which CPU is executing out of it, so it can tell
+// that CPU's block cache about writes. A 'reference' MMU is the one used
+// by the lockstep (-l) reference CPU (see refcpu.h) in place of a Cpu:
+// it's silent, never offers code pages, and sends every access through
+// read()/write().
+class TestMMU final : public MMU {
+public:
+  TestMMU(Cpu *c, bool isReference = false) {
+    cpu = c;
+    reference = isReference;
+    if (!reference) {
+      // Everything but the console I/O pages (and the test number
+      // writes to page 2) can bypass read()/write()
+      for (int i=0; i<256; i++) {
+	readPointers[i] = writePointers[i] = &ram[i << 8];
+	writeCodePages[i] = i;
+      }
+      readPointers[0xBF] = writePointers[0xBF] = NULL;
+      readPointers[0xF0] = writePointers[0xF0] = NULL;
+      writePointers[0x02] = NULL;
+    }
+  }
+  virtual ~TestMMU() {}
+
+  virtual void Reset() {}
+
+  virtual uint8_t read(uint16_t mem) { if (mem == 0xBFF0 || mem == 0xF001) { return 'R'; } return ram[mem];}
+  virtual void write(uint16_t mem, uint8_t val) {
+    if (mem == 0xBFF0 || mem == 0xF001) {if (!reference) printf("%c", val); return;}
+    if (mem == 0x202 || mem == 0x200) {
+      // Stop the CPU at the end of a test run, so batched Run()s don't
+      // carry on in to the final busy loop
+      if (val == 240) {
+	if (reference) refcpuRealtime(); else cpu->realtime();
+      }
+      if (!reference) {
+	if (val == 240) { printf("All tests successful!\n"); running = 0; }
+	printf("Start test %d\n", val);
+      }
+    }
+    ram[mem] = val;
+#ifdef BLOCKCACHE
+    if (!reference) cpu->invalidateCode(mem >> 8, mem & 0xFF);
+#endif
+  }
+  virtual uint8_t readDirect(uint16_t address, uint8_t fromPage) { return read(address);}
+
+  // The console I/O pages can't be cached as code
+  virtual uint16_t codePage(uint8_t hi) { return (reference || hi == 0xBF || hi == 0xF0) ? NOCODEPAGE : hi; }
+
+  virtual bool Serialize(int8_t fd) { return false; }
+  virtual bool Deserialize(int8_t fd) { return false; }
+
+  uint8_t ram[65536];
+  Cpu *cpu;
+  bool reference;
+};
+
+#endif
@@ -7,9 +7,12 @@ class VMKeyboard {
  public:
   virtual ~VMKeyboard() {}
 
+  // Called from the host's input thread; they only queue the key...
   virtual void keyDepressed(uint8_t k) = 0;
   virtual void keyReleased(uint8_t k) = 0;
-  virtual void maintainKeyboard(uint32_t cycleCount) = 0;
+  // ... and the CPU thread acts on what's queued here, before it
+  // runs any scheduler events
+  virtual void processKeys() = 0;
 };
 
 #endif
@@ -15,6 +15,9 @@ class VMRam {
   uint8_t readByte(uint32_t addr);
   void writeByte(uint32_t addr, uint8_t value);
 
+  // Host address of a 256-byte page, for the MMU's page tables
+  uint8_t *pagePointer(uint16_t page) { return &preallocatedRam[page << 8]; }
+
   bool Serialize(int8_t fd);
   bool Deserialize(int8_t fd);
 